@@ -1,4 +1,4 @@
-/* af_fontengine.h - v0.1.8
+/* af_fontengine.h - v0.1.9
 
 Api / Platform agnostic font rendering engine. (Comes with a builtin opengl 3 implmentation!)
 
@@ -76,6 +76,36 @@ Contributor list
 AnthoFoxo
 
 Recent version history:
+0.1.9 (unreleased)
+	utf8 decoding and line splitting use a vectorized ascii/newline fast path (sse2, avx2, neon)
+	embedded null characters no longer stop text drawing, `end` is always respected
+	added word wrapped paragraph layout with incremental updates after edits `affe_paragraph_*`
+	added line indexed append only documents which only draw visible lines `affe_document_*`
+	added deferred buffer flush control, draws are sorted and merged by pipeline key `affe_buffer_key`
+	added blend modes `affe_set_blend`
+	added recorders to lay out text on worker threads and merge it on the render thread `affe_recorder_*`
+	fonts, glyphs and atlas space can be shared between contexts `affe_cache_acquire`
+	fixed glyphs being lost when the atlas is invalidated while rasterizing
+	added glyph cache, atlas and draw counters per frame `affe_stats_get`, `affe_frame_end`
+	added headless null backend `af_fontengine_impl_null.h`, cmake project, benchmarks and tests
+	added software backend drawing into rgba8 images `af_fontengine_impl_soft.h`
+	added allocator callbacks `affe_context_create_info::allocator` and stb_truetype hooks `affe_stbtt_malloc`
+	glyphs are stored in pages and no longer move when more glyphs are cached
+	codepoints below `AFFE_DIRECT_GLYPHS` are looked up without hashing and kept pre-scaled for drawing
+	added styled text drawn in one batch `affe_text_draw_spans`
+	added clip rectangles `affe_set_clip`, text outside of the clip rectangle or viewport is culled before glyph lookup
+	added `affe_text_emit` writing text into caller memory in a chosen vertex format, `affe_glyph_get` and `affe_atlas_generation`
+	added outline, shadow and glow effects `affe_set_effect`, drawn in one pass by the OpenGL and software backends
+	added optional HarfBuzz shaping of complex scripts with `AFFE_HARFBUZZ`, shaped lines are cached per font and text
+	added C++ wrapper `af_fontengine.hpp` with `affe::basic_context` forwarding the procs to a backend class in a typed vertex format, `affe_text_quads`
+	added `affe_text_draw_int` and `affe_text_draw_float` drawing numbers from a per font digit table without formatting, optionally tabular
+	added `affe_set_bitmap_below` drawing small text from pixel aligned coverage bitmaps in the same atlas
+	added `affe_text_draw_batch` drawing many independent strings with one flush, laid out on `affe_batch_threads` threads
+	added optional trace zones with `AFFE_TRACE`, kept in a lock free ring buffer per context and written as chrome trace json `affe_trace_write`
+	added `affe_draw_cache` copying the vertices of text drawn unchanged from the last frame instead of laying it out again
+	added `AFFE_FLAGS_ATLAS_BC4` packing glyphs on 4x4 blocks, `affe_bc4_encode` and `affe_bc4_decode`, and `AFFE_OGL3_BC4` storing the opengl atlas compressed
+	added `affe_memory_get`, `affe_memory_trim` and `affe_context_create_info::memory_budget` keeping memory under a budget
+	quad vertices are written with vector stores (sse2, avx2, neon), glyphs keep normalized texture coordinates
 0.1.8 (2023-12-16)
 	opengl implmentation sets all needed state, now restores previous
 	added `affe_viewport` Sets the viewport when called, should be done anytime the surface changes size
@@ -122,7 +152,9 @@ Recent version history:
 #ifndef AF_FONTENGINE_H
 #define AF_FONTENGINE_H
 
-#define AFFE_VERSION 0.1.8
+#define AFFE_VERSION 0.1.9
+
+#include <stddef.h> // size_t in the allocator procs
 
 #ifndef NULL
 #	define NULL 0
@@ -154,6 +186,8 @@ extern "C" {
 #define AFFE_ERROR_STATES_UNDERFLOW 1
 #define AFFE_ERROR_STATES_OVERFLOW 2
 #define AFFE_ERROR_ATLAS_FULL 3
+// The context stayed over `memory_budget` after trimming, see `affe_memory_trim`
+#define AFFE_ERROR_MEMORY_BUDGET 4
 
 // Horizontal alignment
 #define AFFE_ALIGN_LEFT (1 << 0)
@@ -163,14 +197,45 @@ extern "C" {
 // Controls how the buffer is flushed
 // Automatic: buffer never needs manually flushed
 // None: buffer must be manually flushed at the end of the frame
+// Deferred: like none, draws are sorted by pipeline key when flushed to merge draw calls
 #define AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC 0
 #define AFFE_BUFFER_FLUSH_CONTROL_NONE 1
+#define AFFE_BUFFER_FLUSH_CONTROL_DEFERRED 2
+
+// Blend modes
+#define AFFE_BLEND_ALPHA 0
+#define AFFE_BLEND_ADDITIVE 1
+
+// Number drawing flags, see `affe_text_draw_int`
+// Tabular: every digit takes the width of the widest digit, aligned by advance instead of ink so changing values don't move
+#define AFFE_NUMBER_TABULAR (1 << 0)
+
+// Vertex color types, see `affe_vertex_format`
+#define AFFE_COLOR_FLOAT 0
+#define AFFE_COLOR_RGBA8 1
 
-// Defined backend feature supprt, currently unused, primitive restart may be supported in the future
+// Pipeline keys, vertices with equal keys can be drawn with the same pipeline state
+// Keys sort by atlas page, then shader variant, then blend mode
+// The shader variant is the effect of the text, see `affe_buffer_effect`, or `AFFE_SHADER_COVERAGE`
+// See: `affe_buffer_key`
+#define AFFE_KEY_BLEND(key) ((key) & 0xFFu)
+#define AFFE_KEY_SHADER(key) (((key) >> 8) & 0xFFu)
+#define AFFE_KEY_PAGE(key) ((key) >> 16)
+#define AFFE_KEY_MAKE(page, shader, blend) (((unsigned int)(page) << 16) | ((unsigned int)(shader) << 8) | (unsigned int)(blend))
+
+// Shader variant of text drawn from coverage bitmaps, the atlas holds coverage instead of distance, see `affe_set_bitmap_below`
+#define AFFE_SHADER_COVERAGE 0xFFu
+
+// Defined backend feature supprt, primitive restart may be supported in the future
 #define AFFE_FLAGS_NONE 0
+// The backend stores the atlas as BC4 blocks, glyphs are packed and uploaded on whole 4x4 blocks, see `affe_bc4_encode`
+#define AFFE_FLAGS_ATLAS_BC4 1
 
 typedef struct affe_context affe_context;
 
+// Fonts, glyphs and atlas space, may be shared between contexts
+typedef struct affe_cache affe_cache;
+
 struct affe_vertex
 {
 	// TODO: change rgba floats to a single unsigned int, provide functions to easily convert between the two
@@ -179,6 +244,19 @@ struct affe_vertex
 
 typedef struct affe_vertex affe_vertex;
 
+// Memory functions used by the engine, set all or none of the procs
+// When none are set malloc, realloc and free are used.
+// Recorders allocate from the threads they are used on.
+struct affe_allocator
+{
+	void* user_ptr;
+	void*(*alloc_proc)(void* user_ptr, size_t size);
+	void*(*realloc_proc)(void* user_ptr, void* ptr, size_t size);
+	void(*free_proc)(void* user_ptr, void* ptr);
+};
+
+typedef struct affe_allocator affe_allocator;
+
 struct affe_context_create_info
 {
 	// Initial size of the cache
@@ -195,17 +273,94 @@ struct affe_context_create_info
 	// How many quads to allocate space for in the vertex buffer
 	long long buffer_quad_count;
 
-	// Currently unused
+	// Backend features, see `AFFE_FLAGS_NONE`
 	unsigned int flags;
 
 	// Rasterizer settings
 	float edge_value;
 	float size;
 	int padding;
+
+	// Glyph cache to share, NULL to create a new one. See `affe_cache_acquire`
+	// When set, the cache's size and rasterizer settings replace the ones above
+	affe_cache* cache;
+
+	// Memory functions, a shared cache keeps using the allocator of the context that created it
+	affe_allocator allocator;
+
+	// Bytes the context and its glyph cache may keep, 0 for no limit, checked by `affe_frame_end`
+	long long memory_budget;
 };
 
 typedef struct affe_context_create_info affe_context_create_info;
 
+struct affe_buffer_stats
+{
+	// Text draws recorded and draw calls issued by the last flush, the difference was merged
+	long long commands, draws;
+
+	// Totals since the context was created
+	long long total_commands, total_draws;
+};
+
+typedef struct affe_buffer_stats affe_buffer_stats;
+
+struct affe_stats
+{
+	// Glyph lookups that were found in the cache and lookups that had to rasterize
+	long long glyph_hits;
+	long long glyph_misses;
+
+	// Nanoseconds spent rasterizing glyphs
+	long long rasterize_time;
+
+	// Calls to `update_proc` and the number of pixels sent
+	long long update_calls;
+	long long update_bytes;
+
+	// Calls to `draw_proc` and the number of vertices sent
+	long long draw_calls;
+	long long draw_verts;
+
+	// Calls to `affe_cache_invalidate` affecting this context
+	long long invalidations;
+
+	// Text draws copied from the last frame and draws laid out and kept, see `affe_draw_cache`
+	long long draw_cache_hits;
+	long long draw_cache_misses;
+
+	// Atlas pixels in use and the atlas size, only the latest value is kept
+	long long atlas_used;
+	long long atlas_size;
+
+	// Calls to `affe_frame_end`
+	long long frames;
+};
+
+typedef struct affe_stats affe_stats;
+
+// Memory categories, see `affe_memory_get`
+#define AFFE_MEMORY_FONTS 0 // Fonts and the font data given to the engine
+#define AFFE_MEMORY_GLYPHS 1 // Glyph tables and shaped lines
+#define AFFE_MEMORY_PACKER 2 // Atlas packer nodes
+#define AFFE_MEMORY_VERTICES 3 // Vertex buffers, recorded commands, batch vertices and kept draws
+#define AFFE_MEMORY_STAGING 4 // Rasterizer scratch memory
+#define AFFE_MEMORY_OTHER 5 // Contexts, caches, states, threads and trace events
+#define AFFE_MEMORY_COUNT 6
+
+struct affe_memory
+{
+	// Bytes held by the context and its glyph cache per category, and their sum
+	long long bytes[AFFE_MEMORY_COUNT];
+	long long total;
+
+	// The context's `memory_budget`, and the frames that ended over it
+	long long budget;
+	long long trims;
+};
+
+typedef struct affe_memory affe_memory;
+
 // PUBLIC API
 
 // Create a new context, should be used by backends, look at your implmentation header for your create function
@@ -224,6 +379,13 @@ AFFE_API void* affe_user_ptr(affe_context* ctx);
 // if take_ownership is true, the engine will automatically free the data pointer with `free`
 AFFE_API int affe_font_add(affe_context* ctx, void* data, int index, bool take_ownership);
 
+// stb_truetype allocation hooks, rasterizer memory then comes from the cache's allocator and is reused between glyphs
+// Define these before including the stb_truetype implementation:
+// #define STBTT_malloc(size, user) affe_stbtt_malloc(size, user)
+// #define STBTT_free(ptr, user) affe_stbtt_free(ptr, user)
+AFFE_API void* affe_stbtt_malloc(size_t size, void* userdata);
+AFFE_API void affe_stbtt_free(void* ptr, void* userdata);
+
 // If a glyph cannot be found in a font, it will look through the fallback fonts to match a glyph
 AFFE_API int affe_font_fallback(affe_context* ctx, int base, int fallback);
 
@@ -241,8 +403,19 @@ AFFE_API void affe_state_clear(affe_context* ctx);
 AFFE_API void affe_viewport(affe_context* ctx, int width, int height);
 
 // Request the backend to clear glyph references, backend is allowed invalidate the cache texture
+// Every context sharing the cache is flushed
 AFFE_API void affe_cache_invalidate(affe_context* ctx);
 
+// Get the context's glyph cache and add a reference to it
+// Pass it through `affe_context_create_info::cache` to share fonts, glyphs and atlas space with another context.
+// Every context sharing a cache receives each glyph through its `update_proc`, glyphs are only rasterized once.
+// Contexts sharing a cache must be used from the same thread.
+AFFE_API affe_cache* affe_cache_acquire(affe_context* ctx);
+
+// Remove a reference from a cache, the cache is deleted with its last reference
+// Contexts hold their own reference
+AFFE_API void affe_cache_release(affe_cache* cache);
+
 
 // Set the current font size in pixels (relative to viewport size)
 AFFE_API void affe_set_size(affe_context* ctx, float size);
@@ -256,16 +429,57 @@ AFFE_API void affe_set_font(affe_context* ctx, int font);
 // Set current font alignment, one of: AFFE_ALIGN_LEFT, AFFE_ALIGN_CENTER, AFFE_ALIGN_RIGHT
 AFFE_API void affe_set_alignment(affe_context* ctx, int alignment);
 
+// Set current blend mode, one of: AFFE_BLEND_ALPHA, AFFE_BLEND_ADDITIVE
+AFFE_API void affe_set_blend(affe_context* ctx, int blend);
+
+// Effects evaluated from the distance field in the same pass as the text, lengths are in pixels
+// Effects can only reach into the glyph padding, larger values are clamped
+struct affe_effect
+{
+	float outline_width;
+	float outline_r, outline_g, outline_b, outline_a;
+
+	// Offset follows the viewport, y up
+	float shadow_x, shadow_y;
+	float shadow_softness;
+	float shadow_r, shadow_g, shadow_b, shadow_a;
+
+	// Fades out from the glyph edge
+	float glow_width;
+	float glow_r, glow_g, glow_b, glow_a;
+};
+
+typedef struct affe_effect affe_effect;
+
+// Set current effect, NULL removes it
+// The OpenGL and software backends draw effects, text written by `affe_text_emit` has none
+AFFE_API void affe_set_effect(affe_context* ctx, const affe_effect* effect);
+
+// Draw text smaller than `size` pixels from coverage bitmaps rasterized at the exact pixel size, 0 disables it and is the default
+// Bitmap glyphs are snapped to whole pixels and share the atlas with the distance field glyphs, one copy per size
+// Text with an effect and text written to caller memory always use the distance field
+AFFE_API void affe_set_bitmap_below(affe_context* ctx, float size);
+
+// Set the current clip rectangle in viewport space, glyphs crossing its edges are cut on the cpu so no scissor is needed
+// Text is always culled against the viewport given to `affe_viewport`
+AFFE_API void affe_set_clip(affe_context* ctx, float x, float y, float width, float height);
+
+// Remove the current clip rectangle
+AFFE_API void affe_reset_clip(affe_context* ctx);
+
 // Controls the behavior of buffer flushing.
 // `AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC` (default): Buffer is flushed at the end of text draws or when the buffer is filled.
 // `AFFE_BUFFER_FLUSH_CONTROL_NONE`: Buffer is only flushed when filled or manually via `affe_buffer_flush`.
+// `AFFE_BUFFER_FLUSH_CONTROL_DEFERRED`: As none, but draws are recorded and sorted by pipeline key when flushed,
+//     each key is drawn with one draw call. Text with different keys may be drawn out of submission order.
 // 
 // Notes: It is UB to use any other control value than listed above.
+// Changing to or from deferred control flushes the buffer.
 // See: `affe_buffer_flush`
 AFFE_API void affe_buffer_flush_control(affe_context* ctx, int control);
 
 // Flush the vertex buffer.
-// This is required at the end of each frame when buffer control is set to `AFFE_BUFFER_FLUSH_CONTROL_NONE`
+// This is required at the end of each frame when buffer control is set to `AFFE_BUFFER_FLUSH_CONTROL_NONE` or `AFFE_BUFFER_FLUSH_CONTROL_DEFERRED`
 //
 // See: `affe_buffer_flush_control`
 AFFE_API void affe_buffer_flush(affe_context* ctx);
@@ -275,6 +489,99 @@ AFFE_API void affe_buffer_flush(affe_context* ctx);
 // Can be used in callbacks to allocate the buffer for the backend
 AFFE_API long long affe_buffer_size(affe_context* ctx);
 
+// Used by backends
+// Get the pipeline key of the vertices passed to `draw_proc`, only valid during `draw_proc`
+// Use `AFFE_KEY_PAGE`, `AFFE_KEY_SHADER` and `AFFE_KEY_BLEND` to pick the pipeline state
+AFFE_API unsigned int affe_buffer_key(affe_context* ctx);
+
+// Used by backends
+// Get the effect of the vertices passed to `draw_proc`, only valid during `draw_proc`
+// Returns NULL for text without effects. Lengths are in atlas texels instead of pixels,
+// divide by the padding for distance field units.
+AFFE_API const affe_effect* affe_buffer_effect(affe_context* ctx);
+
+// Get how many text draws were merged into how many draw calls
+AFFE_API void affe_buffer_stats_get(affe_context* ctx, affe_buffer_stats* stats);
+
+// Mark the end of a frame, the counters of the frame become available through `affe_stats_get`
+AFFE_API void affe_frame_end(affe_context* ctx);
+
+// Get the counters of the last finished frame and the sum of all frames finished since the last reset, either may be null
+// Counters are zero when compiled with `AFFE_NO_STATS`
+AFFE_API void affe_stats_get(affe_context* ctx, affe_stats* frame, affe_stats* total);
+
+// Reset all counters
+AFFE_API void affe_stats_reset(affe_context* ctx);
+
+// Get the bytes held by the context and its glyph cache, paragraphs, documents and recorders are not included
+// A shared cache is counted by every context using it
+AFFE_API void affe_memory_get(affe_context* ctx, affe_memory* memory);
+
+// Free memory until the context holds at most `budget` bytes, returns the bytes held afterwards
+// Staging buffers are freed first, then shaped lines, kept draws, and last the glyph cache is invalidated and its tables freed
+// Called by `affe_frame_end` when over `memory_budget`, must not be called while a batch or deferred flush is running
+AFFE_API long long affe_memory_trim(affe_context* ctx, long long budget);
+
+// ----- tracing -----
+
+// Zones recorded when compiled with `AFFE_TRACE`
+#define AFFE_ZONE_RASTERIZE 0 // Glyph rasterization, value is the codepoint
+#define AFFE_ZONE_UPLOAD 1 // `update_proc`, value is the number of pixels
+#define AFFE_ZONE_DRAW 2 // `draw_proc`, value is the number of vertices
+#define AFFE_ZONE_FLUSH 3 // `affe_buffer_flush` with vertices, value is the number of draw calls
+#define AFFE_ZONE_INVALIDATE 4 // `affe_cache_invalidate`, value is the new atlas generation
+#define AFFE_ZONE_SHAPE 5 // HarfBuzz shaping of a line missing from the cache, value is the number of glyphs
+#define AFFE_ZONE_BATCH 6 // `affe_text_draw_batch`, value is the number of items
+#define AFFE_ZONE_LAYOUT 7 // One thread's part of a batch, value is the number of vertices
+#define AFFE_ZONE_SUBMIT 8 // `affe_recorder_submit`, value is the number of recorders
+#define AFFE_ZONE_FRAME 9 // `affe_frame_end`, recorded as an instant
+#define AFFE_ZONE_COUNT 10
+
+#define AFFE_TRACE_PHASE_BEGIN 0
+#define AFFE_TRACE_PHASE_END 1
+#define AFFE_TRACE_PHASE_INSTANT 2
+
+struct affe_trace_event
+{
+	int zone;
+	int phase;
+
+	// 0 for the calling thread, batch parts on worker threads use their part index
+	int thread;
+
+	// Nanoseconds from the timer, see `AFFE_TIMER_NOW`
+	long long time;
+
+	// Zone specific, only set on end and instant events
+	long long value;
+};
+
+typedef struct affe_trace_event affe_trace_event;
+
+// Called for every event as it is recorded, on the thread recording it
+typedef void(*affe_trace_proc)(void* user_ptr, const affe_trace_event* event);
+
+// Receives the trace as text, `data` is not null terminated
+typedef void(*affe_trace_write_proc)(void* user_ptr, const char* data, int size);
+
+// Forward events to an external profiler, proc may be null to stop
+// Events are still kept in the context's ring buffer of the last `AFFE_TRACE_EVENTS` events
+AFFE_API void affe_trace_callback(affe_context* ctx, affe_trace_proc proc, void* user_ptr);
+
+// Get the name of a zone, "unknown" for invalid zones
+AFFE_API const char* affe_trace_zone_name(int zone);
+
+// Copy up to capacity of the most recent events oldest first, returns the number copied
+// Events are always zero without `AFFE_TRACE`. Call while no batch is being laid out.
+AFFE_API int affe_trace_events(affe_context* ctx, affe_trace_event* events, int capacity);
+
+// Forget all recorded events
+AFFE_API void affe_trace_clear(affe_context* ctx);
+
+// Write the recorded events as Chrome trace event JSON, as loaded by chrome://tracing and Perfetto
+// Times are microseconds since the context was created. Returns the number of events written.
+AFFE_API int affe_trace_write(affe_context* ctx, affe_trace_write_proc proc, void* user_ptr);
+
 // Draw some text!
 // Line endings will be respected
 // string is a pointer to the start of some text
@@ -286,6 +593,283 @@ AFFE_API void affe_text_draw(affe_context* ctx, float x, float y, const char* st
 // Line endings will **NOT** be respected
 AFFE_API void affe_text_draw_inline(affe_context* ctx, float x, float y, const char* string, const char* end);
 
+// Keep the vertices of `affe_text_draw` and `affe_text_draw_inline`, disabled by default
+// A call repeating a kept one with the same text, position, state, viewport and atlas generation copies its vertices
+// instead of laying the text out again. `affe_frame_end` must be called every frame, draws not repeated in a frame are dropped.
+// Disabling frees the kept draws.
+AFFE_API void affe_draw_cache(affe_context* ctx, bool enabled);
+
+// ----- numbers -----
+
+// Draw a number without formatting it into a string first, uses the current state like `affe_text_draw_inline`
+// Digits, sign and decimal point are looked up from a table kept per font for the size last drawn.
+// `flags` is 0 or `AFFE_NUMBER_TABULAR`. Bitmap sizes, and numbers whose glyphs do not fit the atlas together, are drawn as text without tabular digits.
+AFFE_API void affe_text_draw_int(affe_context* ctx, float x, float y, long long value, int flags);
+
+// `decimals` digits are drawn after the decimal point, clamped to 0 through 9
+// The value is rounded to nearest with halves away from zero, values rounding to zero are drawn without a sign
+// Not a number and infinities are drawn as "nan", "inf" and "-inf"
+AFFE_API void affe_text_draw_float(affe_context* ctx, float x, float y, double value, int decimals, int flags);
+
+// ----- styled text -----
+
+struct affe_text_style
+{
+	float size;
+	float r, g, b, a;
+	int font;
+};
+
+typedef struct affe_text_style affe_text_style;
+
+// Bytes [begin, end) of the string are drawn with `styles[style]`
+struct affe_text_span
+{
+	int begin, end;
+	int style;
+};
+
+typedef struct affe_text_span affe_text_span;
+
+// Draw text with the style changing between spans, line endings will be respected
+// Spans must be sorted and must not overlap, text outside of spans uses the current state.
+// Each line is aligned as a whole using the current state's alignment and advances by its tallest style.
+// All spans are written in one batch, in automatic flush control the buffer is flushed once.
+AFFE_API void affe_text_draw_spans(affe_context* ctx, float x, float y, const char* string, const char* end, const affe_text_style* styles, const affe_text_span* spans, int spans_count);
+
+// ----- caller memory -----
+
+// Layout of the vertices written by `affe_text_emit`
+struct affe_vertex_format
+{
+	// Bytes from the start of one vertex to the next
+	int stride;
+
+	// Byte offsets within a vertex, `AFFE_INVALID` leaves the attribute out
+	// position: float x, y. texcoord: float s, t, normalized. color: see `color_type`
+	int position;
+	int texcoord;
+	int color;
+
+	// `AFFE_COLOR_FLOAT` for float r, g, b, a or `AFFE_COLOR_RGBA8` for unsigned char r, g, b, a
+	int color_type;
+
+	// 6 for two triangles per quad, ordered as `draw_proc` receives them
+	// 4 for one vertex per corner for indexed drawing: bottom left, bottom right, top right, top left
+	int quad_vertices;
+};
+
+typedef struct affe_vertex_format affe_vertex_format;
+
+// A glyph at the current font and size
+struct affe_glyph_quad
+{
+	// Pixels from the pen position
+	float x0, y0, x1, y1;
+
+	// Normalized atlas coordinates of the corners at (x0, y0) and (x1, y1)
+	float s0, t0, s1, t1;
+
+	float advance;
+};
+
+typedef struct affe_glyph_quad affe_glyph_quad;
+
+// Write text into caller memory instead of the vertex buffer, `draw_proc` is not called
+// Text is laid out as `affe_text_draw` with the current state, culling and clipping included.
+// `verts` receives up to `capacity` quads of `format->quad_vertices` vertices each, `written` is set to the number of quads written.
+// Returns FALSE if `capacity` was too small, the quads that fit are still written.
+// Also returns FALSE without writing if `string` is NULL, `format->quad_vertices` is not 4 or 6 or `format->stride` is not positive.
+// Texture coordinates are valid until `affe_atlas_generation` changes.
+// If the atlas is invalidated while emitting, the text is emitted again. Returns FALSE with nothing written if it is invalidated a second time, the glyphs of the text do not fit the atlas together.
+AFFE_API int affe_text_emit(affe_context* ctx, float x, float y, const char* string, const char* end, const affe_vertex_format* format, void* verts, long long capacity, long long* written);
+
+// Number of quads `affe_text_emit` writes for the same text and state
+// Missing glyphs are rasterized, so the following `affe_text_emit` does not invalidate the atlas part way through
+AFFE_API long long affe_text_emit_count(affe_context* ctx, float x, float y, const char* string, const char* end);
+
+// Get a glyph of the current font at the current size, rasterizing it if needed
+// Returns FALSE if the glyph could not be rasterized
+AFFE_API int affe_glyph_get(affe_context* ctx, unsigned int codepoint, affe_glyph_quad* quad);
+
+// Incremented whenever the atlas is invalidated, text emitted before must be emitted again
+AFFE_API unsigned int affe_atlas_generation(affe_context* ctx);
+
+// A laid out glyph as `affe_text_quads` writes it
+struct affe_text_quad
+{
+	// Pixels, bottom left and top right corners
+	float x0, y0, x1, y1;
+
+	// Normalized atlas coordinates of the corners at (x0, y0) and (x1, y1)
+	float s0, t0, s1, t1;
+
+	float r, g, b, a;
+};
+
+typedef struct affe_text_quad affe_text_quad;
+
+// Like `affe_text_emit`, but writes one `affe_text_quad` per glyph without applying a vertex format, FALSE and `written` are set the same way
+// Meant for wrappers building vertices themselves, see `af_fontengine.hpp`
+AFFE_API int affe_text_quads(affe_context* ctx, float x, float y, const char* string, const char* end, affe_text_quad* quads, long long capacity, long long* written);
+
+// ----- paragraphs -----
+
+// A wrapped line of a paragraph
+struct affe_paragraph_line
+{
+	// Byte range of the line within the text, trailing whitespace and line breaks are excluded
+	int begin, end;
+
+	// Offset from the paragraph origin, `x` includes alignment, `y` grows down one line height per line
+	float x, y;
+
+	// Width of the line in pixels
+	float width;
+
+	// Offset the wrap read up to, the line depends on the text from `begin` to here
+	int scan_end;
+};
+
+typedef struct affe_paragraph_line affe_paragraph_line;
+
+// Retained word wrapped layout of some text
+typedef struct affe_paragraph affe_paragraph;
+
+// Create an empty paragraph, returns NULL on failure
+AFFE_API affe_paragraph* affe_paragraph_create(affe_context* ctx);
+
+// Delete a paragraph
+AFFE_API void affe_paragraph_delete(affe_context* ctx, affe_paragraph* paragraph);
+
+// Lay out text using the current font, size and alignment, lines wrap at `max_width` pixels
+// Lines break at whitespace, after hyphens and around cjk ideographs, words wider than a line are split
+// Line endings will be respected
+// Returns `TRUE` on success, on failure the previous layout is kept
+AFFE_API int affe_paragraph_layout(affe_context* ctx, affe_paragraph* paragraph, const char* string, const char* end, float max_width);
+
+// Update the layout after an edit, `removed` bytes at `offset` were replaced by `inserted` bytes
+// string is the full text after the edit, only lines around the edit are laid out again
+// Uses the settings from the last `affe_paragraph_layout` call
+// Returns `TRUE` on success, on failure the previous layout is kept
+AFFE_API int affe_paragraph_edit(affe_context* ctx, affe_paragraph* paragraph, const char* string, const char* end, int offset, int removed, int inserted);
+
+// Get the number of lines in the layout
+AFFE_API int affe_paragraph_line_count(affe_context* ctx, const affe_paragraph* paragraph);
+
+// Get the lines of the layout, the pointer is valid until the paragraph is laid out again
+AFFE_API const affe_paragraph_line* affe_paragraph_lines(affe_context* ctx, const affe_paragraph* paragraph);
+
+// Draw a paragraph, string must be the same text it was laid out with
+// The current state should match the state used during layout
+AFFE_API void affe_paragraph_draw(affe_context* ctx, const affe_paragraph* paragraph, float x, float y, const char* string);
+
+// ----- documents -----
+
+// Append only text with an index of line offsets, for very large or streaming text such as logs
+typedef struct affe_document affe_document;
+
+// Create an empty document, returns NULL on failure
+AFFE_API affe_document* affe_document_create(affe_context* ctx);
+
+// Delete a document
+AFFE_API void affe_document_delete(affe_context* ctx, affe_document* document);
+
+// Append text to the document, the text is copied and only new bytes are scanned for line breaks
+// crlf, cr and lf are all treated as a single line break, even when split between appends
+// Returns `TRUE` on success, on failure the document is unchanged
+AFFE_API int affe_document_append(affe_context* ctx, affe_document* document, const char* string, const char* end);
+
+// Remove all text from the document, keeps allocated memory for reuse
+AFFE_API void affe_document_clear(affe_context* ctx, affe_document* document);
+
+// Get the number of lines in the document, an empty document has one empty line
+AFFE_API long long affe_document_line_count(affe_context* ctx, const affe_document* document);
+
+// Get the text of a line, `end` receives the end of the line excluding the line break
+// Pointers are valid until the document is appended to
+AFFE_API const char* affe_document_line(affe_context* ctx, const affe_document* document, long long line, const char** end);
+
+// Draw the lines of the document which intersect the view rectangle, in viewport space
+// (x, y) is where the first line is drawn, as with `affe_text_draw`
+// Cost depends on the number of visible lines, not the size of the document
+AFFE_API void affe_document_draw(affe_context* ctx, const affe_document* document, float x, float y, float view_x, float view_y, float view_width, float view_height);
+
+// ----- recorders -----
+
+// Records text on worker threads into its own vertex stream, later merged on the render thread
+//
+// Recorders only read the glyph cache. While any recorder is recording, the context must not be used
+// by the render thread for anything but other recorders. Each recorder must only be used by one thread at a time.
+// Lines using glyphs that are not cached yet are deferred to `affe_recorder_submit`.
+typedef struct affe_recorder affe_recorder;
+
+// Create a recorder, returns NULL on failure
+AFFE_API affe_recorder* affe_recorder_create(affe_context* ctx);
+
+// Delete a recorder
+AFFE_API void affe_recorder_delete(affe_context* ctx, affe_recorder* recorder);
+
+// Discard recorded text and copy the context's current state into the recorder
+// Call on the render thread before handing the recorder to a worker
+AFFE_API void affe_recorder_reset(affe_context* ctx, affe_recorder* recorder);
+
+// Set recorder state, these match `affe_set_size`, `affe_set_color`, `affe_set_font`, `affe_set_alignment`, `affe_set_blend`, `affe_set_effect`, `affe_set_bitmap_below`, `affe_set_clip` and `affe_reset_clip`
+AFFE_API void affe_recorder_set_size(affe_context* ctx, affe_recorder* recorder, float size);
+AFFE_API void affe_recorder_set_color(affe_context* ctx, affe_recorder* recorder, float r, float g, float b, float a);
+AFFE_API void affe_recorder_set_font(affe_context* ctx, affe_recorder* recorder, int font);
+AFFE_API void affe_recorder_set_alignment(affe_context* ctx, affe_recorder* recorder, int alignment);
+AFFE_API void affe_recorder_set_blend(affe_context* ctx, affe_recorder* recorder, int blend);
+AFFE_API void affe_recorder_set_effect(affe_context* ctx, affe_recorder* recorder, const affe_effect* effect);
+AFFE_API void affe_recorder_set_bitmap_below(affe_context* ctx, affe_recorder* recorder, float size);
+AFFE_API void affe_recorder_set_clip(affe_context* ctx, affe_recorder* recorder, float x, float y, float width, float height);
+AFFE_API void affe_recorder_reset_clip(affe_context* ctx, affe_recorder* recorder);
+
+// Record text, as `affe_text_draw` and `affe_text_draw_inline`
+// Returns `FALSE` if memory could not be allocated, text recorded before is kept
+AFFE_API int affe_recorder_text_draw(affe_context* ctx, affe_recorder* recorder, float x, float y, const char* string, const char* end);
+AFFE_API int affe_recorder_text_draw_inline(affe_context* ctx, affe_recorder* recorder, float x, float y, const char* string, const char* end);
+
+// Render thread only, after every recorder finished recording
+// Rasterizes glyphs the recorders missed, then merges recorders in order into the vertex buffer
+// Recorded text is kept until `affe_recorder_reset`, so a recorder may be submitted again
+AFFE_API void affe_recorder_submit(affe_context* ctx, affe_recorder* const* recorders, int recorders_count);
+
+// ----- batches -----
+
+// A string drawn by `affe_text_draw_batch`, `end` may be NULL
+struct affe_text_item
+{
+	float x, y;
+	const char* string;
+	const char* end;
+
+	// Index into the batch's styles, -1 for the current state
+	int style;
+};
+
+typedef struct affe_text_item affe_text_item;
+
+// Draw many independent strings, each as `affe_text_draw` with its style applied over the current state
+// Glyphs are rasterized once for the whole batch, then items are laid out over `affe_batch_threads` threads
+// into their own ranges of a batch buffer and copied into the vertex buffer in order.
+// In automatic flush control the buffer is flushed once.
+AFFE_API void affe_text_draw_batch(affe_context* ctx, const affe_text_item* items, int items_count, const affe_text_style* styles);
+
+// Lay out batches on multiple threads, including the calling thread, 1 by default
+// Threads are created once and reused, only batches with many items are split. Worker threads only read the glyph cache.
+AFFE_API void affe_batch_threads(affe_context* ctx, int threads);
+
+// Bytes of the BC4 (RGTC1) blocks covering `width` by `height` pixels, 8 bytes per 4x4 block
+#define AFFE_BC4_SIZE(width, height) ((long long)(((width) + 3) / 4) * (((height) + 3) / 4) * 8)
+
+// Compress 8 bit pixels into BC4 blocks, rows of blocks follow the order of the pixel rows
+// Pixels past the right and bottom edge repeat the last column and row. `stride` is the distance between pixel rows in bytes
+AFFE_API void affe_bc4_encode(const unsigned char* pixels, int width, int height, int stride, unsigned char* blocks);
+
+// Expand BC4 blocks back into 8 bit pixels, to measure the encoder or keep a copy of a compressed atlas
+AFFE_API void affe_bc4_decode(const unsigned char* blocks, int width, int height, unsigned char* pixels, int stride);
+
 #ifdef __cplusplus
 }
 #endif
@@ -302,6 +886,7 @@ AFFE_API void affe_text_draw_inline(affe_context* ctx, float x, float y, const c
 #ifndef AFFE_INIT_FONTS
 #	define AFFE_INIT_FONTS 4
 #endif
+// Glyphs are allocated in pages of this many glyphs, pages never move
 #ifndef AFFE_INIT_GLYPHS
 #	define AFFE_INIT_GLYPHS 256
 #endif
@@ -311,21 +896,198 @@ AFFE_API void affe_text_draw_inline(affe_context* ctx, float x, float y, const c
 #ifndef AFFE_MAX_FALLBACKS
 #	define AFFE_MAX_FALLBACKS 16
 #endif
+// Distinct effects between buffer flushes, at most 254
+#ifndef AFFE_MAX_EFFECTS
+#	define AFFE_MAX_EFFECTS 32
+#endif
+#if AFFE_MAX_EFFECTS >= AFFE_SHADER_COVERAGE
+#	error "AFFE_MAX_EFFECTS must leave room for AFFE_SHADER_COVERAGE"
+#endif
+
+#ifndef AFFE_INIT_LINES
+#	define AFFE_INIT_LINES 64
+#endif
+#ifndef AFFE_INIT_DOCUMENT
+#	define AFFE_INIT_DOCUMENT 4096
+#endif
+#ifndef AFFE_INIT_COMMANDS
+#	define AFFE_INIT_COMMANDS 64
+#endif
+// Codepoints below this are looked up by direct indexing instead of hashing, at least 1
+#ifndef AFFE_DIRECT_GLYPHS
+#	define AFFE_DIRECT_GLYPHS 256
+#endif
+
+// Initial size of the rasterizer scratch memory in bytes
+#ifndef AFFE_INIT_SCRATCH
+#	define AFFE_INIT_SCRATCH (64 * 1024)
+#endif
+// Shaped lines kept before the run cache is cleared, and its bucket count as a power of two
+#ifndef AFFE_SHAPE_RUNS
+#	define AFFE_SHAPE_RUNS 1024
+#endif
+#ifndef AFFE_SHAPE_BUCKETS
+#	define AFFE_SHAPE_BUCKETS 256
+#endif
+
+#ifndef AFFE_INIT_RECORDER_ITEMS
+#	define AFFE_INIT_RECORDER_ITEMS 64
+#endif
+
+// Buckets looking up draws of the last frame and draws kept per frame at most, see `affe_draw_cache`
+#ifndef AFFE_DRAW_CACHE_BUCKETS
+#	define AFFE_DRAW_CACHE_BUCKETS 1024
+#endif
+#ifndef AFFE_DRAW_CACHE_DRAWS
+#	define AFFE_DRAW_CACHE_DRAWS 16384
+#endif
+
+// Threads a batch is laid out on at most, and batches with fewer items are laid out on the calling thread
+#ifndef AFFE_MAX_THREADS
+#	define AFFE_MAX_THREADS 16
+#endif
+#ifndef AFFE_BATCH_THREAD_MIN_ITEMS
+#	define AFFE_BATCH_THREAD_MIN_ITEMS 64
+#endif
+
+// Events kept per context when compiled with `AFFE_TRACE`, must be a power of two
+#ifndef AFFE_TRACE_EVENTS
+#	define AFFE_TRACE_EVENTS 16384
+#endif
+#if (AFFE_TRACE_EVENTS & (AFFE_TRACE_EVENTS - 1)) != 0
+#	error "AFFE_TRACE_EVENTS must be a power of two"
+#endif
+
+// Number of codepoints decoded at a time while drawing or measuring text
+#ifndef AFFE_DECODE_CHUNK
+#	define AFFE_DECODE_CHUNK 256
+#endif
+
+// Define `AFFE_NO_SIMD` to force the scalar code paths
+#ifndef AFFE_NO_SIMD
+#	if defined(__AVX2__)
+#		define AFFE__AVX2 1
+#		include <immintrin.h>
+#	endif
+#	if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#		define AFFE__SSE2 1
+#		include <emmintrin.h>
+#	elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#		define AFFE__NEON 1
+#		include <arm_neon.h>
+#	endif
+#endif
+
+#ifdef _MSC_VER
+#	include <intrin.h>
+#endif
+
+// Define `AFFE_HARFBUZZ` and link harfbuzz to shape lines of complex scripts
+#ifdef AFFE_HARFBUZZ
+#	include <hb.h>
+#endif
+
+// Define `AFFE_NO_THREADS` to lay out batches on the calling thread only
+#ifndef AFFE_NO_THREADS
+#	include <new>
+#	include <thread>
+#	include <mutex>
+#	include <condition_variable>
+#endif
+
+// Define `AFFE_TRACE` to record engine zones into a ring buffer per context, see `affe_trace_events`
+#ifdef AFFE_TRACE
+#	include <atomic>
+#endif
+
+// Define `AFFE_NO_STATS` to compile out all counters and timers
+// Define `AFFE_TIMER_NOW` to a nanosecond clock to replace the default timer
+#if !defined(AFFE_NO_STATS) || defined(AFFE_TRACE)
+#	ifndef AFFE_TIMER_NOW
+#		ifdef _WIN32
+#			ifndef WIN32_LEAN_AND_MEAN
+#				define WIN32_LEAN_AND_MEAN
+#			endif
+#			include <windows.h>
+
+static long long affe__timer_now(void)
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (long long)(counter.QuadPart / frequency.QuadPart) * 1000000000LL + (long long)(counter.QuadPart % frequency.QuadPart) * 1000000000LL / frequency.QuadPart;
+}
+#		else
+#			include <time.h>
+
+static long long affe__timer_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+#else
+	// Strict ISO C hides `clock_gettime`, fall back to processor time
+	return (long long)clock() * (1000000000LL / CLOCKS_PER_SEC);
+#endif
+}
+#		endif
+#		define AFFE_TIMER_NOW() affe__timer_now()
+#	endif
+#endif
+
+#ifndef AFFE_NO_STATS
+#	define AFFE__STAT_ADD(ctx, field, value) ((ctx)->stats.field += (value))
+#	define AFFE__TIMER_BEGIN(name) long long name = AFFE_TIMER_NOW()
+#	define AFFE__TIMER_END(ctx, field, name) AFFE__STAT_ADD(ctx, field, AFFE_TIMER_NOW() - (name))
+#else
+#	define AFFE__STAT_ADD(ctx, field, value) ((void)0)
+#	define AFFE__TIMER_BEGIN(name) ((void)0)
+#	define AFFE__TIMER_END(ctx, field, name) ((void)0)
+#endif
+
+typedef struct affe__font affe__font;
+
+// Glyph cache keys with this bit set hold a glyph index from shaping instead of a codepoint
+#define AFFE__GLYPH_INDEX 0x80000000u
 
 struct affe__glyph
 {
 	unsigned int codepoint;
 	int index;
+	affe__font* render;
 	int next;
 	float size;
 	int advance;
 	int padding;
 	int x0, y0, x1, y1;
 	int s0, t0, s1, t1;
+
+	// `s0`, `t0`, `s1` and `t1` normalized by the atlas size
+	float u0, v0, u1, v1;
 };
 
 typedef struct affe__glyph affe__glyph;
 
+// A glyph scaled and ready to emit, see `affe__font::direct_quads`
+struct affe__direct
+{
+	// Pixels from the pen position
+	float x0, y0, x1, y1;
+	float advance;
+
+	// Normalized texture coordinates
+	float s0, t0, s1, t1;
+
+	int visible;
+
+	// Valid while equal to `affe__font::direct_stamp`
+	unsigned int stamp;
+};
+
+typedef struct affe__direct affe__direct;
+
 struct affe__font
 {
 	stbtt_fontinfo metrics;
@@ -333,90 +1095,616 @@ struct affe__font
 	void* data;
 	bool is_owner;
 
-	affe__glyph* glyphs;
-	int glyphs_capacity;
+	// Bytes of the font's tables, counted while the engine owns `data`
+	long long data_size;
+
+	affe__glyph** glyph_pages;
+	int glyph_pages_capacity;
+	int glyph_pages_count;
 	int glyphs_count;
 
 	int lut[AFFE_HASH_LUT_SIZE];
 
+	// Cached glyphs at the cache's size for low codepoints, NULL when not cached
+	affe__glyph* direct[AFFE_DIRECT_GLYPHS];
+
+	// Low codepoints scaled for the last size drawn, only used from the render thread
+	affe__direct direct_quads[AFFE_DIRECT_GLYPHS];
+	float direct_scale;
+	unsigned int direct_stamp;
+
+	// Digits, minus and decimal point scaled like `direct_quads`, see `AFFE__NUMERALS`
+	affe__direct numerals[12];
+
+	// Widest digit advance, valid while `numerals_stamp` equals `direct_stamp`
+	float numerals_tabular;
+	unsigned int numerals_stamp;
+
 	int fallbacks[AFFE_MAX_FALLBACKS];
 	int fallbacks_count;
 
 	int ascent, descent, line_gap;
+
+	// Box around the pen covering every glyph of the font and its fallbacks, padding included
+	int x_min, y_min, x_max, y_max;
+
+#ifdef AFFE_HARFBUZZ
+	// Created on the first shaped line
+	hb_font_t* shaper;
+#endif
 };
 
 typedef struct affe__font affe__font;
 
-struct affe__state
+static affe__glyph* affe__font__glyph(const affe__font* font, int index)
 {
-	float size;
-	float r, g, b, a;
-	int font;
-	int alignment;
+	return &font->glyph_pages[index / AFFE_INIT_GLYPHS][index % AFFE_INIT_GLYPHS];
+}
+
+struct affe__scratch_block
+{
+	struct affe__scratch_block* next;
 };
 
-typedef struct affe__state affe__state;
+typedef struct affe__scratch_block affe__scratch_block;
 
-struct affe_context
+// Bump allocator for memory only needed while rasterizing one glyph
+struct affe__scratch
 {
-	affe_context_create_info info;
+	affe_allocator allocator;
 
-	affe__font** fonts;
-	long long fonts_capacity;
-	int fonts_count;
+	unsigned char* base;
+	size_t size;
+	size_t used;
 
-	affe_vertex* verts;
-	long long verts_count;
+	// Allocations that did not fit, the base grows by their size on reset
+	affe__scratch_block* overflow;
+	size_t overflow_size;
+};
 
-	affe__state states[AFFE_MAX_STATES];
-	long long states_count;
+typedef struct affe__scratch affe__scratch;
 
-	stbrp_context packer;
-	stbrp_node* packer_nodes;
-	int packer_nodes_count;
+#ifdef AFFE_HARFBUZZ
+// Glyph of a shaped line in font units
+struct affe__shaped
+{
+	unsigned int index;
+	int advance;
+	int x_offset, y_offset;
+};
 
-	int buffer_flush_control;
+typedef struct affe__shaped affe__shaped;
 
-	int canvas_width;
-	int canvas_height;
+// A shaped line, its glyphs and then its text follow in the same allocation
+struct affe__run
+{
+	struct affe__run* next;
+	unsigned int hash;
+	int font;
+	int text_size;
+	int glyphs_count;
 };
 
-static void affe__font__free(affe__font* font)
+typedef struct affe__run affe__run;
+
+static affe__shaped* affe__run__glyphs(const affe__run* run)
 {
-	if (font == NULL) return;
-	if (font->glyphs) free(font->glyphs);
-	if (font->is_owner && font->data) free(font->data);
-	free(font);
+	return (affe__shaped*)(run + 1);
 }
 
-static int affe__font__alloc(affe_context* ctx)
+static const char* affe__run__text(const affe__run* run)
 {
-	if (ctx->fonts_count + 1 > ctx->fonts_capacity)
-	{
-		ctx->fonts_capacity = ctx->fonts_capacity == 0 ? AFFE_INIT_FONTS : ctx->fonts_capacity * 2;
-		affe__font** new_fonts = (affe__font**)realloc(ctx->fonts, ctx->fonts_capacity * sizeof(affe__font*));
-		if (new_fonts == NULL) return AFFE_INVALID;
-		ctx->fonts = new_fonts;
-	}
+	return (const char*)(affe__run__glyphs(run) + run->glyphs_count);
+}
+#endif
 
-	affe__font* font = (affe__font*)malloc(sizeof(affe__font));
-	if (font == NULL) goto error;
-	memset(font, 0, sizeof(affe__font));
+struct affe_cache
+{
+	int refs;
+
+	affe_allocator allocator;
+	affe__scratch scratch;
+
+	affe__font** fonts;
+	long long fonts_capacity;
+	int fonts_count;
+
+	stbrp_context packer;
+	stbrp_node* packer_nodes;
+	int packer_nodes_count;
+
+	// Atlas size and rasterizer settings
+	int width, height;
+	float edge_value;
+	float size;
+	int padding;
+
+	// Atlas texels per packer unit, 4 when the atlas is stored in compressed blocks
+	int block;
+
+	// Incremented whenever glyph texture coordinates become invalid
+	unsigned int generation;
+
+#ifndef AFFE_NO_STATS
+	// Pixels packed since the last invalidation
+	long long atlas_used;
+#endif
+
+	// Contexts receiving glyph uploads
+	affe_context** contexts;
+	int contexts_count;
+	int contexts_capacity;
+
+#ifdef AFFE_HARFBUZZ
+	// Shaped lines by font and text, independent of size
+	affe__run* runs[AFFE_SHAPE_BUCKETS];
+	int runs_count;
+	long long runs_bytes;
+	hb_buffer_t* shape_buffer;
+#endif
+};
+
+struct affe__state
+{
+	float size;
+	float r, g, b, a;
+	int font;
+	int alignment;
+	int blend;
+
+	// Clip rectangle, only used when `clip` is set
+	int clip;
+	float clip_x0, clip_y0, clip_x1, clip_y1;
+
+	// Zeroed when there is no effect
+	affe_effect effect;
+
+	// Sizes below this are drawn from coverage bitmaps, 0 when disabled
+	float bitmap_below;
+};
+
+typedef struct affe__state affe__state;
+
+// A run of vertices sharing a pipeline key, recorded while flush control is deferred
+struct affe__command
+{
+	unsigned int key;
+	long long first;
+	long long count;
+};
+
+typedef struct affe__command affe__command;
+
+// A text draw kept by `affe_draw_cache`, everything its vertices depend on
+struct affe__drawn
+{
+	unsigned int hash;
+	int next;
+
+	// Frame the draw was last repeated in
+	unsigned int frame;
+
+	affe__state state;
+	float x, y;
+	int lines;
+	int canvas_width, canvas_height;
+	unsigned int generation;
+
+	// Ranges of the draw cache's bytes and quads
+	long long text, text_count;
+	long long first, count;
+};
+
+typedef struct affe__drawn affe__drawn;
+
+// Corners of a kept quad, the color is the draw's
+struct affe__drawn_quad
+{
+	float x0, y0, x1, y1, s0, t0, s1, t1;
+};
+
+typedef struct affe__drawn_quad affe__drawn_quad;
+
+// Draws kept in place while they are repeated every frame
+// Draws not repeated are unlinked at the end of a frame and their space is taken back once it outweighs the rest
+struct affe__drawn_cache
+{
+	int buckets[AFFE_DRAW_CACHE_BUCKETS];
+	unsigned int frame;
+
+	affe__drawn* entries;
+	int entries_count;
+	int entries_capacity;
+
+	char* bytes;
+	long long bytes_count;
+	long long bytes_capacity;
+
+	// Kept as quads to read a sixth of the memory vertices would take
+	affe__drawn_quad* quads;
+	long long quads_count;
+	long long quads_capacity;
+
+	// Vertices of the draw being laid out
+	affe_vertex* scratch;
+	long long scratch_capacity;
+};
+
+typedef struct affe__drawn_cache affe__drawn_cache;
+
+#ifndef AFFE_NO_THREADS
+// Worker threads of a context, see `affe_batch_threads`
+typedef struct affe__pool affe__pool;
+#endif
+
+struct affe_context
+{
+	affe_context_create_info info;
+
+	affe_cache* cache;
+
+	affe_vertex* verts;
+	long long verts_count;
+
+	// Pipeline key of the vertices being written, and of the vertices passed to `draw_proc`
+	unsigned int verts_key;
+	unsigned int flush_key;
+
+	// Effects referenced by the shader variant of pipeline keys, converted to atlas texels
+	affe_effect effects[AFFE_MAX_EFFECTS];
+	int effects_count;
+
+	affe__command* commands;
+	affe__command* commands_scratch;
+	int commands_count;
+	int commands_capacity;
+
+	// Deferred vertices are gathered here in sorted order, allocated on first use
+	affe_vertex* verts_sorted;
+
+	long long flush_commands;
+	long long flush_draws;
+	affe_buffer_stats buffer_stats;
+
+#ifndef AFFE_NO_STATS
+	// Counters of the current frame, the last finished frame and all finished frames
+	affe_stats stats;
+	affe_stats stats_frame;
+	affe_stats stats_total;
+#endif
+
+#ifdef AFFE_TRACE
+	// Ring buffer of the last `AFFE_TRACE_EVENTS` events, `trace_head` counts every event recorded
+	affe_trace_event* trace_events;
+	alignas(std::atomic_ref<unsigned long long>::required_alignment) unsigned long long trace_head;
+	long long trace_epoch;
+
+	affe_trace_proc trace_proc;
+	void* trace_user_ptr;
+#endif
+
+	affe__state states[AFFE_MAX_STATES];
+	long long states_count;
+
+	int buffer_flush_control;
+
+	// NULL while `affe_draw_cache` is disabled
+	affe__drawn_cache* drawn;
+
+	// Frames that ended over `memory_budget`
+	long long memory_trims;
+
+	// Threads laying out batches, the pool only exists with more than one
+	int batch_threads;
+
+#ifndef AFFE_NO_THREADS
+	affe__pool* batch_pool;
+
+	// Item ranges and vertices of the last batch, kept to be reused
+	long long* batch_ranges;
+	long long batch_ranges_capacity;
+	affe_vertex* batch_verts;
+	long long batch_verts_capacity;
+#endif
+
+	int canvas_width;
+	int canvas_height;
+};
+
+static void* affe__default_alloc(void*, size_t size) { return malloc(size); }
+static void* affe__default_realloc(void*, void* ptr, size_t size) { return realloc(ptr, size); }
+static void affe__default_free(void*, void* ptr) { free(ptr); }
+
+static void affe__allocator__init(affe_allocator* allocator)
+{
+	if (allocator->alloc_proc && allocator->realloc_proc && allocator->free_proc) return;
+
+	allocator->user_ptr = NULL;
+	allocator->alloc_proc = &affe__default_alloc;
+	allocator->realloc_proc = &affe__default_realloc;
+	allocator->free_proc = &affe__default_free;
+}
+
+static void* affe__malloc(const affe_allocator* allocator, size_t size)
+{
+	return allocator->alloc_proc(allocator->user_ptr, size);
+}
+
+static void* affe__realloc(const affe_allocator* allocator, void* ptr, size_t size)
+{
+	return allocator->realloc_proc(allocator->user_ptr, ptr, size);
+}
+
+static void affe__free(const affe_allocator* allocator, void* ptr)
+{
+	if (ptr) allocator->free_proc(allocator->user_ptr, ptr);
+}
+
+#ifdef AFFE_TRACE
+// Claim the next slot of the ring buffer, safe to call from batch worker threads
+static void affe__trace__event(affe_context* ctx, int zone, int phase, int thread, long long value)
+{
+	if (!ctx->trace_events) return;
+
+	affe_trace_event event;
+	event.zone = zone;
+	event.phase = phase;
+	event.thread = thread;
+	event.time = AFFE_TIMER_NOW();
+	event.value = value;
+
+	unsigned long long index = std::atomic_ref<unsigned long long>(ctx->trace_head).fetch_add(1, std::memory_order_relaxed);
+	ctx->trace_events[index & (AFFE_TRACE_EVENTS - 1)] = event;
+
+	if (ctx->trace_proc)
+		ctx->trace_proc(ctx->trace_user_ptr, &event);
+}
+
+#	define AFFE__TRACE_BEGIN(ctx, zone, thread) affe__trace__event(ctx, zone, AFFE_TRACE_PHASE_BEGIN, thread, 0)
+#	define AFFE__TRACE_END(ctx, zone, thread, value) affe__trace__event(ctx, zone, AFFE_TRACE_PHASE_END, thread, value)
+#	define AFFE__TRACE_INSTANT(ctx, zone, value) affe__trace__event(ctx, zone, AFFE_TRACE_PHASE_INSTANT, 0, value)
+#else
+#	define AFFE__TRACE_BEGIN(ctx, zone, thread) ((void)0)
+#	define AFFE__TRACE_END(ctx, zone, thread, value) ((void)0)
+#	define AFFE__TRACE_INSTANT(ctx, zone, value) ((void)0)
+#endif
+
+static void* affe__scratch__alloc(affe__scratch* scratch, size_t size)
+{
+	size = (size + 15) & ~(size_t)15;
+
+	if (scratch->used + size <= scratch->size)
+	{
+		void* ptr = scratch->base + scratch->used;
+		scratch->used += size;
+		return ptr;
+	}
+
+	// Out of space, fall back to the allocator until the next reset
+	size_t header = (sizeof(affe__scratch_block) + 15) & ~(size_t)15;
+	affe__scratch_block* block = (affe__scratch_block*)affe__malloc(&scratch->allocator, header + size);
+	if (!block) return NULL;
+
+	block->next = scratch->overflow;
+	scratch->overflow = block;
+	scratch->overflow_size += size;
+
+	return (unsigned char*)block + header;
+}
+
+// Release everything allocated since the last reset
+static void affe__scratch__reset(affe__scratch* scratch)
+{
+	scratch->used = 0;
+	if (!scratch->overflow) return;
 
-	font->glyphs = (affe__glyph*)malloc(AFFE_INIT_GLYPHS * sizeof(affe__glyph));
-	if (font->glyphs == NULL) goto error;
-	font->glyphs_capacity = AFFE_INIT_GLYPHS;
-	font->glyphs_count = 0;
+	while (scratch->overflow)
+	{
+		affe__scratch_block* next = scratch->overflow->next;
+		affe__free(&scratch->allocator, scratch->overflow);
+		scratch->overflow = next;
+	}
+
+	// Grow so the same work fits next time
+	size_t new_size = scratch->size + scratch->overflow_size;
+	scratch->overflow_size = 0;
+
+	unsigned char* new_base = (unsigned char*)affe__malloc(&scratch->allocator, new_size);
+	if (!new_base) return;
+
+	affe__free(&scratch->allocator, scratch->base);
+	scratch->base = new_base;
+	scratch->size = new_size;
+}
+
+static void affe__scratch__free(affe__scratch* scratch)
+{
+	affe__scratch__reset(scratch);
+	affe__free(&scratch->allocator, scratch->base);
+	scratch->base = NULL;
+	scratch->size = 0;
+}
+
+#ifndef AFFE_NO_THREADS
+// Threads running parts of a job, the calling thread runs part 0
+struct affe__pool
+{
+	std::thread threads[AFFE_MAX_THREADS];
+	int threads_count;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+
+	unsigned long long job;
+	int pending;
+	bool quit;
+
+	// Current job
+	void(*proc)(void* user_ptr, int part, int parts);
+	void* user_ptr;
+};
+
+static void affe__pool__worker(affe__pool* pool, int part)
+{
+	unsigned long long seen = 0;
+
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(pool->mutex);
+			pool->wake.wait(lock, [&] { return pool->quit || pool->job != seen; });
+			if (pool->quit) return;
+			seen = pool->job;
+		}
+
+		pool->proc(pool->user_ptr, part, pool->threads_count + 1);
+
+		{
+			std::lock_guard<std::mutex> lock(pool->mutex);
+			if (--pool->pending == 0) pool->done.notify_one();
+		}
+	}
+}
+
+static void affe__pool__delete(const affe_allocator* allocator, affe__pool* pool)
+{
+	if (!pool) return;
+
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->quit = true;
+	}
+	pool->wake.notify_all();
+
+	for (int i = 0; i < pool->threads_count; ++i)
+		pool->threads[i].join();
+
+	pool->~affe__pool();
+	affe__free(allocator, pool);
+}
+
+// Returns NULL on failure, `threads` includes the calling thread
+static affe__pool* affe__pool__create(const affe_allocator* allocator, int threads)
+{
+	void* memory = affe__malloc(allocator, sizeof(affe__pool));
+	if (!memory) return NULL;
+
+	affe__pool* pool = new (memory) affe__pool();
+
+	for (int i = 0; i < threads - 1; ++i)
+	{
+		pool->threads[i] = std::thread(affe__pool__worker, pool, i + 1);
+		++pool->threads_count;
+	}
+
+	return pool;
+}
+
+// Run every part of a job and wait for all of them
+static void affe__pool__run(affe__pool* pool, void(*proc)(void* user_ptr, int part, int parts), void* user_ptr)
+{
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->proc = proc;
+		pool->user_ptr = user_ptr;
+		pool->pending = pool->threads_count;
+		++pool->job;
+	}
+	pool->wake.notify_all();
+
+	proc(user_ptr, 0, pool->threads_count + 1);
+
+	std::unique_lock<std::mutex> lock(pool->mutex);
+	pool->done.wait(lock, [&] { return pool->pending == 0; });
+}
+#endif
+
+void* affe_stbtt_malloc(size_t size, void* userdata)
+{
+	if (!userdata) return malloc(size);
+	return affe__scratch__alloc((affe__scratch*)userdata, size);
+}
+
+void affe_stbtt_free(void* ptr, void* userdata)
+{
+	// Scratch memory is released all at once after each glyph
+	if (!userdata) free(ptr);
+}
+
+static void affe__font__free(affe_cache* cache, affe__font* font)
+{
+	if (font == NULL) return;
+
+	for (int i = 0; i < font->glyph_pages_count; ++i)
+		affe__free(&cache->allocator, font->glyph_pages[i]);
+
+	affe__free(&cache->allocator, font->glyph_pages);
+	if (font->is_owner && font->data) free(font->data); // owned data comes from the caller's malloc, not the allocator
+#ifdef AFFE_HARFBUZZ
+	if (font->shaper) hb_font_destroy(font->shaper);
+#endif
+	affe__free(&cache->allocator, font);
+}
+
+static int affe__font__alloc(affe_context* ctx)
+{
+	if (ctx->cache->fonts_count + 1 > ctx->cache->fonts_capacity)
+	{
+		ctx->cache->fonts_capacity = ctx->cache->fonts_capacity == 0 ? AFFE_INIT_FONTS : ctx->cache->fonts_capacity * 2;
+		affe__font** new_fonts = (affe__font**)affe__realloc(&ctx->cache->allocator, ctx->cache->fonts, ctx->cache->fonts_capacity * sizeof(affe__font*));
+		if (new_fonts == NULL) return AFFE_INVALID;
+		ctx->cache->fonts = new_fonts;
+	}
+
+	affe__font* font = (affe__font*)affe__malloc(&ctx->cache->allocator, sizeof(affe__font));
+	if (font == NULL) goto error;
+	memset(font, 0, sizeof(affe__font));
 
-	ctx->fonts[ctx->fonts_count] = font;
-	return ctx->fonts_count++;
+	ctx->cache->fonts[ctx->cache->fonts_count] = font;
+	return ctx->cache->fonts_count++;
 
 error:
-	affe__font__free(font);
+	affe__font__free(ctx->cache, font);
 
 	return AFFE_INVALID;
 }
 
+// Widen the box around the glyphs of `font` by the glyphs of `source`, the font itself or one of its fallbacks
+// Glyph boxes are stored in the rendering font's units with its padding, as done here
+static void affe__font__bounds(affe_context* ctx, affe__font* font, const affe__font* source)
+{
+	int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+	stbtt_GetFontBoundingBox(&source->metrics, &x0, &y0, &x1, &y1);
+
+	int padding = (int)((float)ctx->info.padding / stbtt_ScaleForPixelHeight(&source->metrics, ctx->info.size));
+
+	if (x0 - padding < font->x_min) font->x_min = x0 - padding;
+	if (y0 - padding < font->y_min) font->y_min = y0 - padding;
+	if (x1 + padding > font->x_max) font->x_max = x1 + padding;
+	if (y1 + padding > font->y_max) font->y_max = y1 + padding;
+}
+
+// End of the last table in the font's table directory, font data is not required to hold more
+static long long affe__font__size(const unsigned char* data, int offset)
+{
+	const unsigned char* directory = data + offset;
+	const int tables = directory[4] << 8 | directory[5];
+
+	long long size = offset + 12 + 16LL * tables;
+
+	for (int i = 0; i < tables; ++i)
+	{
+		const unsigned char* record = directory + 12 + 16 * i;
+		const long long table_offset = (long long)record[8] << 24 | record[9] << 16 | record[10] << 8 | record[11];
+		const long long table_length = (long long)record[12] << 24 | record[13] << 16 | record[14] << 8 | record[15];
+
+		if (table_offset + table_length > size) size = table_offset + table_length;
+	}
+
+	return size;
+}
+
 int affe_font_add(affe_context* ctx, void* data, int index, bool take_ownership)
 {
 	if (!ctx) return AFFE_INVALID;
@@ -424,7 +1712,7 @@ int affe_font_add(affe_context* ctx, void* data, int index, bool take_ownership)
 	int font_index = affe__font__alloc(ctx);
 	if (font_index == AFFE_INVALID) return AFFE_INVALID;
 
-	affe__font* font = ctx->fonts[font_index];
+	affe__font* font = ctx->cache->fonts[font_index];
 
 	for (int i = 0; i < AFFE_HASH_LUT_SIZE; ++i)
 		font->lut[i] = -1;
@@ -435,25 +1723,35 @@ int affe_font_add(affe_context* ctx, void* data, int index, bool take_ownership)
 	if (!stbtt_InitFont(&font->metrics, (const unsigned char*)font->data, stbtt_GetFontOffsetForIndex((const unsigned char*)font->data, index)))
 		goto error;
 
+	// Used by `affe_stbtt_malloc`
+	font->metrics.userdata = &ctx->cache->scratch;
+
 	stbtt_GetFontVMetrics(&font->metrics, &font->ascent, &font->descent, &font->line_gap);
+	affe__font__bounds(ctx, font, font);
+
+	// Only data the engine keeps is counted
+	font->data_size = take_ownership ? affe__font__size((const unsigned char*)font->data, font->metrics.fontstart) : 0;
 
 	return font_index;
 
 error:
-	affe__font__free(font);
-	--ctx->fonts_count;
+	affe__font__free(ctx->cache, font);
+	--ctx->cache->fonts_count;
 	return AFFE_INVALID;
 }
 
 int affe_font_fallback(affe_context* ctx, int base, int fallback)
 {
 	if (!ctx) return FALSE;
-	if (base < 0 || base >= ctx->fonts_count) return FALSE;
+	if (base < 0 || base >= ctx->cache->fonts_count) return FALSE;
 
-	affe__font* font_base = ctx->fonts[base];
+	affe__font* font_base = ctx->cache->fonts[base];
 
 	if (font_base->fallbacks_count < AFFE_MAX_FALLBACKS)
 	{
+		if (fallback >= 0 && fallback < ctx->cache->fonts_count && ctx->cache->fonts[fallback]->data)
+			affe__font__bounds(ctx, font_base, ctx->cache->fonts[fallback]);
+
 		font_base->fallbacks[font_base->fallbacks_count++] = fallback;
 		return TRUE;
 	}
@@ -501,9 +1799,61 @@ void affe_set_alignment(affe_context* ctx, int alignment)
 	affe__state__get(ctx)->alignment = alignment;
 }
 
+void affe_set_blend(affe_context* ctx, int blend)
+{
+	if (!ctx) return;
+	affe__state__get(ctx)->blend = blend;
+}
+
+static void affe__state__effect(affe__state* state, const affe_effect* effect)
+{
+	if (effect)
+		state->effect = *effect;
+	else
+		memset(&state->effect, 0, sizeof(affe_effect));
+}
+
+void affe_set_effect(affe_context* ctx, const affe_effect* effect)
+{
+	if (!ctx) return;
+	affe__state__effect(affe__state__get(ctx), effect);
+}
+
+void affe_set_bitmap_below(affe_context* ctx, float size)
+{
+	if (!ctx) return;
+	affe__state__get(ctx)->bitmap_below = size;
+}
+
+static void affe__state__clip(affe__state* state, float x, float y, float width, float height)
+{
+	state->clip = TRUE;
+	state->clip_x0 = x;
+	state->clip_y0 = y;
+	state->clip_x1 = x + width;
+	state->clip_y1 = y + height;
+}
+
+void affe_set_clip(affe_context* ctx, float x, float y, float width, float height)
+{
+	if (!ctx) return;
+	affe__state__clip(affe__state__get(ctx), x, y, width, height);
+}
+
+void affe_reset_clip(affe_context* ctx)
+{
+	if (!ctx) return;
+	affe__state__get(ctx)->clip = FALSE;
+}
+
 void affe_buffer_flush_control(affe_context* ctx, int control)
 {
 	if (!ctx) return;
+
+	// Recorded commands only make sense while deferred
+	if (control != ctx->buffer_flush_control && (control == AFFE_BUFFER_FLUSH_CONTROL_DEFERRED || ctx->buffer_flush_control == AFFE_BUFFER_FLUSH_CONTROL_DEFERRED))
+		affe_buffer_flush(ctx);
+
 	ctx->buffer_flush_control = control;
 }
 
@@ -539,22 +1889,263 @@ void affe_cache_invalidate(affe_context* ctx)
 {
 	if (!ctx) return;
 
-	// Since glyph data will be invalid after this function, flush all existing data from the buffer
-	affe_buffer_flush(ctx);
+	AFFE__TRACE_BEGIN(ctx, AFFE_ZONE_INVALIDATE, 0);
+
+	affe_cache* cache = ctx->cache;
+
+	// Since glyph data will be invalid after this function, flush all existing data from the buffers
+	for (int i = 0; i < cache->contexts_count; ++i)
+	{
+		affe_buffer_flush(cache->contexts[i]);
+		AFFE__STAT_ADD(cache->contexts[i], invalidations, 1);
+	}
+
+	++cache->generation;
+
+#ifndef AFFE_NO_STATS
+	cache->atlas_used = 0;
+#endif
 
 	// Recreate packer
-	stbrp_init_target(&ctx->packer, ctx->info.width, ctx->info.height, ctx->packer_nodes, ctx->packer_nodes_count);
+	stbrp_init_target(&cache->packer, cache->width / cache->block, cache->height / cache->block, cache->packer_nodes, cache->packer_nodes_count);
 
-	for (int i = 0; i < ctx->fonts_count; ++i)
+	for (int i = 0; i < cache->fonts_count; ++i)
 	{
 		// Clear lut
 		for (int j = 0; j < AFFE_HASH_LUT_SIZE; ++j)
-			ctx->fonts[i]->lut[j] = -1;
+			cache->fonts[i]->lut[j] = -1;
 
-		ctx->fonts[i]->glyphs_count = 0;
+		memset(cache->fonts[i]->direct, 0, sizeof(cache->fonts[i]->direct));
+		++cache->fonts[i]->direct_stamp;
+
+		cache->fonts[i]->glyphs_count = 0;
+	}
+
+	AFFE__TRACE_END(ctx, AFFE_ZONE_INVALIDATE, 0, cache->generation);
+}
+
+#ifdef AFFE_HARFBUZZ
+static void affe__run__clear(affe_cache* cache)
+{
+	for (int i = 0; i < AFFE_SHAPE_BUCKETS; ++i)
+	{
+		affe__run* run = cache->runs[i];
+		while (run)
+		{
+			affe__run* next = run->next;
+			affe__free(&cache->allocator, run);
+			run = next;
+		}
+
+		cache->runs[i] = NULL;
+	}
+
+	cache->runs_count = 0;
+	cache->runs_bytes = 0;
+}
+#endif
+
+static void affe__cache__free(affe_cache* cache)
+{
+	if (!cache) return;
+
+	for (int i = 0; i < cache->fonts_count; ++i)
+		affe__font__free(cache, cache->fonts[i]);
+
+	affe__scratch__free(&cache->scratch);
+
+#ifdef AFFE_HARFBUZZ
+	affe__run__clear(cache);
+	if (cache->shape_buffer) hb_buffer_destroy(cache->shape_buffer);
+#endif
+
+	affe_allocator allocator = cache->allocator;
+	affe__free(&allocator, cache->fonts);
+	affe__free(&allocator, cache->packer_nodes);
+	affe__free(&allocator, cache->contexts);
+	affe__free(&allocator, cache);
+}
+
+static affe_cache* affe__cache__create(const affe_context_create_info* info)
+{
+	affe_cache* cache = (affe_cache*)affe__malloc(&info->allocator, sizeof(affe_cache));
+	if (!cache) goto error;
+	memset(cache, 0, sizeof(affe_cache));
+
+	cache->refs = 1;
+	cache->allocator = info->allocator;
+
+	// Rasterizer scratch memory
+	cache->scratch.allocator = info->allocator;
+	cache->scratch.base = (unsigned char*)affe__malloc(&cache->allocator, AFFE_INIT_SCRATCH);
+	if (!cache->scratch.base) goto error;
+	cache->scratch.size = AFFE_INIT_SCRATCH;
+	cache->width = info->width;
+	cache->height = info->height;
+	cache->edge_value = info->edge_value;
+	cache->size = info->size;
+	cache->padding = info->padding;
+	cache->block = (info->flags & AFFE_FLAGS_ATLAS_BC4) ? 4 : 1;
+
+	// Setup rectangle packer, compressed atlases are packed in whole blocks
+	cache->packer_nodes_count = cache->width / cache->block;
+	cache->packer_nodes = (stbrp_node*)affe__malloc(&cache->allocator, cache->packer_nodes_count * sizeof(stbrp_node));
+	if (!cache->packer_nodes) goto error;
+	stbrp_init_target(&cache->packer, cache->width / cache->block, cache->height / cache->block, cache->packer_nodes, cache->packer_nodes_count);
+
+	// Allocate font
+	cache->fonts = (affe__font**)affe__malloc(&cache->allocator, AFFE_INIT_FONTS * sizeof(affe__font*));
+	if (!cache->fonts) goto error;
+	memset(cache->fonts, 0, AFFE_INIT_FONTS * sizeof(affe__font*));
+	cache->fonts_capacity = AFFE_INIT_FONTS;
+	cache->fonts_count = 0;
+
+	return cache;
+error:
+	affe__cache__free(cache);
+	return NULL;
+}
+
+static int affe__cache__attach(affe_cache* cache, affe_context* ctx)
+{
+	if (cache->contexts_count + 1 > cache->contexts_capacity)
+	{
+		int new_capacity = cache->contexts_capacity == 0 ? 4 : cache->contexts_capacity * 2;
+		affe_context** new_contexts = (affe_context**)affe__realloc(&cache->allocator, cache->contexts, new_capacity * sizeof(affe_context*));
+		if (!new_contexts) return FALSE;
+
+		cache->contexts = new_contexts;
+		cache->contexts_capacity = new_capacity;
+	}
+
+	cache->contexts[cache->contexts_count++] = ctx;
+	return TRUE;
+}
+
+static void affe__cache__detach(affe_cache* cache, affe_context* ctx)
+{
+	for (int i = 0; i < cache->contexts_count; ++i)
+	{
+		if (cache->contexts[i] != ctx) continue;
+
+		cache->contexts[i] = cache->contexts[--cache->contexts_count];
+		return;
+	}
+}
+
+// Send glyph pixels to every context sharing the cache
+static void affe__cache__upload(affe_cache* cache, int x, int y, int w, int h, void* pixels)
+{
+	for (int i = 0; i < cache->contexts_count; ++i)
+	{
+		affe_context* ctx = cache->contexts[i];
+		if (!ctx->info.update_proc) continue;
+
+		AFFE__TRACE_BEGIN(ctx, AFFE_ZONE_UPLOAD, 0);
+		ctx->info.update_proc(ctx, ctx->info.user_ptr, x, y, w, h, pixels);
+		AFFE__TRACE_END(ctx, AFFE_ZONE_UPLOAD, 0, (long long)w * h);
+
+		AFFE__STAT_ADD(ctx, update_calls, 1);
+		AFFE__STAT_ADD(ctx, update_bytes, (long long)w * h);
+	}
+}
+
+// Rasterize a coverage bitmap into scratch memory, returns NULL for empty glyphs
+// `*ix0`, `*iy0`, `*ix1` and `*iy1` receive the pixel box of the coverage with y down
+static unsigned char* affe__glyph__bitmap(affe__scratch* scratch, const stbtt_fontinfo* metrics, int glyph_index, float scale, int* w, int* h, int* ix0, int* iy0, int* ix1, int* iy1)
+{
+	stbtt_GetGlyphBitmapBox(metrics, glyph_index, scale, scale, ix0, iy0, ix1, iy1);
+	if (*ix1 <= *ix0 || *iy1 <= *iy0) return NULL;
+
+	// One empty texel around the coverage keeps bilinear filtering from reading neighbouring glyphs
+	*w = *ix1 - *ix0 + 2;
+	*h = *iy1 - *iy0 + 2;
+
+	unsigned char* pixels = (unsigned char*)affe__scratch__alloc(scratch, (size_t)*w * *h);
+	if (!pixels) return NULL;
+
+	memset(pixels, 0, (size_t)*w * *h);
+	stbtt_MakeGlyphBitmap(metrics, pixels + *w + 1, *w - 2, *h - 2, *w, scale, scale, glyph_index);
+	return pixels;
+}
+
+// Pad glyph pixels with empty texels to whole packer units, `*w` and `*h` are rounded up
+// Returns the pixels as they are when they already fit, NULL when scratch memory runs out
+static unsigned char* affe__cache__pad(affe_cache* cache, unsigned char* pixels, int* w, int* h)
+{
+	const int padded_w = (*w + cache->block - 1) / cache->block * cache->block;
+	const int padded_h = (*h + cache->block - 1) / cache->block * cache->block;
+	if (padded_w == *w && padded_h == *h) return pixels;
+
+	unsigned char* padded = (unsigned char*)affe__scratch__alloc(&cache->scratch, (size_t)padded_w * padded_h);
+	if (!padded) return NULL;
+
+	memset(padded, 0, (size_t)padded_w * padded_h);
+	for (int y = 0; y < *h; ++y)
+		memcpy(padded + (size_t)y * padded_w, pixels + (size_t)y * *w, *w);
+
+	*w = padded_w;
+	*h = padded_h;
+	return padded;
+}
+
+// Rasterize every cached glyph again for a context joining a shared cache
+static void affe__cache__replay(affe_cache* cache, affe_context* ctx)
+{
+	if (!ctx->info.update_proc) return;
+
+	for (int i = 0; i < cache->fonts_count; ++i)
+	{
+		affe__font* font = cache->fonts[i];
+
+		for (int j = 0; j < font->glyphs_count; ++j)
+		{
+			affe__glyph* glyph = affe__font__glyph(font, j);
+			if (glyph->s0 == glyph->s1 || glyph->t0 == glyph->t1) continue;
+
+			// Coverage bitmaps are cached under negative sizes
+			const int bitmap = glyph->size < 0.0f;
+			float scale = stbtt_ScaleForPixelHeight(&glyph->render->metrics, bitmap ? -glyph->size : glyph->size);
+
+			int w, h, ix0, iy0, ix1, iy1;
+			unsigned char* pixels = bitmap ?
+				affe__glyph__bitmap(&cache->scratch, &glyph->render->metrics, glyph->index, scale, &w, &h, &ix0, &iy0, &ix1, &iy1) :
+				stbtt_GetGlyphSDF(&glyph->render->metrics, scale, glyph->index, cache->padding, (unsigned char)(cache->edge_value * 255.0f), 255.0f / (float)cache->padding, &w, &h, NULL, NULL);
+			if (!pixels)
+			{
+				affe__scratch__reset(&cache->scratch);
+				continue;
+			}
+
+			// Uploaded in whole packer units, as when the glyph was packed
+			unsigned char* upload = affe__cache__pad(cache, pixels, &w, &h);
+			if (upload)
+			{
+				ctx->info.update_proc(ctx, ctx->info.user_ptr, glyph->s0, glyph->t1, w, h, upload);
+				AFFE__STAT_ADD(ctx, update_calls, 1);
+				AFFE__STAT_ADD(ctx, update_bytes, (long long)w * h);
+			}
+
+			if (!bitmap) stbtt_FreeSDF(pixels, glyph->render->metrics.userdata);
+			affe__scratch__reset(&cache->scratch);
+		}
 	}
 }
 
+affe_cache* affe_cache_acquire(affe_context* ctx)
+{
+	if (!ctx) return NULL;
+	++ctx->cache->refs;
+	return ctx->cache;
+}
+
+void affe_cache_release(affe_cache* cache)
+{
+	if (!cache) return;
+	if (--cache->refs > 0) return;
+	affe__cache__free(cache);
+}
+
 void affe_viewport(affe_context* ctx, int width, int height)
 {
 	if (!ctx) return;
@@ -574,6 +2165,80 @@ void affe_state_clear(affe_context* ctx)
 	state->a = 1.0f;
 	state->font = AFFE_INVALID;
 	state->alignment = AFFE_ALIGN_LEFT;
+	state->blend = AFFE_BLEND_ALPHA;
+	state->clip = FALSE;
+	memset(&state->effect, 0, sizeof(affe_effect));
+	state->bitmap_below = 0.0f;
+}
+
+// Unlink draws that were not repeated in the frame that ended, compact them away when they outweigh the rest
+static void affe__drawn__frame_end(affe__drawn_cache* drawn)
+{
+	long long live_quads = 0, dead_quads = 0;
+	int live_count = 0;
+
+	for (int i = 0; i < drawn->entries_count; ++i)
+	{
+		if (drawn->entries[i].frame == drawn->frame)
+		{
+			live_quads += drawn->entries[i].count;
+			++live_count;
+		}
+		else
+			dead_quads += drawn->entries[i].count;
+	}
+
+	if (dead_quads > live_quads || drawn->entries_count - live_count > live_count)
+	{
+		int count = 0;
+		long long bytes_count = 0, quads_count = 0;
+
+		for (int i = 0; i < drawn->entries_count; ++i)
+		{
+			affe__drawn entry = drawn->entries[i];
+			if (entry.frame != drawn->frame) continue;
+
+			memmove(drawn->bytes + bytes_count, drawn->bytes + entry.text, entry.text_count);
+			entry.text = bytes_count;
+			bytes_count += entry.text_count;
+
+			if (entry.count > 0) memmove(drawn->quads + quads_count, drawn->quads + entry.first, entry.count * sizeof(affe__drawn_quad));
+			entry.first = quads_count;
+			quads_count += entry.count;
+
+			drawn->entries[count++] = entry;
+		}
+
+		drawn->entries_count = count;
+		drawn->bytes_count = bytes_count;
+		drawn->quads_count = quads_count;
+	}
+
+	for (int i = 0; i < AFFE_DRAW_CACHE_BUCKETS; ++i)
+		drawn->buckets[i] = -1;
+
+	for (int i = 0; i < drawn->entries_count; ++i)
+	{
+		affe__drawn* entry = &drawn->entries[i];
+		if (entry->frame != drawn->frame) continue;
+
+		int* bucket = &drawn->buckets[entry->hash & (AFFE_DRAW_CACHE_BUCKETS - 1)];
+		entry->next = *bucket;
+		*bucket = i;
+	}
+
+	++drawn->frame;
+}
+
+static void affe__drawn__free(const affe_allocator* allocator, affe__drawn_cache* drawn)
+{
+	if (!drawn) return;
+
+	affe__free(allocator, drawn->entries);
+	affe__free(allocator, drawn->bytes);
+	affe__free(allocator, drawn->quads);
+	affe__free(allocator, drawn->scratch);
+	affe__free(allocator, drawn);
 }
 
 void affe_context_delete(affe_context* ctx)
@@ -583,45 +2248,89 @@ void affe_context_delete(affe_context* ctx)
 	if (ctx->info.delete_proc)
 		ctx->info.delete_proc(ctx, ctx->info.user_ptr);
 
-	for (int i = 0; i < ctx->fonts_count; ++i)
-		affe__font__free(ctx->fonts[i]);
+	if (ctx->cache)
+	{
+		affe__cache__detach(ctx->cache, ctx);
+		affe_cache_release(ctx->cache);
+	}
+
+	affe_allocator allocator = ctx->info.allocator;
+
+#ifndef AFFE_NO_THREADS
+	affe__pool__delete(&allocator, ctx->batch_pool);
+	affe__free(&allocator, ctx->batch_ranges);
+	affe__free(&allocator, ctx->batch_verts);
+#endif
+
+#ifdef AFFE_TRACE
+	affe__free(&allocator, ctx->trace_events);
+#endif
+
+	affe__drawn__free(&allocator, ctx->drawn);
 
-	if (ctx->verts) free(ctx->verts);
-	if (ctx->packer_nodes) free(ctx->packer_nodes);
-	if (ctx->fonts) free(ctx->fonts);
-	free(ctx);
+	affe__free(&allocator, ctx->verts);
+	affe__free(&allocator, ctx->verts_sorted);
+	affe__free(&allocator, ctx->commands);
+	affe__free(&allocator, ctx->commands_scratch);
+	affe__free(&allocator, ctx);
 }
 
 affe_context* affe_context_create(const affe_context_create_info* info)
 {
+	affe_allocator allocator = info->allocator;
+	affe__allocator__init(&allocator);
+
 	// Allocate context
-	affe_context* ctx = (affe_context*)malloc(sizeof(affe_context));
+	affe_context* ctx = (affe_context*)affe__malloc(&allocator, sizeof(affe_context));
 	if (!ctx) goto error;
 	memset(ctx, 0, sizeof(affe_context));
 
 	ctx->info = *info;
+	ctx->info.allocator = allocator;
+
+#ifdef AFFE_TRACE
+	ctx->trace_events = (affe_trace_event*)affe__malloc(&allocator, AFFE_TRACE_EVENTS * sizeof(affe_trace_event));
+	if (!ctx->trace_events) goto error;
+	ctx->trace_epoch = AFFE_TIMER_NOW();
+#endif
+
+	// Share or create the glyph cache
+	if (info->cache)
+	{
+		ctx->cache = info->cache;
+		++ctx->cache->refs;
+
+		ctx->info.width = ctx->cache->width;
+		ctx->info.height = ctx->cache->height;
+		ctx->info.edge_value = ctx->cache->edge_value;
+		ctx->info.size = ctx->cache->size;
+		ctx->info.padding = ctx->cache->padding;
+
+		// Uploads to a compressed atlas must cover whole blocks
+		if ((info->flags & AFFE_FLAGS_ATLAS_BC4) && ctx->cache->block != 4) goto error;
+	}
+	else
+	{
+		ctx->cache = affe__cache__create(&ctx->info);
+		if (!ctx->cache) goto error;
+	}
+
+	ctx->info.cache = ctx->cache;
 
-	// Setup rectangle packer
-	ctx->packer_nodes_count = ctx->info.width;
-	ctx->packer_nodes = (stbrp_node*)malloc(ctx->packer_nodes_count * sizeof(stbrp_node));
-	if (!ctx->packer_nodes) goto error;
-	stbrp_init_target(&ctx->packer, ctx->info.width, ctx->info.height, ctx->packer_nodes, ctx->packer_nodes_count);
+	if (!affe__cache__attach(ctx->cache, ctx)) goto error;
 
 	// Invoke user create function
 	if (ctx->info.create_proc)
 		if (ctx->info.create_proc(ctx, ctx->info.user_ptr, ctx->info.width, ctx->info.height) == FALSE)
 			goto error;
 
-	// Allocate font
-	ctx->fonts = (affe__font**)malloc(AFFE_INIT_FONTS * sizeof(affe__font*));
-	if (!ctx->fonts) goto error;
-	memset(ctx->fonts, 0, AFFE_INIT_FONTS * sizeof(affe__font*));
-	ctx->fonts_capacity = AFFE_INIT_FONTS;
-	ctx->fonts_count = 0;
+	// Glyphs already in a shared cache are needed by this context too
+	affe__cache__replay(ctx->cache, ctx);
 
 	// Allocate vertex buffer
 	ctx->buffer_flush_control = AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC;
-	ctx->verts = (affe_vertex*)malloc(ctx->info.buffer_quad_count * 6 * sizeof(affe_vertex));
+	ctx->batch_threads = 1;
+	ctx->verts = (affe_vertex*)affe__malloc(&ctx->info.allocator, ctx->info.buffer_quad_count * 6 * sizeof(affe_vertex));
 	if (!ctx->verts) goto error;
 
 	// Setup initial state
@@ -673,355 +2382,4085 @@ static unsigned int affe__decut(unsigned int* state, unsigned int* codep, unsign
 	return *state;
 }
 
-void affe_buffer_flush(affe_context* ctx)
+static void affe__buffer__draw(affe_context* ctx, unsigned int key, affe_vertex* verts, long long verts_count)
 {
-	if (!ctx) return;
-	if (ctx->verts_count <= 0) return;
-
-	if (ctx->info.draw_proc)
-		ctx->info.draw_proc(ctx, ctx->info.user_ptr, ctx->verts, ctx->verts_count);
+	ctx->flush_key = key;
+	++ctx->flush_draws;
 
-	ctx->verts_count = 0;
-}
+	AFFE__STAT_ADD(ctx, draw_calls, 1);
+	AFFE__STAT_ADD(ctx, draw_verts, verts_count);
 
-long long affe_buffer_size(affe_context* ctx)
-{
-	if (!ctx) return 0;
-	return ctx->info.buffer_quad_count * 6 * sizeof(affe_vertex);
+	if (ctx->info.draw_proc)
+	{
+		AFFE__TRACE_BEGIN(ctx, AFFE_ZONE_DRAW, 0);
+		ctx->info.draw_proc(ctx, ctx->info.user_ptr, verts, verts_count);
+		AFFE__TRACE_END(ctx, AFFE_ZONE_DRAW, 0, verts_count);
+	}
 }
 
-static unsigned int affe__hash(unsigned int a)
+// Stable merge sort of the recorded commands by key
+static void affe__buffer__sort(affe_context* ctx)
 {
-	a += ~(a << 15);
-	a ^= (a >> 10);
-	a += (a << 3);
-	a ^= (a >> 6);
-	a += ~(a << 11);
-	a ^= (a >> 16);
-	return a;
-}
+	affe__command* src = ctx->commands;
+	affe__command* dst = ctx->commands_scratch;
+	const int count = ctx->commands_count;
 
-static affe__glyph* affe__glyph__alloc(affe__font* font)
-{
-	if (font->glyphs_count + 1 > font->glyphs_capacity)
+	for (int width = 1; width < count; width *= 2)
 	{
-		font->glyphs_capacity = font->glyphs_capacity == 0 ? AFFE_INIT_GLYPHS : font->glyphs_capacity * 2;
-		affe__glyph* new_alloc = (affe__glyph*)realloc(font->glyphs, font->glyphs_capacity * sizeof(affe__glyph));
-		if (!new_alloc) return NULL;
-		font->glyphs = new_alloc;
+		for (int lo = 0; lo < count; lo += 2 * width)
+		{
+			int mid = lo + width < count ? lo + width : count;
+			int hi = lo + 2 * width < count ? lo + 2 * width : count;
+			int i = lo, j = mid, k = lo;
+
+			while (i < mid && j < hi) dst[k++] = src[j].key < src[i].key ? src[j++] : src[i++];
+			while (i < mid) dst[k++] = src[i++];
+			while (j < hi) dst[k++] = src[j++];
+		}
+
+		affe__command* swap = src;
+		src = dst;
+		dst = swap;
 	}
 
-	return &font->glyphs[font->glyphs_count++];
+	ctx->commands = src;
+	ctx->commands_scratch = dst;
 }
 
-static affe__glyph* affe__glyph__get(affe_context* ctx, affe__font* font, int codepoint, float size, int padding)
+static void affe__buffer__flush_sorted(affe_context* ctx)
 {
-	affe__font* font_render = font;
+	for (int i = 0; i < ctx->commands_count; ++i)
+		ctx->commands[i].count = (i + 1 < ctx->commands_count ? ctx->commands[i + 1].first : ctx->verts_count) - ctx->commands[i].first;
 
-	int hash = affe__hash(codepoint) & (AFFE_HASH_LUT_SIZE - 1);
-	int i = font->lut[hash];
-	while (i != -1)
+	if (!ctx->verts_sorted)
+		ctx->verts_sorted = (affe_vertex*)affe__malloc(&ctx->info.allocator, affe_buffer_size(ctx));
+
+	// Without a staging buffer draw in submission order
+	if (!ctx->verts_sorted)
 	{
-		if (font->glyphs[i].codepoint == codepoint && font->glyphs[i].size == size)
-			return &font->glyphs[i];
-		i = font->glyphs[i].next;
+		for (int i = 0; i < ctx->commands_count; ++i)
+			affe__buffer__draw(ctx, ctx->commands[i].key, ctx->verts + ctx->commands[i].first, ctx->commands[i].count);
+		return;
 	}
 
-	int glyph_index = stbtt_FindGlyphIndex(&font->metrics, codepoint);
+	affe__buffer__sort(ctx);
+
+	long long first = 0;
+	long long count = 0;
 
-	if (glyph_index == 0)
+	for (int i = 0; i < ctx->commands_count; ++i)
 	{
-		for (i = 0; i < font->fallbacks_count; ++i)
-		{
-			affe__font* font_fallback = ctx->fonts[font->fallbacks[i]];
-			int fallback_index = stbtt_FindGlyphIndex(&font_fallback->metrics, codepoint);
+		const affe__command* command = &ctx->commands[i];
 
-			if (fallback_index != 0)
-			{
-				glyph_index = fallback_index;
-				font_render = font_fallback;
-				break;
-			}
+		memcpy(ctx->verts_sorted + first + count, ctx->verts + command->first, command->count * sizeof(affe_vertex));
+		count += command->count;
+
+		if (i + 1 == ctx->commands_count || ctx->commands[i + 1].key != command->key)
+		{
+			affe__buffer__draw(ctx, command->key, ctx->verts_sorted + first, count);
+			first += count;
+			count = 0;
 		}
 	}
+}
 
-	affe__glyph* glyph = affe__glyph__alloc(font);
-	if (glyph == NULL) return NULL;
+void affe_buffer_flush(affe_context* ctx)
+{
+	if (!ctx) return;
 
-	float scale = stbtt_ScaleForPixelHeight(&font_render->metrics, size);
+	if (ctx->verts_count > 0)
+	{
+		AFFE__TRACE_BEGIN(ctx, AFFE_ZONE_FLUSH, 0);
+		ctx->flush_draws = 0;
+
+		if (ctx->commands_count > 1)
+			affe__buffer__flush_sorted(ctx);
+		else
+			affe__buffer__draw(ctx, ctx->commands_count == 1 ? ctx->commands[0].key : ctx->verts_key, ctx->verts, ctx->verts_count);
+
+		ctx->buffer_stats.draws = ctx->flush_draws;
+		ctx->buffer_stats.commands = ctx->flush_commands;
+		ctx->buffer_stats.total_commands += ctx->buffer_stats.commands;
+		ctx->buffer_stats.total_draws += ctx->buffer_stats.draws;
+		AFFE__TRACE_END(ctx, AFFE_ZONE_FLUSH, 0, ctx->flush_draws);
+	}
 
-	int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
-	stbtt_GetGlyphBox(&font_render->metrics, glyph_index, &x0, &y0, &x1, &y1);
+	ctx->verts_count = 0;
+	ctx->commands_count = 0;
+	ctx->flush_commands = 0;
+}
 
-	stbrp_rect rect;
-	memset(&rect, 0, sizeof(stbrp_rect));
+// Begin writing vertices with a pipeline key, outside of deferred control a key change flushes
+static void affe__buffer__key(affe_context* ctx, unsigned int key)
+{
+	if (key != ctx->verts_key && ctx->buffer_flush_control != AFFE_BUFFER_FLUSH_CONTROL_DEFERRED && ctx->verts_count > 0)
+		affe_buffer_flush(ctx);
 
-	unsigned char* pixels = stbtt_GetGlyphSDF(&font_render->metrics, scale, glyph_index, padding, (unsigned char)(ctx->info.edge_value * 255.0f), 255.0f / (float)padding, &rect.w, &rect.h, NULL, NULL);
+	ctx->verts_key = key;
+	++ctx->flush_commands;
+}
 
-	if (pixels)
+// Make room for `count` more vertices using the current key
+static void affe__buffer__reserve(affe_context* ctx, long long count)
+{
+	if (ctx->verts_count + count > ctx->info.buffer_quad_count * 6)
 	{
-		if (!stbrp_pack_rects(&ctx->packer, &rect, 1))
-		{
-			if (ctx->info.error_proc)
-				ctx->info.error_proc(ctx, ctx->info.user_ptr, AFFE_ERROR_ATLAS_FULL);
-			if (!stbrp_pack_rects(&ctx->packer, &rect, 1)) return NULL;
-		}
-
-		if (ctx->info.update_proc)
-			ctx->info.update_proc(ctx, ctx->info.user_ptr, rect.x, rect.y, rect.w, rect.h, pixels);
-
-		stbtt_FreeSDF(pixels, NULL);
+		// Keep the draw that is being written counted
+		affe_buffer_flush(ctx);
+		ctx->flush_commands = 1;
 	}
 
-	stbtt_GetGlyphHMetrics(&font_render->metrics, glyph_index, &glyph->advance, NULL);
+	if (ctx->buffer_flush_control != AFFE_BUFFER_FLUSH_CONTROL_DEFERRED) return;
+	if (ctx->commands_count > 0 && ctx->commands[ctx->commands_count - 1].key == ctx->verts_key) return;
 
-	glyph->s0 = rect.x;
-	glyph->t0 = rect.y + rect.h;
-	glyph->s1 = rect.x + rect.w;
-	glyph->t1 = rect.y;
+	if (ctx->commands_count + 1 > ctx->commands_capacity)
+	{
+		int new_capacity = ctx->commands_capacity == 0 ? AFFE_INIT_COMMANDS : ctx->commands_capacity * 2;
 
-	glyph->padding = (float)padding / scale;
-	glyph->x0 = x0 - glyph->padding;
-	glyph->y0 = y0 - glyph->padding;
-	glyph->x1 = x1 + glyph->padding;
-	glyph->y1 = y1 + glyph->padding;
+		affe__command* new_commands = (affe__command*)affe__realloc(&ctx->info.allocator, ctx->commands, new_capacity * sizeof(affe__command));
+		if (new_commands) ctx->commands = new_commands;
 
-	glyph->codepoint = codepoint;
-	glyph->size = size;
-	glyph->index = glyph_index;
+		affe__command* new_scratch = (affe__command*)affe__realloc(&ctx->info.allocator, ctx->commands_scratch, new_capacity * sizeof(affe__command));
+		if (new_scratch) ctx->commands_scratch = new_scratch;
 
-	glyph->next = font->lut[hash];
-	font->lut[hash] = font->glyphs_count - 1;
+		// Can't record, draw what we have so the key stays correct
+		if (!new_commands || !new_scratch)
+		{
+			affe_buffer_flush(ctx);
+			ctx->flush_commands = 1;
+			if (ctx->commands_capacity == 0) return;
+		}
+		else
+			ctx->commands_capacity = new_capacity;
+	}
 
-	return glyph;
+	affe__command* command = &ctx->commands[ctx->commands_count++];
+	command->key = ctx->verts_key;
+	command->first = ctx->verts_count;
+	command->count = 0;
 }
 
-struct affe__quad
-{
-	float x0, y0, x1, y1, s0, t0, s1, t1, r, g, b, a;
-};
-
-typedef struct affe__quad affe__quad;
-
-int affe__text__line(const char* string, const char* end, const char** line_end, const char** next_start)
+// Copy finished vertices into the buffer using the current key
+static void affe__buffer__write(affe_context* ctx, const affe_vertex* verts, long long verts_count)
 {
-	if (!string) return FALSE;
-	if (!end) end = string + strlen(string);
-
-	// since null(\0) needs to be checked to split the final line, add one to ensure the last line gets output
-	++end;
+	const long long capacity = ctx->info.buffer_quad_count * 6;
 
-	int checking_crlf = FALSE;
-
-	for (; string != end; ++string)
+	while (verts_count > 0)
 	{
-		unsigned int codepoint = *string;
-
-		if (checking_crlf)
-		{
-			if (codepoint == '\n')
-			{
-				*line_end = string - 1;
-				*next_start = string + 1;
-				return TRUE;
-			}
-
-			*line_end = string - 1;
-			*next_start = string;
-			return TRUE;
-		}
+		long long count = capacity - ctx->verts_count;
+		if (count > verts_count) count = verts_count;
+		count -= count % 6;
 
-		if (codepoint == '\r')
+		if (count <= 0)
 		{
-			checking_crlf = TRUE;
+			affe__buffer__reserve(ctx, 6);
 			continue;
 		}
-		else if (codepoint == '\n')
-		{
-			*line_end = string;
-			*next_start = string + 1;
-			return TRUE;
-		}
-		else if (codepoint == '\0')
-		{
-			*line_end = string;
-			*next_start = NULL;
-			return TRUE;
-		}
+
+		affe__buffer__reserve(ctx, count);
+		memcpy(ctx->verts + ctx->verts_count, verts, count * sizeof(affe_vertex));
+		ctx->verts_count += count;
+
+		verts += count;
+		verts_count -= count;
 	}
+}
 
-	return FALSE;
+unsigned int affe_buffer_key(affe_context* ctx)
+{
+	if (!ctx) return 0;
+	return ctx->flush_key;
 }
 
-void affe_text_draw(affe_context* ctx, float x, float y, const char* string, const char* end)
+const affe_effect* affe_buffer_effect(affe_context* ctx)
 {
-	if (!ctx) return;
-	if (!end) end = string + strlen(string);
+	if (!ctx) return NULL;
 
-	affe__state* state = affe__state__get(ctx);
-	if (state->font < 0 || state->font >= ctx->fonts_count) return;
+	unsigned int effect = AFFE_KEY_SHADER(ctx->flush_key);
+	if (effect == 0 || effect > (unsigned int)ctx->effects_count) return NULL;
 
-	affe__font* font = ctx->fonts[state->font];
-	if (!font->data) return;
+	return &ctx->effects[effect - 1];
+}
 
-	const int prev_flush_control = ctx->buffer_flush_control;
+void affe_buffer_stats_get(affe_context* ctx, affe_buffer_stats* stats)
+{
+	if (!ctx || !stats) return;
+	*stats = ctx->buffer_stats;
+}
 
-	if (prev_flush_control == AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC)
-		affe_buffer_flush_control(ctx, AFFE_BUFFER_FLUSH_CONTROL_NONE);
+// ----- memory -----
 
-	int line_height = font->ascent + font->line_gap - font->descent;
-	float scale = stbtt_ScaleForPixelHeight(&font->metrics, state->size);
+static void affe__memory__count(affe_context* ctx, affe_memory* memory)
+{
+	memset(memory, 0, sizeof(affe_memory));
+	long long* bytes = memory->bytes;
+
+	const affe_cache* cache = ctx->cache;
+	bytes[AFFE_MEMORY_OTHER] += sizeof(affe_cache) + cache->contexts_capacity * sizeof(affe_context*);
+	bytes[AFFE_MEMORY_FONTS] += cache->fonts_capacity * sizeof(affe__font*);
+
+	for (int i = 0; i < cache->fonts_count; ++i)
+	{
+		const affe__font* font = cache->fonts[i];
+		bytes[AFFE_MEMORY_FONTS] += sizeof(affe__font) + font->data_size;
+		bytes[AFFE_MEMORY_GLYPHS] += font->glyph_pages_capacity * sizeof(affe__glyph*) + (long long)font->glyph_pages_count * AFFE_INIT_GLYPHS * sizeof(affe__glyph);
+	}
+
+#ifdef AFFE_HARFBUZZ
+	bytes[AFFE_MEMORY_GLYPHS] += cache->runs_bytes;
+#endif
+
+	bytes[AFFE_MEMORY_PACKER] += cache->packer_nodes_count * sizeof(stbrp_node);
+	bytes[AFFE_MEMORY_STAGING] += (long long)(cache->scratch.size + cache->scratch.overflow_size);
+
+	bytes[AFFE_MEMORY_OTHER] += sizeof(affe_context);
+	bytes[AFFE_MEMORY_VERTICES] += affe_buffer_size(ctx) * (ctx->verts_sorted ? 2 : 1);
+	bytes[AFFE_MEMORY_VERTICES] += ctx->commands_capacity * 2 * sizeof(affe__command);
+
+#ifndef AFFE_NO_THREADS
+	if (ctx->batch_pool) bytes[AFFE_MEMORY_OTHER] += sizeof(affe__pool);
+	bytes[AFFE_MEMORY_VERTICES] += ctx->batch_ranges_capacity * sizeof(long long) + ctx->batch_verts_capacity * sizeof(affe_vertex);
+#endif
+
+#ifdef AFFE_TRACE
+	if (ctx->trace_events) bytes[AFFE_MEMORY_OTHER] += AFFE_TRACE_EVENTS * sizeof(affe_trace_event);
+#endif
+
+	if (ctx->drawn)
+	{
+		const affe__drawn_cache* drawn = ctx->drawn;
+		bytes[AFFE_MEMORY_VERTICES] += sizeof(affe__drawn_cache) + drawn->entries_capacity * sizeof(affe__drawn) + drawn->bytes_capacity;
+		bytes[AFFE_MEMORY_VERTICES] += drawn->quads_capacity * sizeof(affe__drawn_quad) + drawn->scratch_capacity * sizeof(affe_vertex);
+	}
+
+	for (int i = 0; i < AFFE_MEMORY_COUNT; ++i)
+		memory->total += bytes[i];
+
+	memory->budget = ctx->info.memory_budget;
+	memory->trims = ctx->memory_trims;
+}
+
+static long long affe__memory__total(affe_context* ctx)
+{
+	affe_memory memory;
+	affe__memory__count(ctx, &memory);
+	return memory.total;
+}
+
+void affe_memory_get(affe_context* ctx, affe_memory* memory)
+{
+	if (!memory) return;
+	memset(memory, 0, sizeof(affe_memory));
+	if (!ctx) return;
+
+	affe__memory__count(ctx, memory);
+}
+
+// Free buffers that are allocated again when needed, and shrink the rasterizer scratch memory back to its initial size
+static void affe__memory__staging(affe_context* ctx)
+{
+	affe__scratch* scratch = &ctx->cache->scratch;
+
+	if (scratch->size > AFFE_INIT_SCRATCH && scratch->used == 0 && !scratch->overflow)
+	{
+		affe__free(&scratch->allocator, scratch->base);
+		scratch->base = (unsigned char*)affe__malloc(&scratch->allocator, AFFE_INIT_SCRATCH);
+		scratch->size = scratch->base ? AFFE_INIT_SCRATCH : 0;
+	}
+
+	affe__free(&ctx->info.allocator, ctx->verts_sorted);
+	ctx->verts_sorted = NULL;
+
+	// Deferred commands still waiting for a flush are kept
+	if (ctx->commands_count == 0)
+	{
+		affe__free(&ctx->info.allocator, ctx->commands);
+		affe__free(&ctx->info.allocator, ctx->commands_scratch);
+		ctx->commands = NULL;
+		ctx->commands_scratch = NULL;
+		ctx->commands_capacity = 0;
+	}
+
+#ifndef AFFE_NO_THREADS
+	affe__free(&ctx->info.allocator, ctx->batch_ranges);
+	affe__free(&ctx->info.allocator, ctx->batch_verts);
+	ctx->batch_ranges = NULL;
+	ctx->batch_verts = NULL;
+	ctx->batch_ranges_capacity = 0;
+	ctx->batch_verts_capacity = 0;
+#endif
+
+	if (ctx->drawn)
+	{
+		affe__free(&ctx->info.allocator, ctx->drawn->scratch);
+		ctx->drawn->scratch = NULL;
+		ctx->drawn->scratch_capacity = 0;
+	}
+}
+
+// Drop every kept draw, the draw cache stays enabled
+static void affe__memory__drawn(affe_context* ctx)
+{
+	affe__drawn_cache* drawn = ctx->drawn;
+	if (!drawn) return;
+
+	affe__free(&ctx->info.allocator, drawn->entries);
+	affe__free(&ctx->info.allocator, drawn->bytes);
+	affe__free(&ctx->info.allocator, drawn->quads);
+
+	drawn->entries = NULL;
+	drawn->entries_count = drawn->entries_capacity = 0;
+	drawn->bytes = NULL;
+	drawn->bytes_count = drawn->bytes_capacity = 0;
+	drawn->quads = NULL;
+	drawn->quads_count = drawn->quads_capacity = 0;
+
+	for (int i = 0; i < AFFE_DRAW_CACHE_BUCKETS; ++i)
+		drawn->buckets[i] = -1;
+}
+
+// Invalidate the glyph cache and free its glyph tables, they are allocated again as glyphs are drawn
+static void affe__memory__glyphs(affe_context* ctx)
+{
+	affe_cache_invalidate(ctx);
+
+	affe_cache* cache = ctx->cache;
+
+	for (int i = 0; i < cache->fonts_count; ++i)
+	{
+		affe__font* font = cache->fonts[i];
+
+		for (int j = 0; j < font->glyph_pages_count; ++j)
+			affe__free(&cache->allocator, font->glyph_pages[j]);
+
+		affe__free(&cache->allocator, font->glyph_pages);
+		font->glyph_pages = NULL;
+		font->glyph_pages_count = 0;
+		font->glyph_pages_capacity = 0;
+	}
+}
+
+long long affe_memory_trim(affe_context* ctx, long long budget)
+{
+	if (!ctx) return 0;
+
+	long long total = affe__memory__total(ctx);
+	if (total <= budget) return total;
+
+	affe__memory__staging(ctx);
+	total = affe__memory__total(ctx);
+	if (total <= budget) return total;
+
+#ifdef AFFE_HARFBUZZ
+	affe__run__clear(ctx->cache);
+	total = affe__memory__total(ctx);
+	if (total <= budget) return total;
+#endif
+
+	affe__memory__drawn(ctx);
+	total = affe__memory__total(ctx);
+	if (total <= budget) return total;
+
+	affe__memory__glyphs(ctx);
+	return affe__memory__total(ctx);
+}
+
+void affe_frame_end(affe_context* ctx)
+{
+	if (!ctx) return;
+
+	AFFE__TRACE_INSTANT(ctx, AFFE_ZONE_FRAME, 0);
+
+	if (ctx->drawn)
+		affe__drawn__frame_end(ctx->drawn);
+
+	if (ctx->info.memory_budget > 0 && affe__memory__total(ctx) > ctx->info.memory_budget)
+	{
+		++ctx->memory_trims;
+
+		if (affe_memory_trim(ctx, ctx->info.memory_budget) > ctx->info.memory_budget && ctx->info.error_proc)
+			ctx->info.error_proc(ctx, ctx->info.user_ptr, AFFE_ERROR_MEMORY_BUDGET);
+	}
+
+#ifndef AFFE_NO_STATS
+	ctx->stats.frames = 1;
+	ctx->stats.atlas_used = ctx->cache->atlas_used;
+	ctx->stats.atlas_size = (long long)ctx->cache->width * ctx->cache->height;
+
+	ctx->stats_frame = ctx->stats;
+
+	ctx->stats_total.glyph_hits += ctx->stats.glyph_hits;
+	ctx->stats_total.glyph_misses += ctx->stats.glyph_misses;
+	ctx->stats_total.rasterize_time += ctx->stats.rasterize_time;
+	ctx->stats_total.update_calls += ctx->stats.update_calls;
+	ctx->stats_total.update_bytes += ctx->stats.update_bytes;
+	ctx->stats_total.draw_calls += ctx->stats.draw_calls;
+	ctx->stats_total.draw_verts += ctx->stats.draw_verts;
+	ctx->stats_total.invalidations += ctx->stats.invalidations;
+	ctx->stats_total.draw_cache_hits += ctx->stats.draw_cache_hits;
+	ctx->stats_total.draw_cache_misses += ctx->stats.draw_cache_misses;
+	ctx->stats_total.atlas_used = ctx->stats.atlas_used;
+	ctx->stats_total.atlas_size = ctx->stats.atlas_size;
+	ctx->stats_total.frames += ctx->stats.frames;
+
+	memset(&ctx->stats, 0, sizeof(affe_stats));
+#endif
+}
+
+void affe_stats_get(affe_context* ctx, affe_stats* frame, affe_stats* total)
+{
+	if (frame) memset(frame, 0, sizeof(affe_stats));
+	if (total) memset(total, 0, sizeof(affe_stats));
+	if (!ctx) return;
+
+#ifndef AFFE_NO_STATS
+	if (frame) *frame = ctx->stats_frame;
+	if (total) *total = ctx->stats_total;
+#endif
+}
+
+void affe_stats_reset(affe_context* ctx)
+{
+	if (!ctx) return;
+
+#ifndef AFFE_NO_STATS
+	memset(&ctx->stats, 0, sizeof(affe_stats));
+	memset(&ctx->stats_frame, 0, sizeof(affe_stats));
+	memset(&ctx->stats_total, 0, sizeof(affe_stats));
+#endif
+}
+
+long long affe_buffer_size(affe_context* ctx)
+{
+	if (!ctx) return 0;
+	return ctx->info.buffer_quad_count * 6 * sizeof(affe_vertex);
+}
+
+static unsigned int affe__hash(unsigned int a)
+{
+	a += ~(a << 15);
+	a ^= (a >> 10);
+	a += (a << 3);
+	a ^= (a >> 6);
+	a += ~(a << 11);
+	a ^= (a >> 16);
+	return a;
+}
+
+static affe__glyph* affe__glyph__alloc(affe_cache* cache, affe__font* font)
+{
+	int page = font->glyphs_count / AFFE_INIT_GLYPHS;
+
+	// Pages are kept after an invalidation, only a new page needs allocated
+	if (page >= font->glyph_pages_count)
+	{
+		if (font->glyph_pages_count + 1 > font->glyph_pages_capacity)
+		{
+			int new_capacity = font->glyph_pages_capacity == 0 ? 4 : font->glyph_pages_capacity * 2;
+			affe__glyph** new_pages = (affe__glyph**)affe__realloc(&cache->allocator, font->glyph_pages, new_capacity * sizeof(affe__glyph*));
+			if (!new_pages) return NULL;
+
+			font->glyph_pages = new_pages;
+			font->glyph_pages_capacity = new_capacity;
+		}
+
+		affe__glyph* new_page = (affe__glyph*)affe__malloc(&cache->allocator, AFFE_INIT_GLYPHS * sizeof(affe__glyph));
+		if (!new_page) return NULL;
+
+		font->glyph_pages[font->glyph_pages_count++] = new_page;
+	}
+
+	return affe__font__glyph(font, font->glyphs_count++);
+}
+
+// Look up a cached glyph without modifying the cache, returns NULL on a miss
+static affe__glyph* affe__glyph__find(affe__font* font, unsigned int codepoint, float size)
+{
+	if (codepoint < AFFE_DIRECT_GLYPHS)
+	{
+		affe__glyph* glyph = font->direct[codepoint];
+		if (glyph && glyph->size == size) return glyph;
+	}
+
+	int i = font->lut[affe__hash(codepoint) & (AFFE_HASH_LUT_SIZE - 1)];
+	while (i != -1)
+	{
+		affe__glyph* glyph = affe__font__glyph(font, i);
+		if (glyph->codepoint == codepoint && glyph->size == size)
+			return glyph;
+		i = glyph->next;
+	}
+
+	return NULL;
+}
+
+// Glyph index of a codepoint in the font or the first fallback that has it, `*font_render` is set to the font used
+static int affe__font__index(affe_context* ctx, affe__font* font, unsigned int codepoint, affe__font** font_render)
+{
+	*font_render = font;
+
+	// Shaped glyphs already are indices into this font
+	if (codepoint & AFFE__GLYPH_INDEX) return (int)(codepoint & ~AFFE__GLYPH_INDEX);
+
+	int glyph_index = stbtt_FindGlyphIndex(&font->metrics, codepoint);
+	if (glyph_index != 0) return glyph_index;
+
+	for (int i = 0; i < font->fallbacks_count; ++i)
+	{
+		affe__font* font_fallback = ctx->cache->fonts[font->fallbacks[i]];
+		int fallback_index = stbtt_FindGlyphIndex(&font_fallback->metrics, codepoint);
+
+		if (fallback_index != 0)
+		{
+			*font_render = font_fallback;
+			return fallback_index;
+		}
+	}
+
+	return 0;
+}
+
+// Nearest integer, halves away from zero
+static float affe__roundf(float value)
+{
+	return (float)(long long)(value < 0.0f ? value - 0.5f : value + 0.5f);
+}
+
+// Sizes below zero rasterize coverage bitmaps at that many pixels instead of a distance field, see `affe__state__glyph_size`
+static affe__glyph* affe__glyph__get(affe_context* ctx, affe__font* font, unsigned int codepoint, float size, int padding)
+{
+	affe__glyph* cached = affe__glyph__find(font, codepoint, size);
+	if (cached)
+	{
+		AFFE__STAT_ADD(ctx, glyph_hits, 1);
+		return cached;
+	}
+
+	AFFE__STAT_ADD(ctx, glyph_misses, 1);
+
+	affe__font* font_render;
+
+	int hash = affe__hash(codepoint) & (AFFE_HASH_LUT_SIZE - 1);
+	int glyph_index = affe__font__index(ctx, font, codepoint, &font_render);
+
+	// Negative sizes are coverage bitmaps at that pixel size
+	const int bitmap = size < 0.0f;
+	float scale = stbtt_ScaleForPixelHeight(&font_render->metrics, bitmap ? -size : size);
+
+	int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+	stbtt_GetGlyphBox(&font_render->metrics, glyph_index, &x0, &y0, &x1, &y1);
+
+	stbrp_rect rect;
+	memset(&rect, 0, sizeof(stbrp_rect));
+
+	AFFE__TRACE_BEGIN(ctx, AFFE_ZONE_RASTERIZE, 0);
+	AFFE__TIMER_BEGIN(rasterize_begin);
+	// Scratch memory is reset once the pixels are uploaded
+	unsigned char* pixels = NULL;
+
+	if (bitmap)
+	{
+		int ix0 = 0, iy0 = 0, ix1 = 0, iy1 = 0;
+		pixels = affe__glyph__bitmap(&ctx->cache->scratch, &font_render->metrics, glyph_index, scale, &rect.w, &rect.h, &ix0, &iy0, &ix1, &iy1);
+
+		if (pixels)
+		{
+			// Box in whole pixels, y up
+			x0 = ix0;
+			y0 = -iy1;
+			x1 = ix1;
+			y1 = -iy0;
+		}
+	}
+	else
+	{
+		pixels = stbtt_GetGlyphSDF(&font_render->metrics, scale, glyph_index, padding, (unsigned char)(ctx->info.edge_value * 255.0f), 255.0f / (float)padding, &rect.w, &rect.h, NULL, NULL);
+	}
+
+	AFFE__TIMER_END(ctx, rasterize_time, rasterize_begin);
+	AFFE__TRACE_END(ctx, AFFE_ZONE_RASTERIZE, 0, codepoint);
+
+	if (pixels)
+	{
+		// Packed and uploaded in whole packer units, the glyph keeps its own size
+		const int block = ctx->cache->block;
+		const int w = rect.w, h = rect.h;
+
+		int upload_w = w, upload_h = h;
+		unsigned char* upload = affe__cache__pad(ctx->cache, pixels, &upload_w, &upload_h);
+		rect.w = upload_w / block;
+		rect.h = upload_h / block;
+
+		int packed = upload && stbrp_pack_rects(&ctx->cache->packer, &rect, 1);
+
+		if (upload && !packed)
+		{
+			if (ctx->info.error_proc)
+				ctx->info.error_proc(ctx, ctx->info.user_ptr, AFFE_ERROR_ATLAS_FULL);
+
+			packed = stbrp_pack_rects(&ctx->cache->packer, &rect, 1);
+		}
+
+		if (!packed)
+		{
+			if (!bitmap) stbtt_FreeSDF(pixels, font_render->metrics.userdata);
+			affe__scratch__reset(&ctx->cache->scratch);
+			return NULL;
+		}
+
+		rect.x *= block;
+		rect.y *= block;
+		rect.w = w;
+		rect.h = h;
+
+		affe__cache__upload(ctx->cache, rect.x, rect.y, upload_w, upload_h, upload);
+
+#ifndef AFFE_NO_STATS
+		ctx->cache->atlas_used += (long long)upload_w * upload_h;
+#endif
+
+		if (!bitmap) stbtt_FreeSDF(pixels, font_render->metrics.userdata);
+	}
+	else if (bitmap)
+	{
+		// Empty glyphs keep no box
+		rect.w = rect.h = 0;
+	}
+
+	affe__scratch__reset(&ctx->cache->scratch);
+
+	// Allocated after packing, an invalidation from a full atlas resets the glyph table
+	affe__glyph* glyph = affe__glyph__alloc(ctx->cache, font);
+	if (glyph == NULL) return NULL;
+
+	stbtt_GetGlyphHMetrics(&font_render->metrics, glyph_index, &glyph->advance, NULL);
+
+	glyph->s0 = rect.x;
+	glyph->t0 = rect.y + rect.h;
+	glyph->s1 = rect.x + rect.w;
+	glyph->t1 = rect.y;
+
+	glyph->u0 = (float)glyph->s0 / (float)ctx->info.width;
+	glyph->v0 = (float)glyph->t0 / (float)ctx->info.height;
+	glyph->u1 = (float)glyph->s1 / (float)ctx->info.width;
+	glyph->v1 = (float)glyph->t1 / (float)ctx->info.height;
+
+	if (bitmap)
+	{
+		// Whole pixels to font units, quads are snapped back to pixels when emitted
+		glyph->padding = (int)(1.0f / scale);
+		glyph->x0 = (int)affe__roundf((float)(x0 - 1) / scale);
+		glyph->y0 = (int)affe__roundf((float)(y0 - 1) / scale);
+		glyph->x1 = (int)affe__roundf((float)(x1 + 1) / scale);
+		glyph->y1 = (int)affe__roundf((float)(y1 + 1) / scale);
+	}
+	else
+	{
+		glyph->padding = (float)padding / scale;
+		glyph->x0 = x0 - glyph->padding;
+		glyph->y0 = y0 - glyph->padding;
+		glyph->x1 = x1 + glyph->padding;
+		glyph->y1 = y1 + glyph->padding;
+	}
+
+	glyph->codepoint = codepoint;
+	glyph->size = size;
+	glyph->index = glyph_index;
+	glyph->render = font_render;
+
+	glyph->next = font->lut[hash];
+	font->lut[hash] = font->glyphs_count - 1;
+
+	if (codepoint < AFFE_DIRECT_GLYPHS && size == ctx->cache->size)
+		font->direct[codepoint] = glyph;
+
+	return glyph;
+}
+
+// Read as three float4s by `affe__quad__verts`, keep the order
+struct affe__quad
+{
+	float x0, y0, x1, y1, s0, t0, s1, t1, r, g, b, a;
+};
+
+typedef struct affe__quad affe__quad;
+
+// Quad of a cached glyph with the pen at `x`, `y`
+// Returns FALSE if the glyph has no pixels
+static int affe__glyph__quad(const affe__state* state, const affe__glyph* glyph, float scale, float x, float y, affe__quad* quad)
+{
+	if (glyph->s0 == glyph->s1 || glyph->t0 == glyph->t1) return FALSE;
+
+	if (glyph->size < 0.0f)
+	{
+		// Coverage bitmaps map one texel to one pixel
+		quad->x0 = affe__roundf(x + (float)glyph->x0 * scale);
+		quad->y0 = affe__roundf(y + (float)glyph->y0 * scale);
+		quad->x1 = quad->x0 + (float)(glyph->s1 - glyph->s0);
+		quad->y1 = quad->y0 + (float)(glyph->t0 - glyph->t1);
+	}
+	else
+	{
+		quad->x0 = x + (float)glyph->x0 * scale;
+		quad->y0 = y + (float)glyph->y0 * scale;
+		quad->x1 = x + (float)glyph->x1 * scale;
+		quad->y1 = y + (float)glyph->y1 * scale;
+	}
+
+	quad->s0 = glyph->u0;
+	quad->t0 = glyph->v0;
+	quad->s1 = glyph->u1;
+	quad->t1 = glyph->v1;
+
+	quad->r = state->r;
+	quad->g = state->g;
+	quad->b = state->b;
+	quad->a = state->a;
+
+	return TRUE;
+}
+
+// Area text is culled against, the viewport and the state's clip rectangle
+struct affe__clip
+{
+	float x0, y0, x1, y1;
+
+	// Quads crossing the edges are cut, otherwise they are only culled
+	int cut;
+};
+
+typedef struct affe__clip affe__clip;
+
+// Returns FALSE when there is nothing to cull against
+static int affe__clip__get(const affe_context* ctx, const affe__state* state, affe__clip* clip)
+{
+	const int viewport = ctx->canvas_width > 0 && ctx->canvas_height > 0;
+	if (!viewport && !state->clip) return FALSE;
+
+	clip->cut = state->clip;
+
+	if (state->clip)
+	{
+		clip->x0 = state->clip_x0;
+		clip->y0 = state->clip_y0;
+		clip->x1 = state->clip_x1;
+		clip->y1 = state->clip_y1;
+	}
+	else
+	{
+		clip->x0 = 0.0f;
+		clip->y0 = 0.0f;
+		clip->x1 = (float)ctx->canvas_width;
+		clip->y1 = (float)ctx->canvas_height;
+	}
+
+	if (viewport)
+	{
+		if (clip->x0 < 0.0f) clip->x0 = 0.0f;
+		if (clip->y0 < 0.0f) clip->y0 = 0.0f;
+		if (clip->x1 > (float)ctx->canvas_width) clip->x1 = (float)ctx->canvas_width;
+		if (clip->y1 > (float)ctx->canvas_height) clip->y1 = (float)ctx->canvas_height;
+	}
+
+	return TRUE;
+}
+
+// Returns FALSE if no glyph of the font on the baseline `y` can be visible
+static int affe__clip__line(const affe__clip* clip, const affe__font* font, float scale, float y)
+{
+	return clip->x0 < clip->x1 && y + (float)font->y_min * scale < clip->y1 && y + (float)font->y_max * scale > clip->y0;
+}
+
+// Cut a quad to the clip rectangle, texture coordinates are cut along with it
+// Returns FALSE if nothing of the quad is visible
+static int affe__clip__quad(const affe__clip* clip, affe__quad* quad)
+{
+	if (quad->x1 <= clip->x0 || quad->x0 >= clip->x1 || quad->y1 <= clip->y0 || quad->y0 >= clip->y1) return FALSE;
+	if (!clip->cut) return TRUE;
+
+	if (quad->x0 < clip->x0)
+	{
+		quad->s0 += (quad->s1 - quad->s0) * (clip->x0 - quad->x0) / (quad->x1 - quad->x0);
+		quad->x0 = clip->x0;
+	}
+
+	if (quad->x1 > clip->x1)
+	{
+		quad->s1 -= (quad->s1 - quad->s0) * (quad->x1 - clip->x1) / (quad->x1 - quad->x0);
+		quad->x1 = clip->x1;
+	}
+
+	if (quad->y0 < clip->y0)
+	{
+		quad->t0 += (quad->t1 - quad->t0) * (clip->y0 - quad->y0) / (quad->y1 - quad->y0);
+		quad->y0 = clip->y0;
+	}
+
+	if (quad->y1 > clip->y1)
+	{
+		quad->t1 -= (quad->t1 - quad->t0) * (quad->y1 - clip->y1) / (quad->y1 - quad->y0);
+		quad->y1 = clip->y1;
+	}
+
+	return TRUE;
+}
+
+// Index of the lowest set bit, `bits` must not be zero
+static int affe__ctz(unsigned long long bits)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, bits);
+	return (int)index;
+#else
+	return __builtin_ctzll(bits);
+#endif
+}
+
+// Find the first carriage return or line feed in [string, end), returns `end` if there is none
+static const char* affe__text__find_eol(const char* string, const char* end)
+{
+#ifdef AFFE__AVX2
+	const __m256i cr32 = _mm256_set1_epi8('\r');
+	const __m256i lf32 = _mm256_set1_epi8('\n');
+
+	for (; end - string >= 32; string += 32)
+	{
+		__m256i chunk = _mm256_loadu_si256((const __m256i*)string);
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, cr32), _mm256_cmpeq_epi8(chunk, lf32)));
+		if (mask) return string + affe__ctz(mask);
+	}
+#endif
+#if defined(AFFE__SSE2)
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+
+	for (; end - string >= 16; string += 16)
+	{
+		__m128i chunk = _mm_loadu_si128((const __m128i*)string);
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, lf)));
+		if (mask) return string + affe__ctz(mask);
+	}
+#elif defined(AFFE__NEON)
+	const uint8x16_t cr = vdupq_n_u8('\r');
+	const uint8x16_t lf = vdupq_n_u8('\n');
+
+	for (; end - string >= 16; string += 16)
+	{
+		uint8x16_t chunk = vld1q_u8((const unsigned char*)string);
+		uint8x16_t eq = vorrq_u8(vceqq_u8(chunk, cr), vceqq_u8(chunk, lf));
+		// narrow each byte compare to a nibble, no movemask on neon
+		unsigned long long mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+		if (mask) return string + (affe__ctz(mask) >> 2);
+	}
+#endif
+
+	for (; string != end; ++string)
+		if (*string == '\r' || *string == '\n') break;
+
+	return string;
+}
+
+// Split the next line from [string, end), crlf, cr and lf are all treated as a single line break
+// `line_end` is exclusive, `next_start` is set to NULL once the final line is output
+// Returns FALSE when there are no more lines
+static int affe__text__line(const char* string, const char* end, const char** line_end, const char** next_start)
+{
+	if (!string) return FALSE;
+	if (!end) end = string + strlen(string);
+
+	const char* eol = affe__text__find_eol(string, end);
+	*line_end = eol;
+
+	if (eol == end)
+		*next_start = NULL;
+	else if (*eol == '\r' && eol + 1 != end && eol[1] == '\n')
+		*next_start = eol + 2;
+	else
+		*next_start = eol + 1;
+
+	return TRUE;
+}
+
+// Decode utf8 from `*string` into `codepoints` until `end` or `capacity` codepoints are written
+// Ascii runs are widened in bulk, well formed 2 and 3 byte sequences are decoded directly,
+// everything else goes through the dfa. Invalid sequences are skipped.
+// Returns the number of codepoints written, zero only once `end` is reached
+static int affe__utf8__decode(const char** string, const char* end, unsigned int* codepoints, int capacity)
+{
+	const unsigned char* s = (const unsigned char*)*string;
+	const unsigned char* e = (const unsigned char*)end;
+	int count = 0;
+
+	while (s != e && count < capacity)
+	{
+#if defined(AFFE__SSE2)
+		const __m128i zero = _mm_setzero_si128();
+
+		while (e - s >= 16 && capacity - count >= 16)
+		{
+			__m128i chunk = _mm_loadu_si128((const __m128i*)s);
+			if (_mm_movemask_epi8(chunk) != 0) break;
+
+			__m128i lo = _mm_unpacklo_epi8(chunk, zero);
+			__m128i hi = _mm_unpackhi_epi8(chunk, zero);
+			_mm_storeu_si128((__m128i*)(codepoints + count + 0), _mm_unpacklo_epi16(lo, zero));
+			_mm_storeu_si128((__m128i*)(codepoints + count + 4), _mm_unpackhi_epi16(lo, zero));
+			_mm_storeu_si128((__m128i*)(codepoints + count + 8), _mm_unpacklo_epi16(hi, zero));
+			_mm_storeu_si128((__m128i*)(codepoints + count + 12), _mm_unpackhi_epi16(hi, zero));
+
+			s += 16;
+			count += 16;
+		}
+#elif defined(AFFE__NEON)
+		while (e - s >= 16 && capacity - count >= 16)
+		{
+			uint8x16_t chunk = vld1q_u8(s);
+			if (vmaxvq_u8(chunk) >= 0x80) break;
+
+			uint16x8_t lo = vmovl_u8(vget_low_u8(chunk));
+			uint16x8_t hi = vmovl_u8(vget_high_u8(chunk));
+			vst1q_u32(codepoints + count + 0, vmovl_u16(vget_low_u16(lo)));
+			vst1q_u32(codepoints + count + 4, vmovl_u16(vget_high_u16(lo)));
+			vst1q_u32(codepoints + count + 8, vmovl_u16(vget_low_u16(hi)));
+			vst1q_u32(codepoints + count + 12, vmovl_u16(vget_high_u16(hi)));
+
+			s += 16;
+			count += 16;
+		}
+#endif
+		if (s == e || count >= capacity) break;
+
+		unsigned int c = *s;
+
+		if (c < 0x80)
+		{
+			codepoints[count++] = c;
+			++s;
+			continue;
+		}
+
+		// latin and most other 2 byte scripts
+		if (c >= 0xC2 && c <= 0xDF && e - s >= 2 && (s[1] & 0xC0) == 0x80)
+		{
+			codepoints[count++] = ((c & 0x1F) << 6) | (s[1] & 0x3F);
+			s += 2;
+			continue;
+		}
+
+		// cjk and the rest of the bmp, E0 and ED have restricted second bytes and are left to the dfa
+		if (((c >= 0xE1 && c <= 0xEC) || c == 0xEE || c == 0xEF) && e - s >= 3 && (s[1] & 0xC0) == 0x80 && (s[2] & 0xC0) == 0x80)
+		{
+			codepoints[count++] = ((c & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+			s += 3;
+			continue;
+		}
+
+		unsigned int codepoint = 0;
+		unsigned int utf8state = AFFE_UTF8_ACCEPT;
+		const unsigned char* start = s;
+
+		for (; s != e; ++s)
+		{
+			unsigned int ret = affe__decut(&utf8state, &codepoint, *s);
+
+			if (ret == AFFE_UTF8_REJECT)
+			{
+				// drop the invalid prefix, the rejected byte may start the next sequence
+				if (s == start) ++s;
+				break;
+			}
+
+			if (ret != AFFE_UTF8_ACCEPT) continue;
+
+			codepoints[count++] = codepoint;
+			++s;
+			break;
+		}
+	}
+
+	*string = (const char*)s;
+	return count;
+}
+
+// Horizontal ink extents and advance of a glyph in font units, as `affe__glyph__get` stores them
+// Glyphs missing from the cache are measured without rasterizing, this only reads the font and is safe on worker threads
+static void affe__glyph__measure(affe_context* ctx, affe__font* font, unsigned int codepoint, int* x0, int* x1, int* advance)
+{
+	affe__glyph* glyph = affe__glyph__find(font, codepoint, ctx->info.size);
+
+	if (glyph)
+	{
+		*x0 = glyph->x0 + glyph->padding;
+		*x1 = glyph->x1 - glyph->padding;
+		*advance = glyph->advance;
+		return;
+	}
+
+	affe__font* font_render;
+	int glyph_index = affe__font__index(ctx, font, codepoint, &font_render);
+
+	int y0 = 0, y1 = 0;
+	*x0 = 0;
+	*x1 = 0;
+	stbtt_GetGlyphBox(&font_render->metrics, glyph_index, x0, &y0, x1, &y1);
+	stbtt_GetGlyphHMetrics(&font_render->metrics, glyph_index, advance, NULL);
+}
+
+static void affe__text_width(affe_context* ctx, affe__font* font, const char* string, const char* end, int* left, int* right, int* advance)
+{
+	int lhs = INT_MAX;
+	int rhs = INT_MIN;
+	int cursor = 0;
+
+	unsigned int codepoints[AFFE_DECODE_CHUNK];
+	int codepoints_count;
+
+	while ((codepoints_count = affe__utf8__decode(&string, end, codepoints, AFFE_DECODE_CHUNK)) > 0)
+	for (int i = 0; i < codepoints_count; ++i)
+	{
+		int glyph_x0, glyph_x1, glyph_advance;
+		affe__glyph__measure(ctx, font, codepoints[i], &glyph_x0, &glyph_x1, &glyph_advance);
+
+		if (cursor + glyph_x0 < lhs) lhs = cursor + glyph_x0;
+		if (cursor + glyph_x1 > rhs) rhs = cursor + glyph_x1;
+
+		cursor += glyph_advance;
+	}
+
+	*left = lhs;
+	*right = rhs;
+	if (advance) *advance = cursor;
+}
+
+// A growable vertex array, owned by whatever records into it
+struct affe__stream
+{
+	affe_vertex* verts;
+	long long count;
+	long long capacity;
+
+	// Memory owned by someone else, quads past the capacity fail instead of growing it
+	int fixed;
+};
+
+typedef struct affe__stream affe__stream;
+
+// Caller memory written by `affe_text_emit` and `affe_text_quads`
+struct affe__target
+{
+	// `affe_text_quad`s are written when NULL
+	const affe_vertex_format* format;
+
+	// Only counts quads when NULL
+	unsigned char* verts;
+
+	// In quads
+	long long capacity;
+	long long count;
+};
+
+typedef struct affe__target affe__target;
+
+static void affe__target__vertex(const affe__target* target, unsigned char* vertex, float x, float y, float s, float t, const void* color, size_t color_size)
+{
+	const affe_vertex_format* format = target->format;
+
+	if (format->position != AFFE_INVALID)
+	{
+		memcpy(vertex + format->position, &x, sizeof(float));
+		memcpy(vertex + format->position + sizeof(float), &y, sizeof(float));
+	}
+
+	if (format->texcoord != AFFE_INVALID)
+	{
+		memcpy(vertex + format->texcoord, &s, sizeof(float));
+		memcpy(vertex + format->texcoord + sizeof(float), &t, sizeof(float));
+	}
+
+	if (format->color != AFFE_INVALID)
+		memcpy(vertex + format->color, color, color_size);
+}
+
+static unsigned char affe__unorm8(float value)
+{
+	if (value <= 0.0f) return 0;
+	if (value >= 1.0f) return 255;
+	return (unsigned char)(value * 255.0f + 0.5f);
+}
+
+static int affe__target__quad(affe__target* target, const affe__quad* quad)
+{
+	if (target->count >= target->capacity) return FALSE;
+
+	if (target->verts && !target->format)
+	{
+		affe_text_quad* out = (affe_text_quad*)target->verts + target->count;
+
+		out->x0 = quad->x0;
+		out->y0 = quad->y0;
+		out->x1 = quad->x1;
+		out->y1 = quad->y1;
+
+		out->s0 = quad->s0;
+		out->t0 = quad->t0;
+		out->s1 = quad->s1;
+		out->t1 = quad->t1;
+
+		out->r = quad->r;
+		out->g = quad->g;
+		out->b = quad->b;
+		out->a = quad->a;
+	}
+	else if (target->verts)
+	{
+		const affe_vertex_format* format = target->format;
+
+		float color_float[4] = { quad->r, quad->g, quad->b, quad->a };
+		unsigned char color_rgba8[4] = { affe__unorm8(quad->r), affe__unorm8(quad->g), affe__unorm8(quad->b), affe__unorm8(quad->a) };
+
+		const void* color = format->color_type == AFFE_COLOR_RGBA8 ? (const void*)color_rgba8 : (const void*)color_float;
+		const size_t color_size = format->color_type == AFFE_COLOR_RGBA8 ? sizeof(color_rgba8) : sizeof(color_float);
+
+		unsigned char* v = target->verts + target->count * format->quad_vertices * format->stride;
+		const long long stride = format->stride;
+
+		if (format->quad_vertices == 4)
+		{
+			affe__target__vertex(target, v + 0 * stride, quad->x0, quad->y0, quad->s0, quad->t0, color, color_size);
+			affe__target__vertex(target, v + 1 * stride, quad->x1, quad->y0, quad->s1, quad->t0, color, color_size);
+			affe__target__vertex(target, v + 2 * stride, quad->x1, quad->y1, quad->s1, quad->t1, color, color_size);
+			affe__target__vertex(target, v + 3 * stride, quad->x0, quad->y1, quad->s0, quad->t1, color, color_size);
+		}
+		else
+		{
+			affe__target__vertex(target, v + 0 * stride, quad->x0, quad->y1, quad->s0, quad->t1, color, color_size);
+			affe__target__vertex(target, v + 1 * stride, quad->x0, quad->y0, quad->s0, quad->t0, color, color_size);
+			affe__target__vertex(target, v + 2 * stride, quad->x1, quad->y1, quad->s1, quad->t1, color, color_size);
+
+			affe__target__vertex(target, v + 3 * stride, quad->x1, quad->y1, quad->s1, quad->t1, color, color_size);
+			affe__target__vertex(target, v + 4 * stride, quad->x0, quad->y0, quad->s0, quad->t0, color, color_size);
+			affe__target__vertex(target, v + 5 * stride, quad->x1, quad->y0, quad->s1, quad->t0, color, color_size);
+		}
+	}
+
+	++target->count;
+	return TRUE;
+}
+
+// Where a line of text is emitted to
+struct affe__sink
+{
+	// Only read the glyph cache, emission stops at the first missing glyph
+	int read_only;
+
+	// Quads are appended here, or to the context buffer when NULL
+	affe__stream* stream;
+
+	// Quads are written to caller memory when set, takes priority over `stream`
+	affe__target* target;
+};
+
+typedef struct affe__sink affe__sink;
+
+// Two triangles of a quad, each vertex position and texture coordinate is shuffled from the bounds and coordinates
+static void affe__quad__verts(const affe__quad* quad, affe_vertex* v)
+{
+#if defined(AFFE__SSE2)
+	const __m128 bounds = _mm_loadu_ps(&quad->x0);
+	const __m128 coords = _mm_loadu_ps(&quad->s0);
+	const __m128 color = _mm_loadu_ps(&quad->r);
+
+	const __m128 top_left = _mm_shuffle_ps(bounds, coords, _MM_SHUFFLE(3, 0, 3, 0));
+	const __m128 bottom_left = _mm_shuffle_ps(bounds, coords, _MM_SHUFFLE(1, 0, 1, 0));
+	const __m128 top_right = _mm_shuffle_ps(bounds, coords, _MM_SHUFFLE(3, 2, 3, 2));
+	const __m128 bottom_right = _mm_shuffle_ps(bounds, coords, _MM_SHUFFLE(1, 2, 1, 2));
+
+#	ifdef AFFE__AVX2
+	// A whole vertex per store, the corner in the low half and the color in the high half
+	_mm256_storeu_ps(&v[0].x, _mm256_insertf128_ps(_mm256_castps128_ps256(top_left), color, 1));
+	_mm256_storeu_ps(&v[1].x, _mm256_insertf128_ps(_mm256_castps128_ps256(bottom_left), color, 1));
+	_mm256_storeu_ps(&v[2].x, _mm256_insertf128_ps(_mm256_castps128_ps256(top_right), color, 1));
+	_mm256_storeu_ps(&v[3].x, _mm256_insertf128_ps(_mm256_castps128_ps256(top_right), color, 1));
+	_mm256_storeu_ps(&v[4].x, _mm256_insertf128_ps(_mm256_castps128_ps256(bottom_left), color, 1));
+	_mm256_storeu_ps(&v[5].x, _mm256_insertf128_ps(_mm256_castps128_ps256(bottom_right), color, 1));
+#	else
+	_mm_storeu_ps(&v[0].x, top_left);
+	_mm_storeu_ps(&v[0].r, color);
+	_mm_storeu_ps(&v[1].x, bottom_left);
+	_mm_storeu_ps(&v[1].r, color);
+	_mm_storeu_ps(&v[2].x, top_right);
+	_mm_storeu_ps(&v[2].r, color);
+	_mm_storeu_ps(&v[3].x, top_right);
+	_mm_storeu_ps(&v[3].r, color);
+	_mm_storeu_ps(&v[4].x, bottom_left);
+	_mm_storeu_ps(&v[4].r, color);
+	_mm_storeu_ps(&v[5].x, bottom_right);
+	_mm_storeu_ps(&v[5].r, color);
+#	endif
+#elif defined(AFFE__NEON)
+	const float32x4_t bounds = vld1q_f32(&quad->x0);
+	const float32x4_t coords = vld1q_f32(&quad->s0);
+	const float32x4_t color = vld1q_f32(&quad->r);
+
+	// Low and high halves give the bottom left and top right corners, the other two mix their odd lanes
+	const uint32x4_t odd = vreinterpretq_u32_u64(vdupq_n_u64(0xFFFFFFFF00000000ull));
+	const float32x4_t bottom_left = vcombine_f32(vget_low_f32(bounds), vget_low_f32(coords));
+	const float32x4_t top_right = vcombine_f32(vget_high_f32(bounds), vget_high_f32(coords));
+	const float32x4_t top_left = vbslq_f32(odd, top_right, bottom_left);
+	const float32x4_t bottom_right = vbslq_f32(odd, bottom_left, top_right);
+
+	vst1q_f32(&v[0].x, top_left);
+	vst1q_f32(&v[0].r, color);
+	vst1q_f32(&v[1].x, bottom_left);
+	vst1q_f32(&v[1].r, color);
+	vst1q_f32(&v[2].x, top_right);
+	vst1q_f32(&v[2].r, color);
+	vst1q_f32(&v[3].x, top_right);
+	vst1q_f32(&v[3].r, color);
+	vst1q_f32(&v[4].x, bottom_left);
+	vst1q_f32(&v[4].r, color);
+	vst1q_f32(&v[5].x, bottom_right);
+	vst1q_f32(&v[5].r, color);
+#else
+	v[0] = affe_vertex(quad->x0, quad->y1, quad->s0, quad->t1, quad->r, quad->g, quad->b, quad->a);
+	v[1] = affe_vertex(quad->x0, quad->y0, quad->s0, quad->t0, quad->r, quad->g, quad->b, quad->a);
+	v[2] = affe_vertex(quad->x1, quad->y1, quad->s1, quad->t1, quad->r, quad->g, quad->b, quad->a);
+
+	v[3] = affe_vertex(quad->x1, quad->y1, quad->s1, quad->t1, quad->r, quad->g, quad->b, quad->a);
+	v[4] = affe_vertex(quad->x0, quad->y0, quad->s0, quad->t0, quad->r, quad->g, quad->b, quad->a);
+	v[5] = affe_vertex(quad->x1, quad->y0, quad->s1, quad->t0, quad->r, quad->g, quad->b, quad->a);
+#endif
+}
+
+static int affe__sink__quad(affe_context* ctx, affe__sink* sink, const affe__quad* quad)
+{
+	affe_vertex* v;
+
+	if (sink->target)
+		return affe__target__quad(sink->target, quad);
+
+	if (sink->stream)
+	{
+		affe__stream* stream = sink->stream;
+
+		if (stream->count + 6 > stream->capacity)
+		{
+			if (stream->fixed) return FALSE;
+
+			long long new_capacity = stream->capacity == 0 ? ctx->info.buffer_quad_count * 6 : stream->capacity * 2;
+			if (new_capacity < stream->count + 6) new_capacity = stream->count + 6;
+
+			affe_vertex* new_verts = (affe_vertex*)affe__realloc(&ctx->info.allocator, stream->verts, new_capacity * sizeof(affe_vertex));
+			if (!new_verts) return FALSE;
+
+			stream->verts = new_verts;
+			stream->capacity = new_capacity;
+		}
+
+		v = stream->verts + stream->count;
+		stream->count += 6;
+	}
+	else
+	{
+		affe__buffer__reserve(ctx, 6);
+		v = ctx->verts + ctx->verts_count;
+		ctx->verts_count += 6;
+	}
+
+	affe__quad__verts(quad, v);
+	return TRUE;
+}
+
+static float affe__clampf(float value, float min, float max)
+{
+	return value < min ? min : value > max ? max : value;
+}
+
+// Returns TRUE if the state has an effect to draw
+static int affe__state__effect_active(const affe__state* state)
+{
+	const affe_effect* effect = &state->effect;
+	return (effect->outline_width > 0.0f && effect->outline_a > 0.0f) || effect->shadow_a > 0.0f || (effect->glow_width > 0.0f && effect->glow_a > 0.0f);
+}
+
+// Returns TRUE if the state's text is drawn from coverage bitmaps, effects need the distance field
+static int affe__state__bitmap(const affe__state* state)
+{
+	return state->bitmap_below > 0.0f && state->size > 0.0f && state->size < state->bitmap_below && !affe__state__effect_active(state);
+}
+
+// Index of the state's effect in the effect table, 0 without an effect
+// A full table is flushed and cleared, so the buffer never refers to a replaced effect
+static unsigned int affe__effect__intern(affe_context* ctx, const affe__state* state)
+{
+	const affe_effect* effect = &state->effect;
+
+	const int outline = effect->outline_width > 0.0f && effect->outline_a > 0.0f;
+	const int shadow = effect->shadow_a > 0.0f;
+	const int glow = effect->glow_width > 0.0f && effect->glow_a > 0.0f;
+
+	if (!outline && !shadow && !glow) return 0;
+
+	// Pixels to atlas texels, limited to what the padding holds
+	const float texels = ctx->info.size / state->size;
+	const float reach = ctx->info.edge_value * (float)ctx->info.padding;
+	const float offset = 0.5f * (float)ctx->info.padding;
+
+	affe_effect converted;
+	memset(&converted, 0, sizeof(affe_effect));
+
+	if (outline)
+	{
+		converted.outline_width = affe__clampf(effect->outline_width * texels, 0.0f, reach);
+		converted.outline_r = effect->outline_r;
+		converted.outline_g = effect->outline_g;
+		converted.outline_b = effect->outline_b;
+		converted.outline_a = effect->outline_a;
+	}
+
+	if (shadow)
+	{
+		converted.shadow_x = affe__clampf(effect->shadow_x * texels, -offset, offset);
+		converted.shadow_y = affe__clampf(effect->shadow_y * texels, -offset, offset);
+		converted.shadow_softness = affe__clampf(effect->shadow_softness * texels, 0.0f, reach);
+		converted.shadow_r = effect->shadow_r;
+		converted.shadow_g = effect->shadow_g;
+		converted.shadow_b = effect->shadow_b;
+		converted.shadow_a = effect->shadow_a;
+	}
+
+	if (glow)
+	{
+		converted.glow_width = affe__clampf(effect->glow_width * texels, 0.0f, reach);
+		converted.glow_r = effect->glow_r;
+		converted.glow_g = effect->glow_g;
+		converted.glow_b = effect->glow_b;
+		converted.glow_a = effect->glow_a;
+	}
+
+	for (int i = 0; i < ctx->effects_count; ++i)
+	{
+		if (memcmp(&ctx->effects[i], &converted, sizeof(affe_effect)) == 0)
+			return (unsigned int)(i + 1);
+	}
+
+	if (ctx->effects_count >= AFFE_MAX_EFFECTS)
+	{
+		affe_buffer_flush(ctx);
+		ctx->effects_count = 0;
+	}
+
+	ctx->effects[ctx->effects_count++] = converted;
+	return (unsigned int)ctx->effects_count;
+}
+
+// Render thread only, interns the state's effect
+static unsigned int affe__state__key(affe_context* ctx, const affe__state* state)
+{
+	if (affe__state__bitmap(state))
+		return AFFE_KEY_MAKE(0, AFFE_SHADER_COVERAGE, state->blend);
+
+	return AFFE_KEY_MAKE(0, affe__effect__intern(ctx, state), state->blend);
+}
+
+// Size glyphs of the state are cached at, negative for coverage bitmaps
+static float affe__state__glyph_size(const affe_context* ctx, const affe__state* state)
+{
+	return affe__state__bitmap(state) ? -state->size : ctx->info.size;
+}
+
+// Scale a glyph into `direct` for `font->direct_scale`, rasterizing it if needed
+static const affe__direct* affe__direct__fill(affe_context* ctx, affe__font* font, unsigned int codepoint, affe__direct* direct)
+{
+	if (direct->stamp == font->direct_stamp)
+	{
+		AFFE__STAT_ADD(ctx, glyph_hits, 1);
+		return direct;
+	}
+
+	affe__glyph* glyph = affe__glyph__get(ctx, font, codepoint, ctx->info.size, ctx->info.padding);
+	if (!glyph) return NULL;
+
+	float scale = font->direct_scale;
+
+	direct->x0 = (float)glyph->x0 * scale;
+	direct->y0 = (float)glyph->y0 * scale;
+	direct->x1 = (float)glyph->x1 * scale;
+	direct->y1 = (float)glyph->y1 * scale;
+	direct->advance = (float)glyph->advance * scale;
+
+	direct->s0 = glyph->u0;
+	direct->t0 = glyph->v0;
+	direct->s1 = glyph->u1;
+	direct->t1 = glyph->v1;
+
+	direct->visible = glyph->s0 != glyph->s1 && glyph->t0 != glyph->t1;
+
+	// Read after rasterizing, a full atlas may have changed the stamp
+	direct->stamp = font->direct_stamp;
+	return direct;
+}
+
+// Get a low codepoint scaled by `font->direct_scale`, rasterizes on a miss
+static const affe__direct* affe__direct__get(affe_context* ctx, affe__font* font, unsigned int codepoint)
+{
+	return affe__direct__fill(ctx, font, codepoint, &font->direct_quads[codepoint]);
+}
+
+// Emit a line of text with the pen starting at `x`, `clip` may be NULL
+// When `pen` is set it receives the pen position past the text, otherwise emission stops at the first glyph past the clip rectangle
+// Returns FALSE if the sink could not take every quad
+static int affe__text__emit_at(affe_context* ctx, const affe__state* state, affe__font* font, float scale, const affe__clip* clip, float x, float y, const char* string, const char* end, affe__sink* sink, float* pen)
+{
+	// Lines outside of the clip rectangle only advance the pen
+	const int line_visible = !clip || affe__clip__line(clip, font, scale, y);
+	if (!line_visible && !pen) return TRUE;
+
+	// Pixels any glyph can reach around the pen
+	const float reach_x0 = (float)font->x_min * scale;
+	const float reach_x1 = (float)font->x_max * scale;
+
+	// Caller memory has no pipeline key to tell coverage apart, it always gets the distance field
+	const int bitmap = !sink->target && affe__state__bitmap(state);
+	const float glyph_size = bitmap ? -state->size : ctx->info.size;
+
+	if (!sink->stream && !sink->target)
+		affe__buffer__key(ctx, affe__state__key(ctx, state));
+
+	// Recorders emit from worker threads and must not write the font
+	if (!sink->read_only && font->direct_scale != scale)
+	{
+		font->direct_scale = scale;
+		++font->direct_stamp;
+	}
+
+	unsigned int codepoints[AFFE_DECODE_CHUNK];
+	int codepoints_count;
+
+	while ((codepoints_count = affe__utf8__decode(&string, end, codepoints, AFFE_DECODE_CHUNK)) > 0)
+	for (int i = 0; i < codepoints_count; ++i)
+	{
+		// Culled glyphs are skipped before they are looked up or rasterized
+		if (clip && (!line_visible || x + reach_x1 <= clip->x0 || x + reach_x0 >= clip->x1))
+		{
+			// Advances never move the pen left, nothing after this is visible
+			if (!pen && x + reach_x0 >= clip->x1) return TRUE;
+
+			int glyph_x0, glyph_x1, glyph_advance;
+			affe__glyph__measure(ctx, font, codepoints[i], &glyph_x0, &glyph_x1, &glyph_advance);
+			x += (float)glyph_advance * scale;
+			continue;
+		}
+
+		if (codepoints[i] < AFFE_DIRECT_GLYPHS && !sink->read_only && !bitmap)
+		{
+			const affe__direct* direct = affe__direct__get(ctx, font, codepoints[i]);
+			if (!direct) continue;
+
+			if (direct->visible)
+			{
+				affe__quad quad;
+
+				quad.x0 = x + direct->x0;
+				quad.y0 = y + direct->y0;
+				quad.x1 = x + direct->x1;
+				quad.y1 = y + direct->y1;
+
+				quad.s0 = direct->s0;
+				quad.t0 = direct->t0;
+				quad.s1 = direct->s1;
+				quad.t1 = direct->t1;
+
+				quad.r = state->r;
+				quad.g = state->g;
+				quad.b = state->b;
+				quad.a = state->a;
+
+				if ((!clip || affe__clip__quad(clip, &quad)) && !affe__sink__quad(ctx, sink, &quad)) return FALSE;
+			}
+
+			x += direct->advance;
+			continue;
+		}
+
+		affe__glyph* glyph = sink->read_only ?
+			affe__glyph__find(font, codepoints[i], glyph_size) :
+			affe__glyph__get(ctx, font, codepoints[i], glyph_size, ctx->info.padding);
+
+		if (!glyph)
+		{
+			if (sink->read_only) return FALSE;
+			continue;
+		}
+
+		affe__quad quad;
+		if (affe__glyph__quad(state, glyph, scale, x, y, &quad) && (!clip || affe__clip__quad(clip, &quad)) && !affe__sink__quad(ctx, sink, &quad)) return FALSE;
+
+		x += (float)glyph->advance * scale;
+	}
+
+	if (pen) *pen = x;
+	return TRUE;
+}
+
+#ifdef AFFE_HARFBUZZ
+// Returns TRUE if the text has a codepoint of a script that needs shaping
+static int affe__shape__complex(const char* string, const char* end)
+{
+	// Everything below U+0580 is drawn per codepoint, those lead bytes are below 0xD6
+	while (string < end && (unsigned char)*string < 0xD6) ++string;
+	if (string == end) return FALSE;
+
+	unsigned int codepoints[AFFE_DECODE_CHUNK];
+	int codepoints_count;
+
+	while ((codepoints_count = affe__utf8__decode(&string, end, codepoints, AFFE_DECODE_CHUNK)) > 0)
+	for (int i = 0; i < codepoints_count; ++i)
+	{
+		const unsigned int c = codepoints[i];
+
+		if ((c >= 0x0590 && c <= 0x08FF)     // Hebrew, Arabic, Syriac, Thaana, NKo
+			|| (c >= 0x0900 && c <= 0x109F)  // Indic, Thai, Lao, Tibetan, Myanmar
+			|| (c >= 0x1780 && c <= 0x18AF)  // Khmer, Mongolian
+			|| (c >= 0xFB1D && c <= 0xFDFF)  // Hebrew and Arabic presentation forms
+			|| (c >= 0xFE70 && c <= 0xFEFF)) // Arabic presentation forms B
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+// Hands HarfBuzz the font tables straight from the font data, nothing is copied
+static hb_blob_t* affe__shape__table(hb_face_t* face, hb_tag_t tag, void* user_data)
+{
+	(void)face;
+
+	const affe__font* font = (const affe__font*)user_data;
+	const unsigned char* data = font->metrics.data;
+	const unsigned char* directory = data + font->metrics.fontstart;
+
+	const int tables_count = (directory[4] << 8) | directory[5];
+
+	for (int i = 0; i < tables_count; ++i)
+	{
+		const unsigned char* record = directory + 12 + i * 16;
+		const hb_tag_t record_tag = HB_TAG(record[0], record[1], record[2], record[3]);
+		if (record_tag != tag) continue;
+
+		const unsigned int offset = ((unsigned int)record[8] << 24) | (record[9] << 16) | (record[10] << 8) | record[11];
+		const unsigned int length = ((unsigned int)record[12] << 24) | (record[13] << 16) | (record[14] << 8) | record[15];
+		return hb_blob_create((const char*)data + offset, length, HB_MEMORY_MODE_READONLY, NULL, NULL);
+	}
+
+	return hb_blob_get_empty();
+}
+
+// Shaped glyphs of a line, shaping it on a miss
+// With `read_only` the run cache is only read, returns NULL on a miss or when shaping fails
+static const affe__run* affe__run__get(affe_context* ctx, int font_id, const char* string, const char* end, int read_only)
+{
+	affe_cache* cache = ctx->cache;
+	const int text_size = (int)(end - string);
+
+	unsigned int hash = 2166136261u ^ affe__hash((unsigned int)font_id);
+	for (int i = 0; i < text_size; ++i)
+		hash = (hash ^ (unsigned char)string[i]) * 16777619u;
+
+	affe__run** bucket = &cache->runs[hash & (AFFE_SHAPE_BUCKETS - 1)];
+
+	for (const affe__run* run = *bucket; run; run = run->next)
+		if (run->hash == hash && run->font == font_id && run->text_size == text_size && memcmp(affe__run__text(run), string, text_size) == 0)
+			return run;
+
+	if (read_only) return NULL;
+
+	affe__font* font = cache->fonts[font_id];
+
+	if (!font->shaper)
+	{
+		hb_face_t* face = hb_face_create_for_tables(&affe__shape__table, font, NULL);
+		const int units_per_em = (int)hb_face_get_upem(face);
+
+		// Positions come back in font units, the same units glyph metrics are kept in
+		font->shaper = hb_font_create(face);
+		hb_font_set_scale(font->shaper, units_per_em, units_per_em);
+		hb_face_destroy(face);
+	}
+
+	if (!cache->shape_buffer)
+	{
+		cache->shape_buffer = hb_buffer_create();
+
+		if (!hb_buffer_allocation_successful(cache->shape_buffer))
+		{
+			hb_buffer_destroy(cache->shape_buffer);
+			cache->shape_buffer = NULL;
+			return NULL;
+		}
+	}
+
+	AFFE__TRACE_BEGIN(ctx, AFFE_ZONE_SHAPE, 0);
+
+	hb_buffer_t* buffer = cache->shape_buffer;
+	hb_buffer_clear_contents(buffer);
+	hb_buffer_add_utf8(buffer, string, text_size, 0, text_size);
+	hb_buffer_guess_segment_properties(buffer);
+	hb_shape(font->shaper, buffer, NULL, 0);
+
+	unsigned int glyphs_count = 0;
+	const hb_glyph_info_t* infos = hb_buffer_get_glyph_infos(buffer, &glyphs_count);
+	const hb_glyph_position_t* positions = hb_buffer_get_glyph_positions(buffer, NULL);
+
+	AFFE__TRACE_END(ctx, AFFE_ZONE_SHAPE, 0, glyphs_count);
+	if (glyphs_count == 0) return NULL;
+
+	if (cache->runs_count >= AFFE_SHAPE_RUNS)
+		affe__run__clear(cache);
+
+	const size_t run_size = sizeof(affe__run) + glyphs_count * sizeof(affe__shaped) + text_size;
+	affe__run* run = (affe__run*)affe__malloc(&cache->allocator, run_size);
+	if (!run) return NULL;
+
+	cache->runs_bytes += (long long)run_size;
+
+	run->hash = hash;
+	run->font = font_id;
+	run->text_size = text_size;
+	run->glyphs_count = (int)glyphs_count;
+
+	affe__shaped* glyphs = affe__run__glyphs(run);
+	for (unsigned int i = 0; i < glyphs_count; ++i)
+	{
+		glyphs[i].index = infos[i].codepoint | AFFE__GLYPH_INDEX;
+		glyphs[i].advance = positions[i].x_advance;
+		glyphs[i].x_offset = positions[i].x_offset;
+		glyphs[i].y_offset = positions[i].y_offset;
+	}
+
+	memcpy((char*)affe__run__text(run), string, text_size);
+
+	run->next = *bucket;
+	*bucket = run;
+	++cache->runs_count;
+
+	return run;
+}
+
+// Emit a shaped line aligned by the state, `clip` may be NULL
+// Returns FALSE if the sink could not take every quad
+static int affe__run__emit(affe_context* ctx, const affe__state* state, affe__font* font, float scale, const affe__clip* clip, float x, float y, const affe__run* run, affe__sink* sink)
+{
+	const affe__shaped* glyphs = affe__run__glyphs(run);
+
+	// calculate alignment from the shaped glyph boxes
+	{
+		int left = INT_MAX, right = INT_MIN, cursor = 0;
+
+		for (int i = 0; i < run->glyphs_count; ++i)
+		{
+			int glyph_x0, glyph_x1, glyph_advance;
+			affe__glyph__measure(ctx, font, glyphs[i].index, &glyph_x0, &glyph_x1, &glyph_advance);
+
+			if (cursor + glyphs[i].x_offset + glyph_x0 < left) left = cursor + glyphs[i].x_offset + glyph_x0;
+			if (cursor + glyphs[i].x_offset + glyph_x1 > right) right = cursor + glyphs[i].x_offset + glyph_x1;
+
+			cursor += glyphs[i].advance;
+		}
+
+		float width = (float)(right - left) * scale;
+
+		x -= (float)left * scale;
+
+		if (state->alignment & AFFE_ALIGN_CENTER)
+			x -= width * 0.5f;
+		else if (state->alignment & AFFE_ALIGN_RIGHT)
+			x -= width;
+	}
+
+	const float reach_x0 = (float)font->x_min * scale;
+	const float reach_x1 = (float)font->x_max * scale;
+
+	const float glyph_size = !sink->target && affe__state__bitmap(state) ? -state->size : ctx->info.size;
+
+	if (!sink->stream && !sink->target)
+		affe__buffer__key(ctx, affe__state__key(ctx, state));
+
+	int cursor = 0;
+
+	for (int i = 0; i < run->glyphs_count; ++i)
+	{
+		const float glyph_x = x + (float)(cursor + glyphs[i].x_offset) * scale;
+		const float glyph_y = y + (float)glyphs[i].y_offset * scale;
+		cursor += glyphs[i].advance;
+
+		if (clip && (glyph_x + reach_x1 <= clip->x0 || glyph_x + reach_x0 >= clip->x1)) continue;
+
+		affe__glyph* glyph = sink->read_only ?
+			affe__glyph__find(font, glyphs[i].index, glyph_size) :
+			affe__glyph__get(ctx, font, glyphs[i].index, glyph_size, ctx->info.padding);
+
+		if (!glyph)
+		{
+			if (sink->read_only) return FALSE;
+			continue;
+		}
+
+		affe__quad quad;
+		if (affe__glyph__quad(state, glyph, scale, glyph_x, glyph_y, &quad) && (!clip || affe__clip__quad(clip, &quad)) && !affe__sink__quad(ctx, sink, &quad)) return FALSE;
+	}
+
+	return TRUE;
+}
+#endif
+
+// Lay out a line of text and emit its quads, line endings are not respected
+// Returns FALSE if the sink could not take every quad
+static int affe__text__emit(affe_context* ctx, const affe__state* state, float x, float y, const char* string, const char* end, affe__sink* sink)
+{
+	if (state->font < 0 || state->font >= ctx->cache->fonts_count) return TRUE;
+
+	affe__font* font = ctx->cache->fonts[state->font];
+	if (!font->data) return TRUE;
+
+	float scale = stbtt_ScaleForPixelHeight(&font->metrics, state->size);
+
+	affe__clip clip;
+	const int culling = affe__clip__get(ctx, state, &clip);
+
+	// Skipped before any decoding
+	if (culling && !affe__clip__line(&clip, font, scale, y)) return TRUE;
+
+#ifdef AFFE_HARFBUZZ
+	// Lines of complex scripts are shaped, anything else stays on the codepoint path
+	if (affe__shape__complex(string, end))
+	{
+		const affe__run* run = affe__run__get(ctx, state->font, string, end, sink->read_only);
+		if (run) return affe__run__emit(ctx, state, font, scale, culling ? &clip : NULL, x, y, run, sink);
+		if (sink->read_only) return FALSE;
+	}
+#endif
+
+	// calculate alignment
+	{
+		int left, right;
+		affe__text_width(ctx, font, string, end, &left, &right, NULL);
+
+		float width = (float)(right - left) * scale;
+
+		x -= (float)left * scale;
+
+		if (state->alignment & AFFE_ALIGN_CENTER)
+			x -= width * 0.5f;
+		else if (state->alignment & AFFE_ALIGN_RIGHT)
+			x -= width;
+	}
+
+	return affe__text__emit_at(ctx, state, font, scale, culling ? &clip : NULL, x, y, string, end, sink, NULL);
+}
+
+// Emit text line by line, line endings are respected
+// Returns FALSE if the sink could not take every quad
+static int affe__text__emit_lines(affe_context* ctx, const affe__state* state, float x, float y, const char* string, const char* end, affe__sink* sink)
+{
+	if (state->font < 0 || state->font >= ctx->cache->fonts_count) return TRUE;
+
+	affe__font* font = ctx->cache->fonts[state->font];
+	if (!font->data) return TRUE;
+
+	int line_height = font->ascent + font->line_gap - font->descent;
+	float scale = stbtt_ScaleForPixelHeight(&font->metrics, state->size);
+
+	const float line_height_scaled = (float)line_height * scale;
+
+	affe__clip clip;
+	const int culling = affe__clip__get(ctx, state, &clip);
+
+	const char* line_end, * next_start;
+	while (affe__text__line(string, end, &line_end, &next_start))
+	{
+		// Lines only move down, the rest of the text is below the clip rectangle
+		if (culling && y + (float)font->y_max * scale <= clip.y0) break;
+
+		if (!affe__text__emit(ctx, state, x, y, string, line_end, sink)) return FALSE;
+		y -= line_height_scaled;
+		string = next_start;
+	}
+
+	return TRUE;
+}
+
+// ----- draw cache -----
+
+static unsigned int affe__drawn__hash(const affe__state* state, float x, float y, const char* string, const char* end, int lines)
+{
+	unsigned int hash = 2166136261u;
+	for (const char* c = string; c < end; ++c)
+		hash = (hash ^ (unsigned char)*c) * 16777619u;
+
+	// The rest of the state is compared on a match
+	unsigned int bits[4];
+	memcpy(&bits[0], &x, sizeof(float));
+	memcpy(&bits[1], &y, sizeof(float));
+	memcpy(&bits[2], &state->size, sizeof(float));
+	memcpy(&bits[3], &state->r, sizeof(float));
+
+	for (int i = 0; i < 4; ++i)
+		hash = affe__hash(hash ^ bits[i]);
+
+	return hash ^ (unsigned int)lines ^ ((unsigned int)state->font << 1);
+}
+
+// Grow the draw cache to take one more draw, returns FALSE on failure
+static int affe__drawn__reserve(affe_context* ctx, affe__drawn_cache* drawn, long long text_count, long long quads_count)
+{
+	if (drawn->entries_count + 1 > drawn->entries_capacity)
+	{
+		int new_capacity = drawn->entries_capacity == 0 ? AFFE_INIT_RECORDER_ITEMS : drawn->entries_capacity * 2;
+		affe__drawn* new_entries = (affe__drawn*)affe__realloc(&ctx->info.allocator, drawn->entries, new_capacity * sizeof(affe__drawn));
+		if (!new_entries) return FALSE;
+
+		drawn->entries = new_entries;
+		drawn->entries_capacity = new_capacity;
+	}
+
+	if (drawn->bytes_count + text_count > drawn->bytes_capacity || !drawn->bytes)
+	{
+		long long new_capacity = drawn->bytes_capacity == 0 ? AFFE_INIT_DOCUMENT : drawn->bytes_capacity;
+		while (new_capacity < drawn->bytes_count + text_count) new_capacity *= 2;
+
+		char* new_bytes = (char*)affe__realloc(&ctx->info.allocator, drawn->bytes, new_capacity);
+		if (!new_bytes) return FALSE;
+
+		drawn->bytes = new_bytes;
+		drawn->bytes_capacity = new_capacity;
+	}
+
+	if (drawn->quads_count + quads_count > drawn->quads_capacity)
+	{
+		long long new_capacity = drawn->quads_capacity == 0 ? ctx->info.buffer_quad_count : drawn->quads_capacity;
+		while (new_capacity < drawn->quads_count + quads_count) new_capacity *= 2;
+
+		affe__drawn_quad* new_quads = (affe__drawn_quad*)affe__realloc(&ctx->info.allocator, drawn->quads, new_capacity * sizeof(affe__drawn_quad));
+		if (!new_quads) return FALSE;
+
+		drawn->quads = new_quads;
+		drawn->quads_capacity = new_capacity;
+	}
+
+	return TRUE;
+}
+
+// Expand kept quads into the buffer using the current key, like `affe__buffer__write`
+static void affe__drawn__write(affe_context* ctx, const affe__drawn* entry, const affe__drawn_quad* quads)
+{
+	const long long capacity = ctx->info.buffer_quad_count * 6;
+
+	affe__quad quad;
+	quad.r = entry->state.r;
+	quad.g = entry->state.g;
+	quad.b = entry->state.b;
+	quad.a = entry->state.a;
+
+	long long quads_count = entry->count;
+
+	while (quads_count > 0)
+	{
+		long long count = (capacity - ctx->verts_count) / 6;
+		if (count > quads_count) count = quads_count;
+
+		if (count <= 0)
+		{
+			affe__buffer__reserve(ctx, 6);
+			continue;
+		}
+
+		affe__buffer__reserve(ctx, count * 6);
+		affe_vertex* v = ctx->verts + ctx->verts_count;
+
+		for (long long i = 0; i < count; ++i, v += 6)
+		{
+			quad.x0 = quads[i].x0;
+			quad.y0 = quads[i].y0;
+			quad.x1 = quads[i].x1;
+			quad.y1 = quads[i].y1;
+			quad.s0 = quads[i].s0;
+			quad.t0 = quads[i].t0;
+			quad.s1 = quads[i].s1;
+			quad.t1 = quads[i].t1;
+			affe__quad__verts(&quad, v);
+		}
+
+		ctx->verts_count += count * 6;
+		quads += count;
+		quads_count -= count;
+	}
+}
+
+// Find a kept draw with the same result, returns NULL when it has to be laid out
+static affe__drawn* affe__drawn__find(affe_context* ctx, affe__drawn_cache* drawn, unsigned int hash, const affe__state* state, float x, float y, const char* string, long long text_count, int lines)
+{
+	for (int i = drawn->buckets[hash & (AFFE_DRAW_CACHE_BUCKETS - 1)]; i >= 0; i = drawn->entries[i].next)
+	{
+		affe__drawn* entry = &drawn->entries[i];
+
+		if (entry->hash != hash || entry->text_count != text_count || entry->lines != lines) continue;
+		if (entry->x != x || entry->y != y) continue;
+		if (entry->generation != ctx->cache->generation) continue;
+		if (entry->canvas_width != ctx->canvas_width || entry->canvas_height != ctx->canvas_height) continue;
+		if (memcmp(&entry->state, state, sizeof(affe__state)) != 0) continue;
+		if (memcmp(drawn->bytes + entry->text, string, text_count) != 0) continue;
+
+		return entry;
+	}
+
+	return NULL;
+}
+
+// Draw text from a kept draw, or lay it out and keep it
+// Returns FALSE when the text has to be drawn without the draw cache
+static int affe__drawn__draw(affe_context* ctx, const affe__state* state, float x, float y, const char* string, const char* end, int lines)
+{
+	affe__drawn_cache* drawn = ctx->drawn;
+
+	const long long text_count = (long long)(end - string);
+	const unsigned int hash = affe__drawn__hash(state, x, y, string, end, lines);
+
+	affe__drawn* entry = affe__drawn__find(ctx, drawn, hash, state, x, y, string, text_count, lines);
+
+	if (entry)
+	{
+		entry->frame = drawn->frame;
+		AFFE__STAT_ADD(ctx, draw_cache_hits, 1);
+	}
+	else
+	{
+		// Without `affe_frame_end` nothing is ever dropped
+		if (drawn->entries_count >= AFFE_DRAW_CACHE_DRAWS) return FALSE;
+
+		const unsigned int generation = ctx->cache->generation;
+
+		affe__stream stream;
+		stream.verts = drawn->scratch;
+		stream.count = 0;
+		stream.capacity = drawn->scratch_capacity;
+		stream.fixed = FALSE;
+
+		affe__sink sink;
+		memset(&sink, 0, sizeof(affe__sink));
+		sink.stream = &stream;
+
+		const int complete = lines ? affe__text__emit_lines(ctx, state, x, y, string, end, &sink) : affe__text__emit(ctx, state, x, y, string, end, &sink);
+
+		drawn->scratch = stream.verts;
+		drawn->scratch_capacity = stream.capacity;
+
+		// Vertices from before an invalidation are stale
+		if (!complete || generation != ctx->cache->generation) return FALSE;
+		if (!affe__drawn__reserve(ctx, drawn, text_count, stream.count / 6)) return FALSE;
+
+		entry = &drawn->entries[drawn->entries_count];
+		entry->hash = hash;
+		entry->frame = drawn->frame;
+		entry->state = *state;
+		entry->x = x;
+		entry->y = y;
+		entry->lines = lines;
+		entry->canvas_width = ctx->canvas_width;
+		entry->canvas_height = ctx->canvas_height;
+		entry->generation = generation;
+		entry->text = drawn->bytes_count;
+		entry->text_count = text_count;
+		entry->first = drawn->quads_count;
+		entry->count = stream.count / 6;
+
+		memcpy(drawn->bytes + entry->text, string, text_count);
+		drawn->bytes_count += text_count;
+
+		// The second and third vertex of a quad hold its corners
+		for (long long i = 0; i < entry->count; ++i)
+		{
+			const affe_vertex* v = stream.verts + i * 6;
+			affe__drawn_quad* quad = &drawn->quads[drawn->quads_count++];
+
+			quad->x0 = v[1].x;
+			quad->y0 = v[1].y;
+			quad->s0 = v[1].s;
+			quad->t0 = v[1].t;
+			quad->x1 = v[2].x;
+			quad->y1 = v[2].y;
+			quad->s1 = v[2].s;
+			quad->t1 = v[2].t;
+		}
+
+		int* bucket = &drawn->buckets[hash & (AFFE_DRAW_CACHE_BUCKETS - 1)];
+		entry->next = *bucket;
+		*bucket = drawn->entries_count++;
+
+		AFFE__STAT_ADD(ctx, draw_cache_misses, 1);
+	}
+
+	if (entry->count > 0)
+	{
+		affe__buffer__key(ctx, affe__state__key(ctx, state));
+		affe__drawn__write(ctx, entry, drawn->quads + entry->first);
+	}
+
+	return TRUE;
+}
+
+void affe_draw_cache(affe_context* ctx, bool enabled)
+{
+	if (!ctx) return;
+	if (enabled == (ctx->drawn != NULL)) return;
+
+	if (!enabled)
+	{
+		affe__drawn__free(&ctx->info.allocator, ctx->drawn);
+		ctx->drawn = NULL;
+		return;
+	}
+
+	ctx->drawn = (affe__drawn_cache*)affe__malloc(&ctx->info.allocator, sizeof(affe__drawn_cache));
+	if (!ctx->drawn) return;
+	memset(ctx->drawn, 0, sizeof(affe__drawn_cache));
+
+	for (int i = 0; i < AFFE_DRAW_CACHE_BUCKETS; ++i)
+		ctx->drawn->buckets[i] = -1;
+}
+
+void affe_text_draw_inline(affe_context* ctx, float x, float y, const char* string, const char* end)
+{
+	if (!ctx) return;
+	if (!end) end = string + strlen(string);
+
+	const affe__state* state = affe__state__get(ctx);
+
+	if (!ctx->drawn || !affe__drawn__draw(ctx, state, x, y, string, end, FALSE))
+	{
+		affe__sink sink;
+		memset(&sink, 0, sizeof(affe__sink));
+
+		affe__text__emit(ctx, state, x, y, string, end, &sink);
+	}
+
+	if (ctx->buffer_flush_control == AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC)
+		affe_buffer_flush(ctx);
+}
+
+void affe_text_draw(affe_context* ctx, float x, float y, const char* string, const char* end)
+{
+	if (!ctx) return;
+	if (!end) end = string + strlen(string);
+
+	const int prev_flush_control = ctx->buffer_flush_control;
+
+	if (prev_flush_control == AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC)
+		affe_buffer_flush_control(ctx, AFFE_BUFFER_FLUSH_CONTROL_NONE);
+
+	const affe__state* state = affe__state__get(ctx);
+
+	if (!ctx->drawn || !affe__drawn__draw(ctx, state, x, y, string, end, TRUE))
+	{
+		affe__sink sink;
+		memset(&sink, 0, sizeof(affe__sink));
+
+		affe__text__emit_lines(ctx, state, x, y, string, end, &sink);
+	}
+
+	if (prev_flush_control == AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC)
+	{
+		affe_buffer_flush(ctx);
+		affe_buffer_flush_control(ctx, AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC);
+	}
+}
+
+// ----- caller memory -----
+
+// Emit text into caller memory, emitting again if the atlas is invalidated part way through
+static int affe__text__target(affe_context* ctx, float x, float y, const char* string, const char* end, affe__target* target)
+{
+	affe__sink sink;
+	memset(&sink, 0, sizeof(affe__sink));
+	sink.target = target;
+
+	const affe__state* state = affe__state__get(ctx);
+	const unsigned int generation = ctx->cache->generation;
+
+	int result = affe__text__emit_lines(ctx, state, x, y, string, end, &sink);
+
+	// The atlas filled up part way through, quads written before that are stale
+	if (ctx->cache->generation != generation)
+	{
+		const unsigned int retry = ctx->cache->generation;
+
+		target->count = 0;
+		result = affe__text__emit_lines(ctx, state, x, y, string, end, &sink);
+
+		// Filled up again, the text does not fit the atlas at once and nothing written is valid
+		if (ctx->cache->generation != retry)
+		{
+			target->count = 0;
+			return FALSE;
+		}
+	}
+
+	return result;
+}
+
+int affe_text_emit(affe_context* ctx, float x, float y, const char* string, const char* end, const affe_vertex_format* format, void* verts, long long capacity, long long* written)
+{
+	if (written) *written = 0;
+	if (!ctx || !format || !verts || !string) return FALSE;
+	if (format->quad_vertices != 4 && format->quad_vertices != 6) return FALSE;
+	if (format->stride <= 0) return FALSE;
+	if (!end) end = string + strlen(string);
+
+	affe__target target;
+	target.format = format;
+	target.verts = (unsigned char*)verts;
+	target.capacity = capacity;
+	target.count = 0;
+
+	int result = affe__text__target(ctx, x, y, string, end, &target);
+
+	if (written) *written = target.count;
+	return result;
+}
+
+int affe_text_quads(affe_context* ctx, float x, float y, const char* string, const char* end, affe_text_quad* quads, long long capacity, long long* written)
+{
+	if (written) *written = 0;
+	if (!ctx || !quads || !string) return FALSE;
+	if (!end) end = string + strlen(string);
+
+	affe__target target;
+	target.format = NULL;
+	target.verts = (unsigned char*)quads;
+	target.capacity = capacity;
+	target.count = 0;
+
+	int result = affe__text__target(ctx, x, y, string, end, &target);
+
+	if (written) *written = target.count;
+	return result;
+}
+
+long long affe_text_emit_count(affe_context* ctx, float x, float y, const char* string, const char* end)
+{
+	if (!ctx || !string) return 0;
+	if (!end) end = string + strlen(string);
+
+	affe__target target;
+	memset(&target, 0, sizeof(affe__target));
+	target.capacity = LLONG_MAX;
+
+	affe__sink sink;
+	memset(&sink, 0, sizeof(affe__sink));
+	sink.target = &target;
+
+	affe__text__emit_lines(ctx, affe__state__get(ctx), x, y, string, end, &sink);
+	return target.count;
+}
+
+int affe_glyph_get(affe_context* ctx, unsigned int codepoint, affe_glyph_quad* quad)
+{
+	if (!ctx || !quad) return FALSE;
+
+	const affe__state* state = affe__state__get(ctx);
+	if (state->font < 0 || state->font >= ctx->cache->fonts_count) return FALSE;
+
+	affe__font* font = ctx->cache->fonts[state->font];
+	if (!font->data) return FALSE;
+
+	affe__glyph* glyph = affe__glyph__get(ctx, font, codepoint, ctx->info.size, ctx->info.padding);
+	if (!glyph) return FALSE;
+
+	float scale = stbtt_ScaleForPixelHeight(&font->metrics, state->size);
+
+	quad->x0 = (float)glyph->x0 * scale;
+	quad->y0 = (float)glyph->y0 * scale;
+	quad->x1 = (float)glyph->x1 * scale;
+	quad->y1 = (float)glyph->y1 * scale;
+
+	quad->s0 = glyph->u0;
+	quad->t0 = glyph->v0;
+	quad->s1 = glyph->u1;
+	quad->t1 = glyph->v1;
+
+	quad->advance = (float)glyph->advance * scale;
+	return TRUE;
+}
+
+unsigned int affe_atlas_generation(affe_context* ctx)
+{
+	if (!ctx) return 0;
+	return ctx->cache->generation;
+}
+
+// ----- numbers -----
+
+// Characters of `affe__font::numerals`, in order
+#define AFFE__NUMERALS "0123456789-."
+
+// Longest formatted number: every digit of the largest double, sign and decimal point
+#define AFFE__NUMBER_CHARS 352
+
+// Write the digits of `digits` followed by `zeros` zeros with a decimal point before the last `decimals` digits
+// Characters are indices into `AFFE__NUMERALS`, returns the number written
+static int affe__number__format(unsigned long long digits, int zeros, int decimals, int negative, unsigned char* out)
+{
+	unsigned char reversed[AFFE__NUMBER_CHARS];
+	int count = 0;
+
+	for (int i = 0; i < zeros; ++i)
+		reversed[count++] = 0;
+
+	do
+	{
+		reversed[count++] = (unsigned char)(digits % 10);
+		digits /= 10;
+	} while (digits);
+
+	// At least one digit before the decimal point
+	while (count < decimals + 1)
+		reversed[count++] = 0;
+
+	int length = 0;
+	if (negative) out[length++] = 10;
+
+	for (int i = count - 1; i >= 0; --i)
+	{
+		out[length++] = reversed[i];
+		if (i == decimals && decimals > 0) out[length++] = 11;
+	}
+
+	return length;
+}
+
+// Draw formatted number characters with the current state
+// Draw the characters as plain text, without tabular digits
+static void affe__number__text(affe_context* ctx, float x, float y, const unsigned char* chars, int count)
+{
+	char text[AFFE__NUMBER_CHARS];
+
+	for (int i = 0; i < count; ++i)
+		text[i] = AFFE__NUMERALS[chars[i]];
+
+	affe_text_draw_inline(ctx, x, y, text, text + count);
+}
+
+static void affe__number__draw(affe_context* ctx, float x, float y, const unsigned char* chars, int count, int flags)
+{
+	const affe__state* state = affe__state__get(ctx);
+	if (state->font < 0 || state->font >= ctx->cache->fonts_count) return;
+
+	affe__font* font = ctx->cache->fonts[state->font];
+	if (!font->data) return;
+
+	// The digit table holds distance field glyphs, bitmap sizes are drawn as text without tabular digits
+	if (affe__state__bitmap(state))
+	{
+		affe__number__text(ctx, x, y, chars, count);
+		return;
+	}
+
+	float scale = stbtt_ScaleForPixelHeight(&font->metrics, state->size);
+
+	affe__clip clip;
+	const int culling = affe__clip__get(ctx, state, &clip);
+	if (culling && !affe__clip__line(&clip, font, scale, y)) return;
+
+	if (font->direct_scale != scale)
+	{
+		font->direct_scale = scale;
+		++font->direct_stamp;
+	}
+
+	const int tabular = (flags & AFFE_NUMBER_TABULAR) != 0;
+
+	// Resolve every glyph before emitting, an invalidation part way through means resolving again
+	const affe__direct* glyphs[AFFE__NUMBER_CHARS];
+	int resolved = FALSE;
+
+	for (int attempt = 0; attempt < 2 && !resolved; ++attempt)
+	{
+		const unsigned int stamp = font->direct_stamp;
+
+		if (tabular && font->numerals_stamp != stamp)
+		{
+			float widest = 0.0f;
+
+			for (int i = 0; i < 10; ++i)
+			{
+				const affe__direct* digit = affe__direct__fill(ctx, font, (unsigned int)AFFE__NUMERALS[i], &font->numerals[i]);
+				if (digit && digit->advance > widest) widest = digit->advance;
+			}
+
+			font->numerals_tabular = widest;
+			font->numerals_stamp = font->direct_stamp;
+		}
+
+		for (int i = 0; i < count; ++i)
+			glyphs[i] = affe__direct__fill(ctx, font, (unsigned int)AFFE__NUMERALS[chars[i]], &font->numerals[chars[i]]);
+
+		resolved = font->direct_stamp == stamp;
+	}
+
+	// Invalidated on both attempts, the resolved glyphs may point into an old atlas
+	if (!resolved)
+	{
+		affe__number__text(ctx, x, y, chars, count);
+		return;
+	}
+
+	// Advance of every character, digits are centered in their cell when tabular
+	float left = 0.0f, right = 0.0f, pen = 0.0f;
+
+	if (tabular)
+	{
+		for (int i = 0; i < count; ++i)
+			if (glyphs[i]) pen += chars[i] < 10 ? font->numerals_tabular : glyphs[i]->advance;
+
+		right = pen;
+	}
+	else
+	{
+		int found = FALSE;
+
+		for (int i = 0; i < count; ++i)
+		{
+			if (!glyphs[i]) continue;
+			if (!found || pen + glyphs[i]->x0 < left) left = pen + glyphs[i]->x0;
+			if (!found || pen + glyphs[i]->x1 > right) right = pen + glyphs[i]->x1;
+			pen += glyphs[i]->advance;
+			found = TRUE;
+		}
+
+		if (!found) return;
+
+		// Quads include the padding, ink is measured without it like `affe__text_width` does
+		const int padding = (int)((float)ctx->info.padding / stbtt_ScaleForPixelHeight(&font->metrics, ctx->info.size));
+		left += (float)padding * scale;
+		right -= (float)padding * scale;
+	}
+
+	x -= left;
+
+	if (state->alignment & AFFE_ALIGN_CENTER)
+		x -= (right - left) * 0.5f;
+	else if (state->alignment & AFFE_ALIGN_RIGHT)
+		x -= right - left;
+
+	affe__buffer__key(ctx, affe__state__key(ctx, state));
+
+	affe__sink sink;
+	memset(&sink, 0, sizeof(affe__sink));
+
+	for (int i = 0; i < count; ++i)
+	{
+		const affe__direct* glyph = glyphs[i];
+		if (!glyph) continue;
+
+		float advance = glyph->advance;
+		float offset = 0.0f;
+
+		if (tabular && chars[i] < 10)
+		{
+			offset = (font->numerals_tabular - glyph->advance) * 0.5f;
+			advance = font->numerals_tabular;
+		}
+
+		if (glyph->visible)
+		{
+			affe__quad quad;
+
+			quad.x0 = x + offset + glyph->x0;
+			quad.y0 = y + glyph->y0;
+			quad.x1 = x + offset + glyph->x1;
+			quad.y1 = y + glyph->y1;
+
+			quad.s0 = glyph->s0;
+			quad.t0 = glyph->t0;
+			quad.s1 = glyph->s1;
+			quad.t1 = glyph->t1;
+
+			quad.r = state->r;
+			quad.g = state->g;
+			quad.b = state->b;
+			quad.a = state->a;
+
+			if (!culling || affe__clip__quad(&clip, &quad)) affe__sink__quad(ctx, &sink, &quad);
+		}
+
+		x += advance;
+	}
+
+	if (ctx->buffer_flush_control == AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC)
+		affe_buffer_flush(ctx);
+}
+
+void affe_text_draw_int(affe_context* ctx, float x, float y, long long value, int flags)
+{
+	if (!ctx) return;
+
+	// Negated as unsigned, `LLONG_MIN` has no positive counterpart
+	const unsigned long long magnitude = value < 0 ? 0ull - (unsigned long long)value : (unsigned long long)value;
+
+	unsigned char chars[AFFE__NUMBER_CHARS];
+	const int count = affe__number__format(magnitude, 0, 0, value < 0, chars);
+
+	affe__number__draw(ctx, x, y, chars, count, flags);
+}
+
+void affe_text_draw_float(affe_context* ctx, float x, float y, double value, int decimals, int flags)
+{
+	if (!ctx) return;
+
+	// Only infinities and not a number give not a number when subtracted from themselves
+	if (value - value != 0.0)
+	{
+		const char* text = value != value ? "nan" : value > 0.0 ? "inf" : "-inf";
+		affe_text_draw_inline(ctx, x, y, text, NULL);
+		return;
+	}
+
+	if (decimals < 0) decimals = 0;
+	if (decimals > 9) decimals = 9;
+
+	static const double powers[10] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+
+	const int negative = value < 0.0;
+	double scaled = (negative ? -value : value) * powers[decimals];
+
+	// Digits past what an unsigned long long holds are written as zeros, a double has no precision there anyway
+	int zeros = 0;
+	while (scaled >= 1e19)
+	{
+		scaled /= 10.0;
+		++zeros;
+	}
+
+	const unsigned long long digits = (unsigned long long)(scaled + 0.5);
+
+	unsigned char chars[AFFE__NUMBER_CHARS];
+	const int count = affe__number__format(digits, zeros, decimals, negative && (digits || zeros), chars);
+
+	affe__number__draw(ctx, x, y, chars, count, flags);
+}
+
+// ----- styled text -----
+
+// Next piece of a line with a single style, `*piece` is where the previous piece ended
+// Returns the span the piece belongs to or NULL for text outside of spans, `*span_index` only moves forward
+static const affe_text_span* affe__span__next(const char* string, const char* piece, const char* line_end, const affe_text_span* spans, int spans_count, int* span_index, const char** piece_end)
+{
+	long long offset = piece - string;
+
+	while (*span_index < spans_count && spans[*span_index].end <= offset)
+		++*span_index;
+
+	if (*span_index < spans_count && spans[*span_index].begin <= offset)
+	{
+		const affe_text_span* span = &spans[*span_index];
+		*piece_end = string + span->end < line_end ? string + span->end : line_end;
+		return span;
+	}
+
+	*piece_end = *span_index < spans_count && string + spans[*span_index].begin < line_end ? string + spans[*span_index].begin : line_end;
+	return NULL;
+}
+
+// `base` with `styles[style]` applied, a negative style keeps the base state
+static void affe__style__state(affe__state* state, const affe__state* base, const affe_text_style* styles, int style_index)
+{
+	*state = *base;
+	if (style_index < 0) return;
+
+	const affe_text_style* style = &styles[style_index];
+	state->size = style->size;
+	state->r = style->r;
+	state->g = style->g;
+	state->b = style->b;
+	state->a = style->a;
+	state->font = style->font;
+}
+
+static void affe__span__state(affe__state* state, const affe__state* base, const affe_text_style* styles, const affe_text_span* span)
+{
+	affe__style__state(state, base, styles, span ? span->style : -1);
+}
+
+static affe__font* affe__span__font(affe_context* ctx, const affe__state* state)
+{
+	if (state->font < 0 || state->font >= ctx->cache->fonts_count) return NULL;
+
+	affe__font* font = ctx->cache->fonts[state->font];
+	return font->data ? font : NULL;
+}
+
+void affe_text_draw_spans(affe_context* ctx, float x, float y, const char* string, const char* end, const affe_text_style* styles, const affe_text_span* spans, int spans_count)
+{
+	if (!ctx) return;
+	if (!end) end = string + strlen(string);
+	if (!spans) spans_count = 0;
+
+	const affe__state* base = affe__state__get(ctx);
+
+	const int prev_flush_control = ctx->buffer_flush_control;
+
+	if (prev_flush_control == AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC)
+		affe_buffer_flush_control(ctx, AFFE_BUFFER_FLUSH_CONTROL_NONE);
+
+	affe__sink sink;
+	memset(&sink, 0, sizeof(affe__sink));
+
+	affe__clip clip;
+	const int culling = affe__clip__get(ctx, base, &clip);
+
+	int span_index = 0;
+	const char* line = string;
+	const char* line_end, * next_start;
+
+	while (affe__text__line(line, end, &line_end, &next_start))
+	{
+		// Measure the whole line, in pixels from the pen start
+		float ink_left = 0.0f, ink_right = 0.0f, pen = 0.0f;
+		float line_height = 0.0f;
+		int has_ink = FALSE;
+
+		int first_span = span_index;
+		const char* piece = line;
+		const char* piece_end;
+
+		do
+		{
+			affe__state state;
+			const affe_text_span* span = affe__span__next(string, piece, line_end, spans, spans_count, &span_index, &piece_end);
+			affe__span__state(&state, base, styles, span);
+
+			affe__font* font = affe__span__font(ctx, &state);
+			if (font)
+			{
+				float scale = stbtt_ScaleForPixelHeight(&font->metrics, state.size);
+				float height = (float)(font->ascent + font->line_gap - font->descent) * scale;
+				if (height > line_height) line_height = height;
+
+				int left, right, advance;
+				affe__text_width(ctx, font, piece, piece_end, &left, &right, &advance);
+
+				if (left <= right)
+				{
+					float piece_left = pen + (float)left * scale;
+					float piece_right = pen + (float)right * scale;
+
+					if (!has_ink || piece_left < ink_left) ink_left = piece_left;
+					if (!has_ink || piece_right > ink_right) ink_right = piece_right;
+					has_ink = TRUE;
+				}
+
+				pen += (float)advance * scale;
+			}
+
+			piece = piece_end;
+		} while (piece < line_end);
+
+		if (has_ink)
+		{
+			pen = x - ink_left;
+
+			if (base->alignment & AFFE_ALIGN_CENTER)
+				pen -= (ink_right - ink_left) * 0.5f;
+			else if (base->alignment & AFFE_ALIGN_RIGHT)
+				pen -= ink_right - ink_left;
+
+			// Emit the pieces again from the same span
+			span_index = first_span;
+			piece = line;
+
+			do
+			{
+				affe__state state;
+				const affe_text_span* span = affe__span__next(string, piece, line_end, spans, spans_count, &span_index, &piece_end);
+				affe__span__state(&state, base, styles, span);
+
+				affe__font* font = affe__span__font(ctx, &state);
+				if (font)
+					affe__text__emit_at(ctx, &state, font, stbtt_ScaleForPixelHeight(&font->metrics, state.size), culling ? &clip : NULL, pen, y, piece, piece_end, &sink, &pen);
+
+				piece = piece_end;
+			} while (piece < line_end);
+		}
+
+		// Empty lines advance by the current state
+		if (line_height == 0.0f)
+		{
+			affe__font* font = affe__span__font(ctx, base);
+			if (font) line_height = (float)(font->ascent + font->line_gap - font->descent) * stbtt_ScaleForPixelHeight(&font->metrics, base->size);
+		}
+
+		y -= line_height;
+		line = next_start;
+	}
+
+	if (prev_flush_control == AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC)
+	{
+		affe_buffer_flush(ctx);
+		affe_buffer_flush_control(ctx, AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC);
+	}
+}
+
+// ----- paragraphs -----
+
+struct affe_paragraph
+{
+	affe_paragraph_line* lines;
+	int lines_count;
+	int lines_capacity;
+
+	// New lines are laid out here first so failures leave the layout untouched
+	affe_paragraph_line* scratch;
+	int scratch_capacity;
+
+	// Settings of the last full layout, reused by edits
+	int length;
+	int font;
+	float size;
+	int alignment;
+	float max_width;
+	float line_height;
+};
+
+// Line breaking classes, a small subset of UAX #14
+#define AFFE__BREAK_AL 0 // letters, digits and everything else
+#define AFFE__BREAK_SP 1 // spaces, break after
+#define AFFE__BREAK_BA 2 // hyphens, dashes and zero width space, break after
+#define AFFE__BREAK_ID 3 // ideographs, break before and after
+#define AFFE__BREAK_CL 4 // closing punctuation, no break before
+#define AFFE__BREAK_OP 5 // opening punctuation, no break after
+#define AFFE__BREAK_GL 6 // non breaking spaces and joiners, no break before or after
+
+static int affe__break__class(unsigned int c)
+{
+	switch (c)
+	{
+	case ' ': case '\t': case 0x3000:
+		return AFFE__BREAK_SP;
+	case '-': case 0x00AD: case 0x200B: case 0x2010: case 0x2012: case 0x2013: case 0x2014:
+		return AFFE__BREAK_BA;
+	case ')': case ']': case '}': case '!': case '?': case ',': case '.': case ':': case ';':
+	case 0x3001: case 0x3002: case 0x300D: case 0x300F: case 0xFF01: case 0xFF09: case 0xFF0C: case 0xFF0E: case 0xFF1A: case 0xFF1B: case 0xFF1F:
+		return AFFE__BREAK_CL;
+	case '(': case '[': case '{': case 0x300C: case 0x300E: case 0xFF08:
+		return AFFE__BREAK_OP;
+	case 0x00A0: case 0x2007: case 0x202F: case 0x2060: case 0xFEFF:
+		return AFFE__BREAK_GL;
+	}
+
+	if ((c >= 0x2E80 && c <= 0x2FFF) || (c >= 0x3040 && c <= 0x30FF) || (c >= 0x3400 && c <= 0x4DBF) || (c >= 0x4E00 && c <= 0x9FFF) ||
+		(c >= 0xAC00 && c <= 0xD7AF) || (c >= 0xF900 && c <= 0xFAFF) || (c >= 0x20000 && c <= 0x2FFFF))
+		return AFFE__BREAK_ID;
+
+	return AFFE__BREAK_AL;
+}
+
+static int affe__break__allowed(int before, int after)
+{
+	if (after == AFFE__BREAK_SP || after == AFFE__BREAK_CL || after == AFFE__BREAK_GL) return FALSE;
+	if (before == AFFE__BREAK_OP || before == AFFE__BREAK_GL) return FALSE;
+	return before == AFFE__BREAK_SP || before == AFFE__BREAK_BA || before == AFFE__BREAK_ID || after == AFFE__BREAK_ID;
+}
+
+static int affe__paragraph__reserve(affe_context* ctx, affe_paragraph_line** lines, int* capacity, int count)
+{
+	if (count <= *capacity) return TRUE;
+
+	int new_capacity = *capacity == 0 ? AFFE_INIT_LINES : *capacity;
+	while (new_capacity < count) new_capacity *= 2;
+
+	affe_paragraph_line* new_lines = (affe_paragraph_line*)affe__realloc(&ctx->info.allocator, *lines, new_capacity * sizeof(affe_paragraph_line));
+	if (!new_lines) return FALSE;
+
+	*lines = new_lines;
+	*capacity = new_capacity;
+	return TRUE;
+}
+
+// Lay out the line starting at `begin`, returns the offset the next line starts at
+// `last` is set when the line runs to the end of the text
+// A line only depends on the text it read from its start, which is what lets edits stop early
+static int affe__paragraph__wrap(affe_context* ctx, affe__font* font, float scale, float max_width, const char* string, int length, int begin, affe_paragraph_line* line, int* last)
+{
+	const char* cursor = string + begin;
+	const char* end = string + length;
+
+	// Extents match `affe__text_width` so lines draw where they were measured
+	int pen = 0;
+	int lhs = INT_MAX, rhs = INT_MIN;
+
+	// Line as of the last non space codepoint
+	int content_end = begin;
+	int content_lhs = 0, content_rhs = 0;
+
+	// Best break opportunity so far
+	int break_next = -1;
+	int break_end = 0, break_lhs = 0, break_rhs = 0;
+
+	int prev_class = AFFE__BREAK_AL;
+	int next = length;
+	*last = TRUE;
+
+	for (int count = 0; cursor != end; ++count)
+	{
+		const int offset = (int)(cursor - string);
+
+		unsigned int codepoint;
+		if (!affe__utf8__decode(&cursor, end, &codepoint, 1)) break;
+
+		if (codepoint == '\r' || codepoint == '\n')
+		{
+			if (codepoint == '\r' && cursor != end && *cursor == '\n') ++cursor;
+			next = (int)(cursor - string);
+			*last = FALSE;
+			break;
+		}
+
+		int cls = affe__break__class(codepoint);
+
+		if (count > 0 && affe__break__allowed(prev_class, cls))
+		{
+			break_next = offset;
+			break_end = content_end;
+			break_lhs = content_lhs;
+			break_rhs = content_rhs;
+		}
+
+		affe__glyph* glyph = affe__glyph__get(ctx, font, codepoint, ctx->info.size, ctx->info.padding);
+
+		if (glyph)
+		{
+			int glyph_left = pen + glyph->x0 + glyph->padding;
+			int glyph_right = pen + glyph->x1 - glyph->padding;
+
+			int new_lhs = glyph_left < lhs ? glyph_left : lhs;
+			int new_rhs = glyph_right > rhs ? glyph_right : rhs;
+
+			// Trailing spaces hang past the edge, a line only overflows once it has something to break
+			if (cls != AFFE__BREAK_SP && (content_end > begin || break_next >= 0) && (float)(new_rhs - new_lhs) * scale > max_width)
+			{
+				if (break_next >= 0)
+				{
+					next = break_next;
+					content_end = break_end;
+					content_lhs = break_lhs;
+					content_rhs = break_rhs;
+				}
+				else // No opportunity, split the word
+					next = offset;
+
+				*last = FALSE;
+				break;
+			}
+
+			lhs = new_lhs;
+			rhs = new_rhs;
+			pen += glyph->advance;
+		}
+
+		if (cls != AFFE__BREAK_SP)
+		{
+			content_end = (int)(cursor - string);
+			content_lhs = lhs;
+			content_rhs = rhs;
+		}
+
+		prev_class = cls;
+	}
+
+	line->begin = begin;
+	line->end = content_end;
+	line->width = content_end > begin && content_rhs > content_lhs ? (float)(content_rhs - content_lhs) * scale : 0.0f;
+	line->scan_end = *last ? length : (int)(cursor - string);
+
+	return next;
+}
+
+// Wrap lines from `begin` into the scratch buffer until the text ends, or a line starts at
+// or after `sync_offset` exactly where an old line at or after `sync_line` started, shifted by `delta`
+// Returns the number of lines written or -1 on allocation failure, `synced` receives the matching old line or -1
+static int affe__paragraph__run(affe_context* ctx, affe_paragraph* paragraph, affe__font* font, const char* string, int begin, int sync_line, int sync_offset, int delta, int* synced)
+{
+	const float scale = stbtt_ScaleForPixelHeight(&font->metrics, paragraph->size);
+	int count = 0;
+
+	*synced = -1;
+
+	for (;;)
+	{
+		if (!affe__paragraph__reserve(ctx, &paragraph->scratch, &paragraph->scratch_capacity, count + 1)) return -1;
+
+		affe_paragraph_line* line = &paragraph->scratch[count++];
+
+		int last;
+		int next = affe__paragraph__wrap(ctx, font, scale, paragraph->max_width, string, paragraph->length, begin, line, &last);
+
+		line->x = 0.0f;
+		if (paragraph->alignment & AFFE_ALIGN_CENTER)
+			line->x = (paragraph->max_width - line->width) * 0.5f;
+		else if (paragraph->alignment & AFFE_ALIGN_RIGHT)
+			line->x = paragraph->max_width - line->width;
+
+		if (last) return count;
+
+		if (sync_line >= 0 && next >= sync_offset)
+		{
+			while (sync_line < paragraph->lines_count && paragraph->lines[sync_line].begin + delta < next) ++sync_line;
+
+			if (sync_line < paragraph->lines_count && paragraph->lines[sync_line].begin + delta == next)
+			{
+				*synced = sync_line;
+				return count;
+			}
+		}
+
+		begin = next;
+	}
+}
+
+affe_paragraph* affe_paragraph_create(affe_context* ctx)
+{
+	if (!ctx) return NULL;
+
+	affe_paragraph* paragraph = (affe_paragraph*)affe__malloc(&ctx->info.allocator, sizeof(affe_paragraph));
+	if (!paragraph) return NULL;
+	memset(paragraph, 0, sizeof(affe_paragraph));
+
+	paragraph->font = AFFE_INVALID;
+	return paragraph;
+}
+
+void affe_paragraph_delete(affe_context* ctx, affe_paragraph* paragraph)
+{
+	if (!ctx) return;
+	if (!paragraph) return;
+
+	affe__free(&ctx->info.allocator, paragraph->lines);
+	affe__free(&ctx->info.allocator, paragraph->scratch);
+	affe__free(&ctx->info.allocator, paragraph);
+}
+
+int affe_paragraph_layout(affe_context* ctx, affe_paragraph* paragraph, const char* string, const char* end, float max_width)
+{
+	if (!ctx) return FALSE;
+	if (!paragraph || !string) return FALSE;
+	if (!end) end = string + strlen(string);
+
+	affe__state* state = affe__state__get(ctx);
+	if (state->font < 0 || state->font >= ctx->cache->fonts_count) return FALSE;
+
+	affe__font* font = ctx->cache->fonts[state->font];
+	if (!font->data) return FALSE;
+
+	const affe_paragraph prev = *paragraph;
+
+	paragraph->length = (int)(end - string);
+	paragraph->font = state->font;
+	paragraph->size = state->size;
+	paragraph->alignment = state->alignment;
+	paragraph->max_width = max_width;
+	paragraph->line_height = (float)(font->ascent + font->line_gap - font->descent) * stbtt_ScaleForPixelHeight(&font->metrics, state->size);
+
+	int synced;
+	int count = affe__paragraph__run(ctx, paragraph, font, string, 0, -1, 0, 0, &synced);
+
+	if (count < 0 || !affe__paragraph__reserve(ctx, &paragraph->lines, &paragraph->lines_capacity, count))
+	{
+		// keep the grown buffers, restore the settings
+		paragraph->length = prev.length;
+		paragraph->font = prev.font;
+		paragraph->size = prev.size;
+		paragraph->alignment = prev.alignment;
+		paragraph->max_width = prev.max_width;
+		paragraph->line_height = prev.line_height;
+		return FALSE;
+	}
+
+	memcpy(paragraph->lines, paragraph->scratch, count * sizeof(affe_paragraph_line));
+	paragraph->lines_count = count;
+
+	for (int i = 0; i < count; ++i)
+		paragraph->lines[i].y = (float)i * paragraph->line_height;
+
+	return TRUE;
+}
+
+int affe_paragraph_edit(affe_context* ctx, affe_paragraph* paragraph, const char* string, const char* end, int offset, int removed, int inserted)
+{
+	if (!ctx) return FALSE;
+	if (!paragraph || !string) return FALSE;
+	if (paragraph->font < 0 || paragraph->font >= ctx->cache->fonts_count) return FALSE;
+	if (!end) end = string + strlen(string);
+
+	affe__font* font = ctx->cache->fonts[paragraph->font];
+	if (!font->data) return FALSE;
+
+	const int length = (int)(end - string);
+	const int delta = inserted - removed;
+
+	if (paragraph->lines_count == 0 || offset < 0 || removed < 0 || inserted < 0 || offset + removed > paragraph->length || paragraph->length + delta != length)
+		return FALSE;
+
+	// Lines that never read up to the edit are unchanged, this includes a line that may pull up an edited word
+	int first = 0;
+	while (first + 1 < paragraph->lines_count && paragraph->lines[first].scan_end < offset) ++first;
+
+	const int prev_length = paragraph->length;
+	paragraph->length = length;
+
+	int synced;
+	int count = affe__paragraph__run(ctx, paragraph, font, string, paragraph->lines[first].begin, first + 1, offset + inserted, delta, &synced);
+
+	int tail = synced < 0 ? 0 : paragraph->lines_count - synced;
+
+	if (count < 0 || !affe__paragraph__reserve(ctx, &paragraph->lines, &paragraph->lines_capacity, first + count + tail))
+	{
+		paragraph->length = prev_length;
+		return FALSE;
+	}
+
+	if (tail > 0)
+		memmove(&paragraph->lines[first + count], &paragraph->lines[synced], tail * sizeof(affe_paragraph_line));
+
+	memcpy(&paragraph->lines[first], paragraph->scratch, count * sizeof(affe_paragraph_line));
+	paragraph->lines_count = first + count + tail;
+
+	for (int i = first + count; i < paragraph->lines_count; ++i)
+	{
+		paragraph->lines[i].begin += delta;
+		paragraph->lines[i].end += delta;
+		paragraph->lines[i].scan_end += delta;
+	}
+
+	for (int i = first; i < paragraph->lines_count; ++i)
+		paragraph->lines[i].y = (float)i * paragraph->line_height;
+
+	return TRUE;
+}
+
+int affe_paragraph_line_count(affe_context* ctx, const affe_paragraph* paragraph)
+{
+	if (!ctx) return 0;
+	if (!paragraph) return 0;
+	return paragraph->lines_count;
+}
+
+const affe_paragraph_line* affe_paragraph_lines(affe_context* ctx, const affe_paragraph* paragraph)
+{
+	if (!ctx) return NULL;
+	if (!paragraph) return NULL;
+	return paragraph->lines;
+}
+
+void affe_paragraph_draw(affe_context* ctx, const affe_paragraph* paragraph, float x, float y, const char* string)
+{
+	if (!ctx) return;
+	if (!paragraph || !string) return;
+
+	affe__state* state = affe__state__get(ctx);
+
+	const int prev_flush_control = ctx->buffer_flush_control;
+	const int prev_alignment = state->alignment;
+
+	if (prev_flush_control == AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC)
+		affe_buffer_flush_control(ctx, AFFE_BUFFER_FLUSH_CONTROL_NONE);
+
+	// Lines are already aligned within the paragraph
+	state->alignment = AFFE_ALIGN_LEFT;
+
+	for (int i = 0; i < paragraph->lines_count; ++i)
+	{
+		const affe_paragraph_line* line = &paragraph->lines[i];
+		if (line->end > line->begin)
+			affe_text_draw_inline(ctx, x + line->x, y - line->y, string + line->begin, string + line->end);
+	}
+
+	state->alignment = prev_alignment;
+
+	if (prev_flush_control == AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC)
+	{
+		affe_buffer_flush(ctx);
+		affe_buffer_flush_control(ctx, AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC);
+	}
+}
+
+// ----- documents -----
+
+struct affe_document
+{
+	char* bytes;
+	long long bytes_count;
+	long long bytes_capacity;
+
+	// Start offset of every line, there is always at least one
+	long long* lines;
+	long long lines_count;
+	long long lines_capacity;
+
+	// Scanning for line breaks resumes here, a trailing carriage return waits for a possible line feed
+	long long scan;
+};
+
+affe_document* affe_document_create(affe_context* ctx)
+{
+	if (!ctx) return NULL;
+
+	affe_document* document = (affe_document*)affe__malloc(&ctx->info.allocator, sizeof(affe_document));
+	if (!document) goto error;
+	memset(document, 0, sizeof(affe_document));
+
+	document->lines = (long long*)affe__malloc(&ctx->info.allocator, AFFE_INIT_LINES * sizeof(long long));
+	if (!document->lines) goto error;
+	document->lines_capacity = AFFE_INIT_LINES;
+	document->lines[document->lines_count++] = 0;
+
+	return document;
+error:
+	affe_document_delete(ctx, document);
+	return NULL;
+}
+
+void affe_document_delete(affe_context* ctx, affe_document* document)
+{
+	if (!ctx) return;
+	if (!document) return;
+
+	affe__free(&ctx->info.allocator, document->bytes);
+	affe__free(&ctx->info.allocator, document->lines);
+	affe__free(&ctx->info.allocator, document);
+}
+
+void affe_document_clear(affe_context* ctx, affe_document* document)
+{
+	if (!ctx) return;
+	if (!document) return;
+
+	document->bytes_count = 0;
+	document->lines_count = 1;
+	document->scan = 0;
+}
+
+int affe_document_append(affe_context* ctx, affe_document* document, const char* string, const char* end)
+{
+	if (!ctx) return FALSE;
+	if (!document || !string) return FALSE;
+	if (!end) end = string + strlen(string);
+
+	const long long count = (long long)(end - string);
+	if (count <= 0) return TRUE;
+
+	if (document->bytes_count + count > document->bytes_capacity)
+	{
+		long long new_capacity = document->bytes_capacity == 0 ? AFFE_INIT_DOCUMENT : document->bytes_capacity;
+		while (new_capacity < document->bytes_count + count) new_capacity *= 2;
+
+		char* new_bytes = (char*)affe__realloc(&ctx->info.allocator, document->bytes, new_capacity);
+		if (!new_bytes) return FALSE;
+
+		document->bytes = new_bytes;
+		document->bytes_capacity = new_capacity;
+	}
+
+	memcpy(document->bytes + document->bytes_count, string, count);
+
+	const long long prev_bytes_count = document->bytes_count;
+	const long long prev_lines_count = document->lines_count;
+	const long long prev_scan = document->scan;
+
+	document->bytes_count += count;
+
+	const char* bytes_end = document->bytes + document->bytes_count;
+	const char* cursor = document->bytes + document->scan;
+
+	for (;;)
+	{
+		const char* eol = affe__text__find_eol(cursor, bytes_end);
+		if (eol == bytes_end) break;
+
+		// A carriage return at the end may be the start of a crlf split between appends
+		if (*eol == '\r' && eol + 1 == bytes_end)
+		{
+			cursor = eol;
+			break;
+		}
+
+		cursor = eol + ((*eol == '\r' && eol[1] == '\n') ? 2 : 1);
+
+		if (document->lines_count + 1 > document->lines_capacity)
+		{
+			long long* new_lines = (long long*)affe__realloc(&ctx->info.allocator, document->lines, document->lines_capacity * 2 * sizeof(long long));
+
+			if (!new_lines)
+			{
+				document->bytes_count = prev_bytes_count;
+				document->lines_count = prev_lines_count;
+				document->scan = prev_scan;
+				return FALSE;
+			}
+
+			document->lines = new_lines;
+			document->lines_capacity *= 2;
+		}
+
+		document->lines[document->lines_count++] = (long long)(cursor - document->bytes);
+	}
+
+	document->scan = (long long)(cursor - document->bytes);
+	return TRUE;
+}
+
+long long affe_document_line_count(affe_context* ctx, const affe_document* document)
+{
+	if (!ctx) return 0;
+	if (!document) return 0;
+	return document->lines_count;
+}
+
+const char* affe_document_line(affe_context* ctx, const affe_document* document, long long line, const char** end)
+{
+	if (!ctx) return NULL;
+	if (!document) return NULL;
+	if (line < 0 || line >= document->lines_count) return NULL;
+
+	const long long begin = document->lines[line];
+	long long line_end;
+
+	if (line + 1 < document->lines_count)
+	{
+		line_end = document->lines[line + 1] - 1;
+		if (document->bytes[line_end] == '\n' && line_end > begin && document->bytes[line_end - 1] == '\r')
+			--line_end;
+	}
+	else
+	{
+		line_end = document->bytes_count;
+		if (line_end > begin && document->bytes[line_end - 1] == '\r')
+			--line_end;
+	}
+
+	if (end) *end = document->bytes + line_end;
+	return document->bytes + begin;
+}
+
+void affe_document_draw(affe_context* ctx, const affe_document* document, float x, float y, float view_x, float view_y, float view_width, float view_height)
+{
+	if (!ctx) return;
+	if (!document || !document->bytes) return;
+
+	affe__state* state = affe__state__get(ctx);
+	if (state->font < 0 || state->font >= ctx->cache->fonts_count) return;
+
+	affe__font* font = ctx->cache->fonts[state->font];
+	if (!font->data) return;
+
+	const float scale = stbtt_ScaleForPixelHeight(&font->metrics, state->size);
+	const float line_height = (float)(font->ascent + font->line_gap - font->descent) * scale;
+	if (line_height <= 0.0f) return;
+
+	// Glyph quads reach past the ascent and descent by the sdf padding
+	const float padding = (float)ctx->info.padding * state->size / ctx->info.size;
+	const float top = (float)font->ascent * scale + padding;
+	const float bottom = (float)font->descent * scale - padding;
+
+	// Line i is drawn at y - i * line_height, find the lines overlapping [view_y, view_y + view_height]
+	const float first_line = (y + bottom - (view_y + view_height)) / line_height;
+	const float last_line = (y + top - view_y) / line_height;
+
+	long long first = (long long)first_line;
+	long long last = (long long)last_line;
+	if ((float)first > first_line) --first;
+	if ((float)last < last_line) ++last;
+
+	if (first < 0) first = 0;
+	if (last > document->lines_count - 1) last = document->lines_count - 1;
+	if (first > last) return;
+
+	// Lines start at x when left aligned and end there when right aligned
+	if ((state->alignment & AFFE_ALIGN_LEFT) && x > view_x + view_width) return;
+	if ((state->alignment & AFFE_ALIGN_RIGHT) && x < view_x) return;
+
+	const int prev_flush_control = ctx->buffer_flush_control;
+
+	if (prev_flush_control == AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC)
+		affe_buffer_flush_control(ctx, AFFE_BUFFER_FLUSH_CONTROL_NONE);
+
+	for (long long i = first; i <= last; ++i)
+	{
+		const char* line_end = NULL;
+		const char* line = affe_document_line(ctx, document, i, &line_end);
+
+		if (line != line_end)
+			affe_text_draw_inline(ctx, x, y - (float)i * line_height, line, line_end);
+	}
+
+	if (prev_flush_control == AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC)
+	{
+		affe_buffer_flush(ctx);
+		affe_buffer_flush_control(ctx, AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC);
+	}
+}
+
+// ----- recorders -----
+
+// A recorded line, vertices are only valid for the atlas generation they were recorded against
+struct affe__recorder_item
+{
+	affe__state state;
+	float x, y;
+
+	// Copy of the text in the recorder's byte arena, kept to lay the line out again
+	long long text;
+	long long text_count;
+
+	// Vertices in the recorder's stream, deferred lines have a count of -1
+	long long first;
+	long long count;
+
+	unsigned int generation;
+};
+
+typedef struct affe__recorder_item affe__recorder_item;
+
+struct affe_recorder
+{
+	affe__state state;
+
+	affe__recorder_item* items;
+	long long items_count;
+	long long items_capacity;
+
+	char* bytes;
+	long long bytes_count;
+	long long bytes_capacity;
+
+	affe__stream stream;
+};
+
+affe_recorder* affe_recorder_create(affe_context* ctx)
+{
+	if (!ctx) return NULL;
+
+	affe_recorder* recorder = (affe_recorder*)affe__malloc(&ctx->info.allocator, sizeof(affe_recorder));
+	if (!recorder) return NULL;
+	memset(recorder, 0, sizeof(affe_recorder));
+
+	affe_recorder_reset(ctx, recorder);
+	return recorder;
+}
+
+void affe_recorder_delete(affe_context* ctx, affe_recorder* recorder)
+{
+	if (!ctx) return;
+	if (!recorder) return;
+
+	affe__free(&ctx->info.allocator, recorder->items);
+	affe__free(&ctx->info.allocator, recorder->bytes);
+	affe__free(&ctx->info.allocator, recorder->stream.verts);
+	affe__free(&ctx->info.allocator, recorder);
+}
+
+void affe_recorder_reset(affe_context* ctx, affe_recorder* recorder)
+{
+	if (!ctx) return;
+	if (!recorder) return;
+
+	recorder->state = *affe__state__get(ctx);
+	recorder->items_count = 0;
+	recorder->bytes_count = 0;
+	recorder->stream.count = 0;
+}
+
+void affe_recorder_set_size(affe_context* ctx, affe_recorder* recorder, float size)
+{
+	if (!ctx || !recorder) return;
+	recorder->state.size = size;
+}
+
+void affe_recorder_set_color(affe_context* ctx, affe_recorder* recorder, float r, float g, float b, float a)
+{
+	if (!ctx || !recorder) return;
+	recorder->state.r = r;
+	recorder->state.g = g;
+	recorder->state.b = b;
+	recorder->state.a = a;
+}
+
+void affe_recorder_set_font(affe_context* ctx, affe_recorder* recorder, int font)
+{
+	if (!ctx || !recorder) return;
+	recorder->state.font = font;
+}
+
+void affe_recorder_set_alignment(affe_context* ctx, affe_recorder* recorder, int alignment)
+{
+	if (!ctx || !recorder) return;
+	recorder->state.alignment = alignment;
+}
+
+void affe_recorder_set_blend(affe_context* ctx, affe_recorder* recorder, int blend)
+{
+	if (!ctx || !recorder) return;
+	recorder->state.blend = blend;
+}
+
+void affe_recorder_set_effect(affe_context* ctx, affe_recorder* recorder, const affe_effect* effect)
+{
+	if (!ctx || !recorder) return;
+	affe__state__effect(&recorder->state, effect);
+}
+
+void affe_recorder_set_bitmap_below(affe_context* ctx, affe_recorder* recorder, float size)
+{
+	if (!ctx || !recorder) return;
+	recorder->state.bitmap_below = size;
+}
+
+void affe_recorder_set_clip(affe_context* ctx, affe_recorder* recorder, float x, float y, float width, float height)
+{
+	if (!ctx || !recorder) return;
+	affe__state__clip(&recorder->state, x, y, width, height);
+}
+
+void affe_recorder_reset_clip(affe_context* ctx, affe_recorder* recorder)
+{
+	if (!ctx || !recorder) return;
+	recorder->state.clip = FALSE;
+}
+
+int affe_recorder_text_draw_inline(affe_context* ctx, affe_recorder* recorder, float x, float y, const char* string, const char* end)
+{
+	if (!ctx) return FALSE;
+	if (!recorder || !string) return FALSE;
+	if (!end) end = string + strlen(string);
+
+	const long long text_count = (long long)(end - string);
+
+	if (recorder->items_count + 1 > recorder->items_capacity)
+	{
+		long long new_capacity = recorder->items_capacity == 0 ? AFFE_INIT_RECORDER_ITEMS : recorder->items_capacity * 2;
+		affe__recorder_item* new_items = (affe__recorder_item*)affe__realloc(&ctx->info.allocator, recorder->items, new_capacity * sizeof(affe__recorder_item));
+		if (!new_items) return FALSE;
+
+		recorder->items = new_items;
+		recorder->items_capacity = new_capacity;
+	}
+
+	if (recorder->bytes_count + text_count > recorder->bytes_capacity)
+	{
+		long long new_capacity = recorder->bytes_capacity == 0 ? AFFE_INIT_DOCUMENT : recorder->bytes_capacity;
+		while (new_capacity < recorder->bytes_count + text_count) new_capacity *= 2;
+
+		char* new_bytes = (char*)affe__realloc(&ctx->info.allocator, recorder->bytes, new_capacity);
+		if (!new_bytes) return FALSE;
+
+		recorder->bytes = new_bytes;
+		recorder->bytes_capacity = new_capacity;
+	}
+
+	affe__recorder_item* item = &recorder->items[recorder->items_count];
+	item->state = recorder->state;
+	item->x = x;
+	item->y = y;
+	item->text = recorder->bytes_count;
+	item->text_count = text_count;
+	item->first = recorder->stream.count;
+	item->generation = ctx->cache->generation;
+
+	memcpy(recorder->bytes + recorder->bytes_count, string, text_count);
+
+	affe__sink sink;
+	memset(&sink, 0, sizeof(affe__sink));
+	sink.read_only = TRUE;
+	sink.stream = &recorder->stream;
+
+	if (affe__text__emit(ctx, &item->state, x, y, string, end, &sink))
+		item->count = recorder->stream.count - item->first;
+	else
+	{
+		// Missing glyphs, or the stream could not grow, the line is laid out again on submit
+		recorder->stream.count = item->first;
+		item->count = -1;
+	}
+
+	recorder->bytes_count += text_count;
+	++recorder->items_count;
+	return TRUE;
+}
+
+int affe_recorder_text_draw(affe_context* ctx, affe_recorder* recorder, float x, float y, const char* string, const char* end)
+{
+	if (!ctx) return FALSE;
+	if (!recorder || !string) return FALSE;
+	if (!end) end = string + strlen(string);
+
+	affe__state* state = &recorder->state;
+	if (state->font < 0 || state->font >= ctx->cache->fonts_count) return TRUE;
+
+	affe__font* font = ctx->cache->fonts[state->font];
+	if (!font->data) return TRUE;
+
+	int line_height = font->ascent + font->line_gap - font->descent;
+	float scale = stbtt_ScaleForPixelHeight(&font->metrics, state->size);
 
 	const float line_height_scaled = (float)line_height * scale;
 
 	const char* line_end, * next_start;
 	while (affe__text__line(string, end, &line_end, &next_start))
 	{
-		affe_text_draw_inline(ctx, x, y, string, line_end);
+		if (!affe_recorder_text_draw_inline(ctx, recorder, x, y, string, line_end)) return FALSE;
+		y -= line_height_scaled;
+		string = next_start;
+	}
+
+	return TRUE;
+}
+
+void affe_recorder_submit(affe_context* ctx, affe_recorder* const* recorders, int recorders_count)
+{
+	if (!ctx) return;
+	if (!recorders) return;
+
+	AFFE__TRACE_BEGIN(ctx, AFFE_ZONE_SUBMIT, 0);
+
+	const int prev_flush_control = ctx->buffer_flush_control;
+
+	if (prev_flush_control == AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC)
+		affe_buffer_flush_control(ctx, AFFE_BUFFER_FLUSH_CONTROL_NONE);
+
+	// Resolve every missed glyph first, so recorded vertices are not invalidated part way through merging
+	for (int i = 0; i < recorders_count; ++i)
+	{
+		const affe_recorder* recorder = recorders[i];
+		if (!recorder) continue;
+
+		for (long long j = 0; j < recorder->items_count; ++j)
+		{
+			const affe__recorder_item* item = &recorder->items[j];
+			if (item->count >= 0) continue;
+			if (item->state.font < 0 || item->state.font >= ctx->cache->fonts_count) continue;
+
+			affe__font* font = ctx->cache->fonts[item->state.font];
+			const char* text = recorder->bytes + item->text;
+			const char* text_end = text + item->text_count;
+			const float glyph_size = affe__state__glyph_size(ctx, &item->state);
+
+#ifdef AFFE_HARFBUZZ
+			// Shaped lines resolve their glyph indices instead
+			const affe__run* run = affe__shape__complex(text, text_end) ? affe__run__get(ctx, item->state.font, text, text_end, FALSE) : NULL;
+			if (run)
+			{
+				for (int k = 0; k < run->glyphs_count; ++k)
+					affe__glyph__get(ctx, font, affe__run__glyphs(run)[k].index, glyph_size, ctx->info.padding);
+				continue;
+			}
+#endif
+
+			unsigned int codepoints[AFFE_DECODE_CHUNK];
+			int codepoints_count;
+
+			while ((codepoints_count = affe__utf8__decode(&text, text_end, codepoints, AFFE_DECODE_CHUNK)) > 0)
+			for (int k = 0; k < codepoints_count; ++k)
+				affe__glyph__get(ctx, font, codepoints[k], glyph_size, ctx->info.padding);
+		}
+	}
+
+	affe__sink sink;
+	memset(&sink, 0, sizeof(affe__sink));
+
+	for (int i = 0; i < recorders_count; ++i)
+	{
+		const affe_recorder* recorder = recorders[i];
+		if (!recorder) continue;
+
+		for (long long j = 0; j < recorder->items_count; ++j)
+		{
+			const affe__recorder_item* item = &recorder->items[j];
+
+			if (item->count >= 0 && item->generation == ctx->cache->generation)
+			{
+				affe__buffer__key(ctx, affe__state__key(ctx, &item->state));
+				affe__buffer__write(ctx, recorder->stream.verts + item->first, item->count);
+			}
+			else
+			{
+				const char* text = recorder->bytes + item->text;
+				affe__text__emit(ctx, &item->state, item->x, item->y, text, text + item->text_count, &sink);
+			}
+		}
+	}
+
+	if (prev_flush_control == AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC)
+	{
+		affe_buffer_flush(ctx);
+		affe_buffer_flush_control(ctx, AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC);
+	}
+
+	AFFE__TRACE_END(ctx, AFFE_ZONE_SUBMIT, 0, recorders_count);
+}
+
+// ----- batches -----
+
+#ifndef AFFE_NO_THREADS
+// Rasterize the glyphs of one line, returns how many quads it can emit at most
+static long long affe__line__resolve(affe_context* ctx, const affe__state* state, affe__font* font, float glyph_size, const char* string, const char* end)
+{
+	(void)state;
+
+#ifdef AFFE_HARFBUZZ
+	// Shaped lines resolve their glyph indices instead
+	const affe__run* run = affe__shape__complex(string, end) ? affe__run__get(ctx, state->font, string, end, FALSE) : NULL;
+	if (run)
+	{
+		for (int i = 0; i < run->glyphs_count; ++i)
+			affe__glyph__get(ctx, font, affe__run__glyphs(run)[i].index, glyph_size, ctx->info.padding);
+
+		return run->glyphs_count;
+	}
+#endif
+
+	long long quads = 0;
+
+	unsigned int codepoints[AFFE_DECODE_CHUNK];
+	int codepoints_count;
+
+	while ((codepoints_count = affe__utf8__decode(&string, end, codepoints, AFFE_DECODE_CHUNK)) > 0)
+	{
+		for (int i = 0; i < codepoints_count; ++i)
+			affe__glyph__get(ctx, font, codepoints[i], glyph_size, ctx->info.padding);
+
+		quads += codepoints_count;
+	}
+
+	return quads;
+}
+
+// Rasterize every glyph `affe__text__emit_lines` needs for the text, lines outside of the clip rectangle are skipped
+// Returns how many quads it can emit at most
+static long long affe__text__resolve(affe_context* ctx, const affe__state* state, float y, const char* string, const char* end)
+{
+	if (state->font < 0 || state->font >= ctx->cache->fonts_count) return 0;
+
+	affe__font* font = ctx->cache->fonts[state->font];
+	if (!font->data) return 0;
+
+	float scale = stbtt_ScaleForPixelHeight(&font->metrics, state->size);
+	const float line_height_scaled = (float)(font->ascent + font->line_gap - font->descent) * scale;
+	const float glyph_size = affe__state__glyph_size(ctx, state);
+
+	affe__clip clip;
+	const int culling = affe__clip__get(ctx, state, &clip);
+
+	long long quads = 0;
+
+	const char* line_end, * next_start;
+	while (affe__text__line(string, end, &line_end, &next_start))
+	{
+		if (culling && y + (float)font->y_max * scale <= clip.y0) break;
+
+		if (!culling || affe__clip__line(&clip, font, scale, y))
+			quads += affe__line__resolve(ctx, state, font, glyph_size, string, line_end);
+
 		y -= line_height_scaled;
 		string = next_start;
 	}
 
-	if (prev_flush_control == AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC)
+	return quads;
+}
+
+// A batch being laid out, shared by every part
+struct affe__batch
+{
+	affe_context* ctx;
+	const affe__state* base;
+	const affe_text_item* items;
+	const affe_text_style* styles;
+
+	// Per item: first vertex in `verts` with one extra entry for the end, text length, and vertices written or -1
+	const long long* firsts;
+	const long long* lengths;
+	long long* counts;
+	affe_vertex* verts;
+
+	// First item of every part, with one extra entry for the end
+	int parts[AFFE_MAX_THREADS + 1];
+};
+
+typedef struct affe__batch affe__batch;
+
+// Lay out the items of one part, only reads the glyph cache
+static void affe__batch__part(void* user_ptr, int part, int)
+{
+	affe__batch* batch = (affe__batch*)user_ptr;
+
+	AFFE__TRACE_BEGIN(batch->ctx, AFFE_ZONE_LAYOUT, part);
+#ifdef AFFE_TRACE
+	long long part_verts = 0;
+#endif
+
+	for (int i = batch->parts[part]; i < batch->parts[part + 1]; ++i)
 	{
-		affe_buffer_flush(ctx);
-		affe_buffer_flush_control(ctx, AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC);
+		const affe_text_item* item = &batch->items[i];
+
+		affe__state state;
+		affe__style__state(&state, batch->base, batch->styles, item->style);
+
+		// Exactly the range resolved for the item, it never grows
+		affe__stream stream;
+		stream.verts = batch->verts + batch->firsts[i];
+		stream.count = 0;
+		stream.capacity = batch->firsts[i + 1] - batch->firsts[i];
+		stream.fixed = TRUE;
+
+		affe__sink sink;
+		memset(&sink, 0, sizeof(affe__sink));
+		sink.read_only = TRUE;
+		sink.stream = &stream;
+
+		const int complete = affe__text__emit_lines(batch->ctx, &state, item->x, item->y, item->string, item->string + batch->lengths[i], &sink);
+		batch->counts[i] = complete ? stream.count : -1;
+
+#ifdef AFFE_TRACE
+		part_verts += stream.count;
+#endif
+	}
+
+	AFFE__TRACE_END(batch->ctx, AFFE_ZONE_LAYOUT, part, part_verts);
+}
+
+// Grow the item ranges and the batch vertices, returns FALSE on failure
+static int affe__batch__reserve(affe_context* ctx, long long ranges, long long verts)
+{
+	if (ranges > ctx->batch_ranges_capacity)
+	{
+		long long* new_ranges = (long long*)affe__realloc(&ctx->info.allocator, ctx->batch_ranges, ranges * sizeof(long long));
+		if (!new_ranges) return FALSE;
+
+		ctx->batch_ranges = new_ranges;
+		ctx->batch_ranges_capacity = ranges;
+	}
+
+	if (verts > ctx->batch_verts_capacity)
+	{
+		affe_vertex* new_verts = (affe_vertex*)affe__realloc(&ctx->info.allocator, ctx->batch_verts, verts * sizeof(affe_vertex));
+		if (!new_verts) return FALSE;
+
+		ctx->batch_verts = new_verts;
+		ctx->batch_verts_capacity = verts;
+	}
+
+	return TRUE;
+}
+
+// Split the items into parts holding about the same number of bytes
+static void affe__batch__split(affe__batch* batch, int items_count, int parts)
+{
+	long long total = 0;
+	for (int i = 0; i < items_count; ++i)
+		total += batch->lengths[i];
+
+	long long bytes = 0;
+	int part = 1;
+	batch->parts[0] = 0;
+
+	for (int i = 0; i < items_count && part < parts; ++i)
+	{
+		bytes += batch->lengths[i];
+
+		while (part < parts && bytes * parts >= total * part)
+			batch->parts[part++] = i + 1;
 	}
+
+	while (part <= parts)
+		batch->parts[part++] = items_count;
 }
 
-static int affe__codepoint_iterator(const char** string, const char* end)
+// Resolve every item, then lay them out on the pool into the batch vertices
+// Returns FALSE if the batch could not be laid out, it is then drawn item by item
+static int affe__batch__layout(affe_context* ctx, affe__batch* batch, int items_count)
 {
-	unsigned int codepoint = 0;
-	unsigned int utf8state = AFFE_UTF8_ACCEPT;
+	// Ranges are stored as firsts, lengths then counts
+	if (!affe__batch__reserve(ctx, (long long)items_count * 3 + 1, 0)) return FALSE;
+
+	long long* firsts = ctx->batch_ranges;
+	long long* lengths = firsts + items_count + 1;
+	long long* counts = lengths + items_count;
 
-	for (; (*string) != end; ++(*string))
+	const affe_text_item* items = batch->items;
+
+	for (int i = 0; i < items_count; ++i)
+		lengths[i] = items[i].end ? items[i].end - items[i].string : (long long)strlen(items[i].string);
+
+	// Rasterize everything up front, a full atlas part way through means resolving again
+	for (int attempt = 0; attempt < 2; ++attempt)
 	{
-		unsigned int ret = affe__decut(&utf8state, &codepoint, *(const unsigned char*)(*string));
-		if (ret == AFFE_UTF8_REJECT)
+		const unsigned int generation = ctx->cache->generation;
+		firsts[0] = 0;
+
+		for (int i = 0; i < items_count; ++i)
+		{
+			affe__state state;
+			affe__style__state(&state, batch->base, batch->styles, items[i].style);
+			firsts[i + 1] = firsts[i] + affe__text__resolve(ctx, &state, items[i].y, items[i].string, items[i].string + lengths[i]) * 6;
+		}
+
+		if (generation != ctx->cache->generation)
 		{
-			utf8state = AFFE_UTF8_ACCEPT;
-			codepoint = 0;
+			// The atlas cannot hold every glyph of the batch at once
+			if (attempt == 1) return FALSE;
+			continue;
 		}
-		if (ret != AFFE_UTF8_ACCEPT) continue;
-		
-		++(*string);
-		return codepoint;
+
+		break;
 	}
 
-	return FALSE;
+	if (!affe__batch__reserve(ctx, 0, firsts[items_count])) return FALSE;
+
+	batch->firsts = firsts;
+	batch->lengths = lengths;
+	batch->counts = counts;
+	batch->verts = ctx->batch_verts;
+
+	affe__batch__split(batch, items_count, ctx->batch_pool->threads_count + 1);
+	affe__pool__run(ctx->batch_pool, affe__batch__part, batch);
+	return TRUE;
 }
+#endif
 
-static void affe__text_width(affe_context* ctx, const char* string, const char* end, int* left, int* right)
+void affe_text_draw_batch(affe_context* ctx, const affe_text_item* items, int items_count, const affe_text_style* styles)
 {
 	if (!ctx) return;
+	if (!items || items_count <= 0) return;
 
-	affe__state* state = affe__state__get(ctx);
-	if (state->font < 0 || state->font >= ctx->fonts_count) return;
+	AFFE__TRACE_BEGIN(ctx, AFFE_ZONE_BATCH, 0);
 
-	affe__font* font = ctx->fonts[state->font];
-	if (!font->data) return;
+	const int prev_flush_control = ctx->buffer_flush_control;
 
-	if (!end) end = string + strlen(string);
+	if (prev_flush_control == AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC)
+		affe_buffer_flush_control(ctx, AFFE_BUFFER_FLUSH_CONTROL_NONE);
 
-	int lhs = INT_MAX;
-	int rhs = INT_MIN;
-	int cursor = 0;
+	const affe__state* base = affe__state__get(ctx);
+
+#ifndef AFFE_NO_THREADS
+	affe__batch batch;
+	memset(&batch, 0, sizeof(affe__batch));
+	batch.ctx = ctx;
+	batch.base = base;
+	batch.items = items;
+	batch.styles = styles;
+
+	// Small batches and contexts without a pool draw item by item, without resolving and copying
+	const int laid_out = ctx->batch_pool && items_count >= AFFE_BATCH_THREAD_MIN_ITEMS && affe__batch__layout(ctx, &batch, items_count);
+
+	// Items that were not laid out are drawn in order and may invalidate the rest
+	const unsigned int generation = ctx->cache->generation;
+#endif
+
+	affe__sink sink;
+	memset(&sink, 0, sizeof(affe__sink));
 
-	while (int codepoint = affe__codepoint_iterator(&string, end))
+	for (int i = 0; i < items_count; ++i)
 	{
-		affe__glyph* glyph = affe__glyph__get(ctx, font, codepoint, ctx->info.size, ctx->info.padding);
+		affe__state state;
+		affe__style__state(&state, base, styles, items[i].style);
 
-		if (glyph)
+#ifndef AFFE_NO_THREADS
+		if (laid_out && batch.counts[i] >= 0 && generation == ctx->cache->generation)
 		{
-			int glyph_left = cursor + glyph->x0 + glyph->padding;
-			int glyph_right = cursor + glyph->x1 - glyph->padding;
-
-			if (glyph_left < lhs) lhs = glyph_left;
-			if (glyph_right > rhs) rhs = glyph_right;
+			if (batch.counts[i] > 0)
+			{
+				affe__buffer__key(ctx, affe__state__key(ctx, &state));
+				affe__buffer__write(ctx, batch.verts + batch.firsts[i], batch.counts[i]);
+			}
 
-			cursor += glyph->advance;
+			continue;
 		}
+#endif
+
+		const char* end = items[i].end ? items[i].end : items[i].string + strlen(items[i].string);
+		affe__text__emit_lines(ctx, &state, items[i].x, items[i].y, items[i].string, end, &sink);
 	}
 
-	*left = lhs;
-	*right = rhs;
+	if (prev_flush_control == AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC)
+	{
+		affe_buffer_flush(ctx);
+		affe_buffer_flush_control(ctx, AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC);
+	}
+
+	AFFE__TRACE_END(ctx, AFFE_ZONE_BATCH, 0, items_count);
 }
 
-void affe_text_draw_inline(affe_context* ctx, float x, float y, const char* string, const char* end)
+void affe_batch_threads(affe_context* ctx, int threads)
 {
 	if (!ctx) return;
 
-	affe__state* state = affe__state__get(ctx);
-	if (state->font < 0 || state->font >= ctx->fonts_count) return;
+	if (threads < 1) threads = 1;
+	if (threads > AFFE_MAX_THREADS) threads = AFFE_MAX_THREADS;
+	if (threads == ctx->batch_threads) return;
 
-	affe__font* font = ctx->fonts[state->font];
-	if (!font->data) return;
+	ctx->batch_threads = threads;
 
-	if (!end) end = string + strlen(string);
+#ifndef AFFE_NO_THREADS
+	affe__pool__delete(&ctx->info.allocator, ctx->batch_pool);
+	ctx->batch_pool = NULL;
 
-	float scale = stbtt_ScaleForPixelHeight(&font->metrics, state->size);
+	if (threads > 1) ctx->batch_pool = affe__pool__create(&ctx->info.allocator, threads);
+#endif
+}
 
-	// calculate alignment
+// ----- block compression -----
+
+// Encode one 4x4 block, the endpoints are its extremes with 6 values interpolated between them
+static void affe__bc4__block(const unsigned char* texels, unsigned char* block)
+{
+	int lo = 255, hi = 0;
+
+	for (int i = 0; i < 16; ++i)
 	{
-		int left, right;
-		affe__text_width(ctx, string, end, &left, &right);
+		if (texels[i] < lo) lo = texels[i];
+		if (texels[i] > hi) hi = texels[i];
+	}
 
-		float width = (float)(right - left) * scale;
+	block[0] = (unsigned char)hi;
+	block[1] = (unsigned char)lo;
 
-		x -= (float)left * scale;
+	// Steps from `lo` to `hi` to indices, step 0 is the second endpoint and step 7 the first
+	static const unsigned long long indices[8] = { 1, 7, 6, 5, 4, 3, 2, 0 };
+	unsigned long long bits = 0;
 
-		if (state->alignment & AFFE_ALIGN_CENTER)
-			x -= width * 0.5f;
-		else if (state->alignment & AFFE_ALIGN_RIGHT)
-			x -= width;
+	if (hi > lo)
+	{
+		// Nearest step in 16.16 fixed point, one division per block
+		const int scale = (7 * 65536 + (hi - lo) / 2) / (hi - lo);
+
+		for (int i = 0; i < 16; ++i)
+			bits |= indices[((texels[i] - lo) * scale + 32768) >> 16] << (3 * i);
 	}
 
-	int prev_glyph_index = -1;
+	for (int i = 0; i < 6; ++i)
+		block[2 + i] = (unsigned char)(bits >> (8 * i));
+}
 
-	while (int codepoint = affe__codepoint_iterator(&string, end))
-	{
-		affe__glyph* glyph = affe__glyph__get(ctx, font, codepoint, ctx->info.size, ctx->info.padding);
+void affe_bc4_encode(const unsigned char* pixels, int width, int height, int stride, unsigned char* blocks)
+{
+	if (!pixels || !blocks) return;
 
-		if (glyph)
+	for (int by = 0; by < height; by += 4)
+	{
+		for (int bx = 0; bx < width; bx += 4, blocks += 8)
 		{
-			if (glyph->s0 != glyph->s1 && glyph->t0 != glyph->t1)
+			unsigned char texels[16];
+
+			for (int y = 0; y < 4; ++y)
 			{
-				if (ctx->verts_count + 6 > ctx->info.buffer_quad_count * 6) affe_buffer_flush(ctx);
+				const unsigned char* row = pixels + (size_t)(by + y < height ? by + y : height - 1) * stride;
 
-				affe__quad quad;
+				for (int x = 0; x < 4; ++x)
+					texels[y * 4 + x] = row[bx + x < width ? bx + x : width - 1];
+			}
+
+			affe__bc4__block(texels, blocks);
+		}
+	}
+}
 
-				quad.x0 = x + (float)glyph->x0 * scale;
-				quad.y0 = y + (float)glyph->y0 * scale;
-				quad.x1 = x + (float)glyph->x1 * scale;
-				quad.y1 = y + (float)glyph->y1 * scale;
+void affe_bc4_decode(const unsigned char* blocks, int width, int height, unsigned char* pixels, int stride)
+{
+	if (!blocks || !pixels) return;
 
-				quad.s0 = (float)glyph->s0 / (float)ctx->info.width;
-				quad.t0 = (float)glyph->t0 / (float)ctx->info.height;
-				quad.s1 = (float)glyph->s1 / (float)ctx->info.width;
-				quad.t1 = (float)glyph->t1 / (float)ctx->info.height;
+	for (int by = 0; by < height; by += 4)
+	{
+		for (int bx = 0; bx < width; bx += 4, blocks += 8)
+		{
+			const int r0 = blocks[0], r1 = blocks[1];
 
-				quad.r = state->r;
-				quad.g = state->g;
-				quad.b = state->b;
-				quad.a = state->a;
+			int values[8] = { r0, r1 };
+
+			if (r0 > r1)
+			{
+				for (int i = 2; i < 8; ++i)
+					values[i] = ((8 - i) * r0 + (i - 1) * r1 + 3) / 7;
+			}
+			else
+			{
+				for (int i = 2; i < 6; ++i)
+					values[i] = ((6 - i) * r0 + (i - 1) * r1 + 2) / 5;
+
+				values[6] = 0;
+				values[7] = 255;
+			}
+
+			unsigned long long bits = 0;
+			for (int i = 0; i < 6; ++i)
+				bits |= (unsigned long long)blocks[2 + i] << (8 * i);
 
-				ctx->verts[ctx->verts_count++] = affe_vertex(quad.x0, quad.y1, quad.s0, quad.t1, quad.r, quad.g, quad.b, quad.a);
-				ctx->verts[ctx->verts_count++] = affe_vertex(quad.x0, quad.y0, quad.s0, quad.t0, quad.r, quad.g, quad.b, quad.a);
-				ctx->verts[ctx->verts_count++] = affe_vertex(quad.x1, quad.y1, quad.s1, quad.t1, quad.r, quad.g, quad.b, quad.a);
+			for (int y = 0; y < 4 && by + y < height; ++y)
+			{
+				unsigned char* row = pixels + (size_t)(by + y) * stride;
 
-				ctx->verts[ctx->verts_count++] = affe_vertex(quad.x1, quad.y1, quad.s1, quad.t1, quad.r, quad.g, quad.b, quad.a);
-				ctx->verts[ctx->verts_count++] = affe_vertex(quad.x0, quad.y0, quad.s0, quad.t0, quad.r, quad.g, quad.b, quad.a);
-				ctx->verts[ctx->verts_count++] = affe_vertex(quad.x1, quad.y0, quad.s1, quad.t0, quad.r, quad.g, quad.b, quad.a);
+				for (int x = 0; x < 4 && bx + x < width; ++x)
+					row[bx + x] = (unsigned char)values[(bits >> (3 * (y * 4 + x))) & 7];
 			}
+		}
+	}
+}
+
+// ----- tracing -----
+
+static const char* const affe__zone_names[AFFE_ZONE_COUNT] = { "rasterize", "upload", "draw", "flush", "invalidate", "shape", "batch", "layout", "submit", "frame" };
+
+void affe_trace_callback(affe_context* ctx, affe_trace_proc proc, void* user_ptr)
+{
+	if (!ctx) return;
+
+#ifdef AFFE_TRACE
+	ctx->trace_proc = proc;
+	ctx->trace_user_ptr = user_ptr;
+#else
+	(void)proc;
+	(void)user_ptr;
+#endif
+}
+
+const char* affe_trace_zone_name(int zone)
+{
+	if (zone < 0 || zone >= AFFE_ZONE_COUNT) return "unknown";
+	return affe__zone_names[zone];
+}
+
+int affe_trace_events(affe_context* ctx, affe_trace_event* events, int capacity)
+{
+	if (!ctx) return 0;
+	if (!events || capacity <= 0) return 0;
+
+#ifdef AFFE_TRACE
+	const unsigned long long head = std::atomic_ref<unsigned long long>(ctx->trace_head).load(std::memory_order_acquire);
+
+	unsigned long long count = head < AFFE_TRACE_EVENTS ? head : AFFE_TRACE_EVENTS;
+	if (count > (unsigned long long)capacity) count = (unsigned long long)capacity;
+
+	for (unsigned long long i = 0; i < count; ++i)
+		events[i] = ctx->trace_events[(head - count + i) & (AFFE_TRACE_EVENTS - 1)];
+
+	return (int)count;
+#else
+	return 0;
+#endif
+}
+
+void affe_trace_clear(affe_context* ctx)
+{
+	if (!ctx) return;
+
+#ifdef AFFE_TRACE
+	std::atomic_ref<unsigned long long>(ctx->trace_head).store(0, std::memory_order_release);
+#endif
+}
+
+#ifdef AFFE_TRACE
+// Text is gathered into a small buffer before it is handed to the user
+struct affe__trace_writer
+{
+	affe_trace_write_proc proc;
+	void* user_ptr;
+
+	char buffer[1024];
+	int count;
+};
+
+typedef struct affe__trace_writer affe__trace_writer;
+
+static void affe__trace__flush(affe__trace_writer* writer)
+{
+	if (writer->count > 0) writer->proc(writer->user_ptr, writer->buffer, writer->count);
+	writer->count = 0;
+}
+
+static void affe__trace__text(affe__trace_writer* writer, const char* text)
+{
+	for (; *text; ++text)
+	{
+		if (writer->count == (int)sizeof(writer->buffer)) affe__trace__flush(writer);
+		writer->buffer[writer->count++] = *text;
+	}
+}
+
+// Write a number with `decimals` digits after the decimal point, `value` is scaled by 10^decimals
+static void affe__trace__number(affe__trace_writer* writer, long long value, int decimals)
+{
+	unsigned char chars[AFFE__NUMBER_CHARS];
+	const unsigned long long magnitude = value < 0 ? 0ull - (unsigned long long)value : (unsigned long long)value;
+	const int count = affe__number__format(magnitude, 0, decimals, value < 0, chars);
+
+	char text[AFFE__NUMBER_CHARS + 1];
+	for (int i = 0; i < count; ++i)
+		text[i] = AFFE__NUMERALS[chars[i]];
+	text[count] = '\0';
+
+	affe__trace__text(writer, text);
+}
+#endif
 
-			x += (float)glyph->advance * scale;
+int affe_trace_write(affe_context* ctx, affe_trace_write_proc proc, void* user_ptr)
+{
+	if (!ctx) return 0;
+	if (!proc) return 0;
+
+#ifdef AFFE_TRACE
+	affe__trace_writer writer;
+	writer.proc = proc;
+	writer.user_ptr = user_ptr;
+	writer.count = 0;
+
+	const unsigned long long head = std::atomic_ref<unsigned long long>(ctx->trace_head).load(std::memory_order_acquire);
+	const unsigned long long count = head < AFFE_TRACE_EVENTS ? head : AFFE_TRACE_EVENTS;
+
+	affe__trace__text(&writer, "{\"traceEvents\":[");
+
+	for (unsigned long long i = 0; i < count; ++i)
+	{
+		const affe_trace_event* event = &ctx->trace_events[(head - count + i) & (AFFE_TRACE_EVENTS - 1)];
+
+		affe__trace__text(&writer, i == 0 ? "\n{\"name\":\"" : ",\n{\"name\":\"");
+		affe__trace__text(&writer, affe_trace_zone_name(event->zone));
+		affe__trace__text(&writer, "\",\"cat\":\"affe\",\"ph\":\"");
+
+		if (event->phase == AFFE_TRACE_PHASE_BEGIN) affe__trace__text(&writer, "B");
+		else if (event->phase == AFFE_TRACE_PHASE_END) affe__trace__text(&writer, "E");
+		else affe__trace__text(&writer, "i\",\"s\":\"t");
+
+		// Nanoseconds written as microseconds
+		affe__trace__text(&writer, "\",\"ts\":");
+		affe__trace__number(&writer, event->time - ctx->trace_epoch, 3);
+		affe__trace__text(&writer, ",\"pid\":1,\"tid\":");
+		affe__trace__number(&writer, event->thread, 0);
+
+		if (event->phase != AFFE_TRACE_PHASE_BEGIN)
+		{
+			affe__trace__text(&writer, ",\"args\":{\"value\":");
+			affe__trace__number(&writer, event->value, 0);
+			affe__trace__text(&writer, "}");
 		}
 
-		prev_glyph_index = glyph != NULL ? glyph->index : -1;
+		affe__trace__text(&writer, "}");
 	}
 
-	if (ctx->buffer_flush_control == AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC)
-		affe_buffer_flush(ctx);
+	affe__trace__text(&writer, "\n],\"displayTimeUnit\":\"ns\"}\n");
+	affe__trace__flush(&writer);
+
+	return (int)count;
+#else
+	(void)user_ptr;
+	return 0;
+#endif
 }
 
 #endif // AFFE_IMPLEMENTATION
\ No newline at end of file
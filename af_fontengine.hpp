@@ -0,0 +1,265 @@
+/* af_fontengine.hpp Last Updated: v0.1.9
+
+Authored from 2023 by AnthoFoxo
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+
+Credits to Sean Barrett, Mikko Mononen, Bjoern Hoehrmann, and the community for making this project possible.
+
+Visit the github page for updates and documentation: https://github.com/anthofoxo/fontengine
+
+Contributor list
+AnthoFoxo
+*/
+#ifndef AF_FONTENGINE_HPP
+#define AF_FONTENGINE_HPP
+
+// Typed C++ facade over the C api, needs C++20
+// The backend, vertex type and options are template parameters. The backend is still reached through the
+// `affe_context_create_info` procs, static trampolines forward each call to its members through the user pointer.
+// Only vertices of a custom type are handed to the backend by `flush` itself, written by `vertex_traits`
+// without looking at a runtime `affe_vertex_format`.
+// Text is laid out by the C api, include the implementation as usual in one source file.
+
+#include "af_fontengine.h"
+
+#include <string.h>
+#include <type_traits>
+#include <vector>
+
+namespace affe
+{
+	// Settings of a `basic_context`
+	// `alignment` and `automatic_flush` are set on the context when it is created, the C api can change them later
+	// The buffer size and vertices per quad are fixed by the type
+	struct default_options
+	{
+		// Alignment set on the context when it is created
+		static constexpr int alignment = AFFE_ALIGN_LEFT;
+
+		// Draw at the end of every `draw`, otherwise only when the buffer fills up or on `flush`
+		static constexpr bool automatic_flush = true;
+
+		// Quads held before the backend draws, replaces `affe_context_create_info::buffer_quad_count`
+		static constexpr long long buffer_quads = 1024;
+
+		// 6 for two triangles per quad, ordered as `draw_proc` receives them
+		// 4 for one vertex per corner for indexed drawing: bottom left, bottom right, top right, top left
+		static constexpr int quad_vertices = 6;
+	};
+
+	// Writes one vertex of a quad, specialize this for your own vertex types
+	template <class Vertex>
+	struct vertex_traits;
+
+	template <>
+	struct vertex_traits<affe_vertex>
+	{
+		static void write(affe_vertex& vertex, float x, float y, float s, float t, const affe_text_quad& quad)
+		{
+			vertex.x = x;
+			vertex.y = y;
+			vertex.s = s;
+			vertex.t = t;
+			vertex.r = quad.r;
+			vertex.g = quad.g;
+			vertex.b = quad.b;
+			vertex.a = quad.a;
+		}
+	};
+
+	// Context forwarding its procs to `Backend`, drawing in `Vertex` format
+	// The backend has these members, `create`, `destroy` and `error` are optional:
+	//   void update(affe_context* ctx, int x, int y, int width, int height, void* pixels);
+	//   void draw(affe_context* ctx, const Vertex* verts, long long verts_count);
+	//   bool create(affe_context* ctx, int width, int height);
+	//   void destroy(affe_context* ctx);
+	//   void error(affe_context* ctx, int error);
+	// Without `error` the cache is invalidated when the atlas is full.
+	// With `affe_vertex` and 6 vertices per quad text goes through the context's own buffer, `affe_buffer_key` is valid in `draw`.
+	// Other vertex types are built from `affe_text_quads`, the pipeline key is not tracked so the backend draws with its own state.
+	template <class Backend, class Vertex = affe_vertex, class Options = default_options>
+	class basic_context
+	{
+		static_assert(Options::quad_vertices == 4 || Options::quad_vertices == 6, "quads have 4 or 6 vertices");
+		static_assert(Options::buffer_quads > 0, "the buffer must hold at least one quad");
+
+		// The engine already writes this layout, no conversion is needed
+		static constexpr bool direct = std::is_same_v<Vertex, affe_vertex> && Options::quad_vertices == 6;
+
+	public:
+		// The procs, user pointer and buffer size of `info` are replaced, everything else is passed to `affe_context_create`
+		basic_context(Backend& backend, const affe_context_create_info& info) : m_backend(backend)
+		{
+			affe_context_create_info create_info = info;
+			create_info.user_ptr = this;
+			create_info.create_proc = &create_proc;
+			create_info.update_proc = &update_proc;
+			create_info.draw_proc = direct ? &draw_proc : NULL;
+			create_info.delete_proc = &delete_proc;
+			create_info.error_proc = &error_proc;
+
+			create_info.buffer_quad_count = Options::buffer_quads;
+
+			if constexpr (!direct)
+			{
+				m_vertices.resize((size_t)(Options::buffer_quads * Options::quad_vertices));
+				m_quads.resize((size_t)Options::buffer_quads);
+			}
+
+			m_ctx = affe_context_create(&create_info);
+			if (!m_ctx) return;
+
+			affe_set_alignment(m_ctx, Options::alignment);
+			affe_buffer_flush_control(m_ctx, Options::automatic_flush ? AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC : AFFE_BUFFER_FLUSH_CONTROL_NONE);
+		}
+
+		~basic_context()
+		{
+			affe_context_delete(m_ctx);
+		}
+
+		basic_context(const basic_context&) = delete;
+		basic_context& operator=(const basic_context&) = delete;
+
+		// FALSE if the context could not be created
+		explicit operator bool() const { return m_ctx != NULL; }
+
+		// For the rest of the C api, fonts and state are set through this
+		affe_context* get() const { return m_ctx; }
+
+		Backend& backend() const { return m_backend; }
+
+		// Draw text with the current state, line endings are respected
+		void draw(float x, float y, const char* string, const char* end = NULL)
+		{
+			if (!m_ctx || !string) return;
+
+			if constexpr (direct)
+			{
+				affe_text_draw(m_ctx, x, y, string, end);
+				return;
+			}
+
+			if (!end) end = string + strlen(string);
+
+			// A full buffer means it was too small, fewer quads mean the text does not fit the atlas and nothing was written
+			long long written = 0;
+			while (!affe_text_quads(m_ctx, x, y, string, end, m_quads.data(), (long long)m_quads.size(), &written) && written == (long long)m_quads.size())
+				m_quads.resize(m_quads.size() * 2);
+
+			for (long long i = 0; i < written; ++i)
+			{
+				if (m_quads_count == Options::buffer_quads) flush();
+
+				write_quad(&m_vertices[(size_t)(m_quads_count * Options::quad_vertices)], m_quads[(size_t)i]);
+				++m_quads_count;
+			}
+
+			if constexpr (Options::automatic_flush) flush();
+		}
+
+		// Send buffered vertices to the backend
+		void flush()
+		{
+			if constexpr (direct)
+			{
+				affe_buffer_flush(m_ctx);
+				return;
+			}
+
+			if (m_quads_count == 0) return;
+
+			m_backend.draw(m_ctx, m_vertices.data(), m_quads_count * Options::quad_vertices);
+			m_quads_count = 0;
+		}
+
+	private:
+		static void write_quad(Vertex* v, const affe_text_quad& quad)
+		{
+			if constexpr (Options::quad_vertices == 4)
+			{
+				vertex_traits<Vertex>::write(v[0], quad.x0, quad.y0, quad.s0, quad.t0, quad);
+				vertex_traits<Vertex>::write(v[1], quad.x1, quad.y0, quad.s1, quad.t0, quad);
+				vertex_traits<Vertex>::write(v[2], quad.x1, quad.y1, quad.s1, quad.t1, quad);
+				vertex_traits<Vertex>::write(v[3], quad.x0, quad.y1, quad.s0, quad.t1, quad);
+			}
+			else
+			{
+				vertex_traits<Vertex>::write(v[0], quad.x0, quad.y1, quad.s0, quad.t1, quad);
+				vertex_traits<Vertex>::write(v[1], quad.x0, quad.y0, quad.s0, quad.t0, quad);
+				vertex_traits<Vertex>::write(v[2], quad.x1, quad.y1, quad.s1, quad.t1, quad);
+
+				vertex_traits<Vertex>::write(v[3], quad.x1, quad.y1, quad.s1, quad.t1, quad);
+				vertex_traits<Vertex>::write(v[4], quad.x0, quad.y0, quad.s0, quad.t0, quad);
+				vertex_traits<Vertex>::write(v[5], quad.x1, quad.y0, quad.s1, quad.t0, quad);
+			}
+		}
+
+		static basic_context* self(void* user_ptr) { return static_cast<basic_context*>(user_ptr); }
+
+		static int create_proc(affe_context* ctx, void* user_ptr, int width, int height)
+		{
+			if constexpr (requires(Backend& backend) { backend.create(ctx, width, height); })
+				return self(user_ptr)->m_backend.create(ctx, width, height) ? TRUE : FALSE;
+			else
+				return TRUE;
+		}
+
+		static void update_proc(affe_context* ctx, void* user_ptr, int x, int y, int width, int height, void* pixels)
+		{
+			self(user_ptr)->m_backend.update(ctx, x, y, width, height, pixels);
+		}
+
+		static void draw_proc(affe_context* ctx, void* user_ptr, affe_vertex* verts, long long verts_count)
+		{
+			self(user_ptr)->m_backend.draw(ctx, (const Vertex*)verts, verts_count);
+		}
+
+		static void delete_proc(affe_context* ctx, void* user_ptr)
+		{
+			if constexpr (requires(Backend& backend) { backend.destroy(ctx); })
+				self(user_ptr)->m_backend.destroy(ctx);
+		}
+
+		static void error_proc(affe_context* ctx, void* user_ptr, int error)
+		{
+			basic_context* context = self(user_ptr);
+
+			// Buffered vertices point into the atlas as it is now, draw them before it can be invalidated
+			if constexpr (!direct)
+			{
+				if (error == AFFE_ERROR_ATLAS_FULL)
+					context->flush();
+			}
+
+			if constexpr (requires(Backend& backend) { backend.error(ctx, error); })
+				context->m_backend.error(ctx, error);
+			else if (error == AFFE_ERROR_ATLAS_FULL)
+				affe_cache_invalidate(ctx);
+		}
+
+		Backend& m_backend;
+		affe_context* m_ctx = NULL;
+
+		std::vector<Vertex> m_vertices;
+		long long m_quads_count = 0;
+
+		// Layout output, grows to the longest text drawn
+		std::vector<affe_text_quad> m_quads;
+	};
+}
+
+#endif // AF_FONTENGINE_HPP
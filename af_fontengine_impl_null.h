@@ -0,0 +1,189 @@
+/* af_fontengine_impl_null.h Last Updated: v0.1.9
+
+Authored from 2023 by AnthoFoxo
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+
+Credits to Sean Barrett, Mikko Mononen, Bjoern Hoehrmann, and the community for making this project possible.
+
+Visit the github page for updates and documentation: https://github.com/anthofoxo/fontengine
+
+Contributor list
+AnthoFoxo
+*/
+#ifndef AF_FONTENGINE_NULL_H
+#define AF_FONTENGINE_NULL_H
+
+// Headless backend, nothing is rendered
+// Callbacks only record call counts and byte counts, useful for benchmarks and testing without a gpu
+// #define AFFE_NULL_IMPLEMENTATION
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct affe_null_stats
+{
+	long long create_calls;
+	long long delete_calls;
+
+	// Calls to `update_proc` and the number of atlas bytes received
+	long long update_calls;
+	long long update_bytes;
+
+	// Calls to `draw_proc` and the number of vertices and bytes received
+	long long draw_calls;
+	long long draw_verts;
+	long long draw_bytes;
+
+	// Calls to `error_proc` with `AFFE_ERROR_ATLAS_FULL`
+	long long atlas_full;
+
+	// Sum of all vertex data received, keeps the work observable and allows comparing output between runs
+	unsigned long long checksum;
+};
+
+typedef struct affe_null_stats affe_null_stats;
+
+AFFE_API affe_context* affe_null_context_create(int width, int height, int quads, int padding, int size);
+// Same as `affe_null_context_create`, engine memory goes through `allocator`, may be NULL
+AFFE_API affe_context* affe_null_context_create_allocator(int width, int height, int quads, int padding, int size, const affe_allocator* allocator);
+AFFE_API void affe_null_context_delete(affe_context* ctx);
+
+// Get the counters recorded by the backend
+AFFE_API const affe_null_stats* affe_null_stats_get(affe_context* ctx);
+AFFE_API void affe_null_stats_reset(affe_context* ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // AF_FONTENGINE_NULL_H
+
+#ifdef AFFE_NULL_IMPLEMENTATION
+
+static int affe__null__create(affe_context* ctx, void* user_ptr, int w, int h)
+{
+	(void)ctx; (void)w; (void)h;
+	affe_null_stats* stats = (affe_null_stats*)user_ptr;
+	++stats->create_calls;
+	return TRUE;
+}
+
+static void affe__null__update(affe_context* ctx, void* user_ptr, int x, int y, int w, int h, void* pixels)
+{
+	(void)ctx; (void)x; (void)y; (void)pixels;
+	affe_null_stats* stats = (affe_null_stats*)user_ptr;
+	++stats->update_calls;
+	stats->update_bytes += (long long)w * h;
+}
+
+static void affe__null__draw(affe_context* ctx, void* user_ptr, affe_vertex* verts, long long verts_count)
+{
+	(void)ctx;
+	affe_null_stats* stats = (affe_null_stats*)user_ptr;
+	++stats->draw_calls;
+	stats->draw_verts += verts_count;
+	stats->draw_bytes += verts_count * (long long)sizeof(affe_vertex);
+
+	// Positions and texture coordinates are enough to detect changed output
+	unsigned long long checksum = stats->checksum;
+
+	for (long long i = 0; i < verts_count; ++i)
+	{
+		unsigned int words[4];
+		memcpy(&words[0], &verts[i].x, sizeof(float));
+		memcpy(&words[1], &verts[i].y, sizeof(float));
+		memcpy(&words[2], &verts[i].s, sizeof(float));
+		memcpy(&words[3], &verts[i].t, sizeof(float));
+
+		checksum = checksum * 31 + (words[0] ^ (words[1] << 1) ^ (words[2] << 2) ^ (words[3] << 3));
+	}
+
+	stats->checksum = checksum;
+}
+
+static void affe__null__delete(affe_context* ctx, void* user_ptr)
+{
+	(void)ctx;
+	affe_null_stats* stats = (affe_null_stats*)user_ptr;
+	++stats->delete_calls;
+}
+
+static void affe__null__error(affe_context* ctx, void* user_ptr, int error)
+{
+	affe_null_stats* stats = (affe_null_stats*)user_ptr;
+
+	if (error == AFFE_ERROR_ATLAS_FULL)
+	{
+		++stats->atlas_full;
+		affe_cache_invalidate(ctx);
+	}
+}
+
+affe_context* affe_null_context_create(int width, int height, int quads, int padding, int size)
+{
+	return affe_null_context_create_allocator(width, height, quads, padding, size, NULL);
+}
+
+affe_context* affe_null_context_create_allocator(int width, int height, int quads, int padding, int size, const affe_allocator* allocator)
+{
+	affe_null_stats* impl;
+	impl = (affe_null_stats*)malloc(sizeof(affe_null_stats));
+	if (!impl) return NULL;
+	memset(impl, 0, sizeof(affe_null_stats));
+
+	affe_context_create_info info;
+	memset(&info, 0, sizeof(affe_context_create_info));
+
+	info.width = width;
+	info.height = height;
+	info.user_ptr = impl;
+	info.create_proc = &affe__null__create;
+	info.update_proc = &affe__null__update;
+	info.draw_proc = &affe__null__draw;
+	info.delete_proc = &affe__null__delete;
+	info.error_proc = &affe__null__error;
+
+	info.buffer_quad_count = quads;
+	info.edge_value = 0.8f;
+	info.padding = padding;
+	info.size = (float)size;
+	if (allocator) info.allocator = *allocator;
+
+	affe_context* ctx = affe_context_create(&info);
+	if (!ctx) free(impl);
+	return ctx;
+}
+
+void affe_null_context_delete(affe_context* ctx)
+{
+	void* user_ptr = affe_user_ptr(ctx);
+	affe_context_delete(ctx);
+	free(user_ptr);
+}
+
+const affe_null_stats* affe_null_stats_get(affe_context* ctx)
+{
+	return (const affe_null_stats*)affe_user_ptr(ctx);
+}
+
+void affe_null_stats_reset(affe_context* ctx)
+{
+	affe_null_stats* stats = (affe_null_stats*)affe_user_ptr(ctx);
+	if (stats) memset(stats, 0, sizeof(affe_null_stats));
+}
+
+#endif // AFFE_NULL_IMPLEMENTATION
@@ -1,4 +1,4 @@
-/* af_fontengine_impl_ogl3.h Last Updated: v0.1.8
+/* af_fontengine_impl_ogl3.h Last Updated: v0.1.9
 
 Authored from 2023 by AnthoFoxo
 
@@ -29,6 +29,9 @@ AnthoFoxo
 // Include an OpenGL header before including this file
 // #define AFFE_OGL3_IMPLEMENTATION
 
+// Define to store the atlas as BC4 (RGTC1) blocks, half the memory of `GL_R8`, see `AFFE_FLAGS_ATLAS_BC4`
+// #define AFFE_OGL3_BC4
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -36,6 +39,9 @@ extern "C" {
 AFFE_API affe_context* affe_ogl3_context_create(int width, int height, int quads, int padding, int size);
 AFFE_API void affe_ogl3_context_delete(affe_context* ctx);
 
+// Atlas texture, for drawing text emitted with `affe_text_emit` in your own draw calls
+AFFE_API unsigned int affe_ogl3_texture(affe_context* ctx);
+
 #ifdef __cplusplus
 }
 #endif
@@ -68,6 +74,23 @@ struct affe__ogl
 	GLuint program;
 	GLuint texture;
 	GLuint vao, vbo;
+
+	// Effect uniforms, see `affe_buffer_effect`
+	GLint u_padding;
+	GLint u_outline, u_outline_col;
+	GLint u_shadow, u_shadow_col;
+	GLint u_glow, u_glow_col;
+
+	// Set for text drawn from coverage bitmaps, see `AFFE_SHADER_COVERAGE`
+	GLint u_coverage;
+
+	float padding;
+
+#ifdef AFFE_OGL3_BC4
+	// Glyph pixels compressed for upload
+	unsigned char* blocks;
+	long long blocks_size;
+#endif
 };
 
 static unsigned int affe__ogl__make_shader(unsigned int type, const char* source)
@@ -97,7 +120,22 @@ static int create(affe_context* ctx, void* user_ptr, int w, int h)
 	unsigned int fsh = 0;
 
 	const char* vsh_source = "#version 330 core\n\nlayout(location = 0) in vec2 vert_pos;\nlayout(location = 1) in vec2 vert_tex;\nlayout(location = 2) in vec4 vert_col;\n\nout vec2 frag_tex;\n\nout vec4 frag_col;\n\nvoid main(void)\n{\n\tgl_Position = vec4(vert_pos, 0.0, 1.0);\n\tfrag_tex = vert_tex;\n\tfrag_col = vert_col;\n}";
-	const char* fsh_source = "#version 330 core\n\nin vec2 frag_tex;\nin vec4 frag_col;\n\nlayout(location = 0) out vec4 out_col;\n\nuniform sampler2D u_sampler;\n\nvoid main(void)\n{\n\tout_col = frag_col;\n\tfloat dist = texture(u_sampler, frag_tex).r;\n\tfloat w = fwidth(dist);\n\tout_col.a *= smoothstep(0.8 - w, 0.8 + w, dist);\n}";
+	// Layers are blended back to front premultiplied: shadow, glow, outline, then the text
+	// Without an effect only the text layer remains, so one variant serves every draw
+	// Coverage bitmaps skip the distance field and use the sample as alpha
+	const char* fsh_source =
+		"#version 330 core\n\nin vec2 frag_tex;\nin vec4 frag_col;\n\nlayout(location = 0) out vec4 out_col;\n\nuniform sampler2D u_sampler;\n"
+		"uniform float u_padding;\nuniform float u_outline;\nuniform vec4 u_outline_col;\nuniform vec3 u_shadow;\nuniform vec4 u_shadow_col;\nuniform float u_glow;\nuniform vec4 u_glow_col;\nuniform bool u_coverage;\n\n"
+		"vec4 layer(vec4 top, vec4 bottom)\n{\n\treturn top + bottom * (1.0 - top.a);\n}\n\n"
+		"void main(void)\n{\n\tconst float edge = 0.8;\n\tfloat dist = texture(u_sampler, frag_tex).r;\n\n"
+		"\tif (u_coverage)\n\t{\n\t\tout_col = vec4(frag_col.rgb, frag_col.a * dist);\n\t\treturn;\n\t}\n\n"
+		"\tfloat w = fwidth(dist);\n\tvec4 col = vec4(0.0);\n\n"
+		"\tif (u_shadow_col.a > 0.0)\n\t{\n\t\tvec2 offset = vec2(u_shadow.x, -u_shadow.y) / vec2(textureSize(u_sampler, 0));\n\t\tfloat soft = u_shadow.z / u_padding + w;\n"
+		"\t\tcol = vec4(u_shadow_col.rgb, 1.0) * u_shadow_col.a * smoothstep(edge - soft, edge + soft, texture(u_sampler, frag_tex - offset).r);\n\t}\n\n"
+		"\tif (u_glow > 0.0)\n\t\tcol = layer(vec4(u_glow_col.rgb, 1.0) * u_glow_col.a * smoothstep(edge - u_glow / u_padding, edge, dist), col);\n\n"
+		"\tif (u_outline > 0.0)\n\t{\n\t\tfloat outline = edge - u_outline / u_padding;\n\t\tcol = layer(vec4(u_outline_col.rgb, 1.0) * u_outline_col.a * smoothstep(outline - w, outline + w, dist), col);\n\t}\n\n"
+		"\tcol = layer(vec4(frag_col.rgb, 1.0) * frag_col.a * smoothstep(edge - w, edge + w, dist), col);\n"
+		"\tout_col = col.a > 0.0 ? vec4(col.rgb / col.a, col.a) : vec4(0.0);\n}";
 
 	affe__ogl* ptr = (affe__ogl*)user_ptr;
 
@@ -133,6 +171,15 @@ static int create(affe_context* ctx, void* user_ptr, int w, int h)
 	glDeleteShader(vsh);
 	glDeleteShader(fsh);
 
+	ptr->u_padding = glGetUniformLocation(ptr->program, "u_padding");
+	ptr->u_outline = glGetUniformLocation(ptr->program, "u_outline");
+	ptr->u_outline_col = glGetUniformLocation(ptr->program, "u_outline_col");
+	ptr->u_shadow = glGetUniformLocation(ptr->program, "u_shadow");
+	ptr->u_shadow_col = glGetUniformLocation(ptr->program, "u_shadow_col");
+	ptr->u_glow = glGetUniformLocation(ptr->program, "u_glow");
+	ptr->u_glow_col = glGetUniformLocation(ptr->program, "u_glow_col");
+	ptr->u_coverage = glGetUniformLocation(ptr->program, "u_coverage");
+
 	glBindBuffer(GL_ARRAY_BUFFER, ptr->vbo);
 	glBufferData(GL_ARRAY_BUFFER, affe_buffer_size(ctx), NULL, GL_STREAM_DRAW);
 
@@ -150,7 +197,11 @@ static int create(affe_context* ctx, void* user_ptr, int w, int h)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+#ifdef AFFE_OGL3_BC4
+	glCompressedTexImage2D(GL_TEXTURE_2D, 0, GL_COMPRESSED_RED_RGTC1, w, h, 0, (GLsizei)AFFE_BC4_SIZE(w, h), NULL);
+#else
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, w, h, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+#endif
 
 	return TRUE;
 error:
@@ -164,17 +215,37 @@ error:
 	return FALSE;
 }
 
-static void update(affe_context* ctx, void* user_ptr, int x, int y, int w, int h, void* pixels)
+static void update(affe_context* ctx, void*, int x, int y, int w, int h, void* pixels)
 {
 	affe__ogl* ptr = ((affe__ogl*)affe_user_ptr(ctx));
 
+#ifdef AFFE_OGL3_BC4
+	// Uploads cover whole blocks
+	const long long size = AFFE_BC4_SIZE(w, h);
+
+	if (size > ptr->blocks_size)
+	{
+		unsigned char* new_blocks = (unsigned char*)realloc(ptr->blocks, size);
+		if (!new_blocks) return;
+
+		ptr->blocks = new_blocks;
+		ptr->blocks_size = size;
+	}
+
+	affe_bc4_encode((const unsigned char*)pixels, w, h, w, ptr->blocks);
+#endif
+
 	int prev_unpack_alignment; glGetIntegerv(GL_UNPACK_ALIGNMENT, &prev_unpack_alignment);
 	int prev_texture_binding; glGetIntegerv(GL_TEXTURE_BINDING_2D, &prev_texture_binding);
 
 	glBindTexture(GL_TEXTURE_2D, ptr->texture);
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 
+#ifdef AFFE_OGL3_BC4
+	glCompressedTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_COMPRESSED_RED_RGTC1, (GLsizei)size, ptr->blocks);
+#else
 	glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RED, GL_UNSIGNED_BYTE, pixels);
+#endif
 
 	glPixelStorei(GL_UNPACK_ALIGNMENT, prev_unpack_alignment);
 	glBindTexture(GL_TEXTURE_2D, std::bit_cast<unsigned int>(prev_texture_binding));
@@ -184,7 +255,7 @@ float af_linear_remap(float value, float min1, float max1, float min2, float max
 	return min2 + (value - min1) * (max2 - min2) / (max1 - min1);
 }
 
-static void draw(affe_context* ctx, void* user_ptr, affe_vertex* verts, long long verts_count)
+static void draw(affe_context* ctx, void*, affe_vertex* verts, long long verts_count)
 {
 	affe__ogl* ptr = ((affe__ogl*)affe_user_ptr(ctx));
 
@@ -220,10 +291,27 @@ static void draw(affe_context* ctx, void* user_ptr, affe_vertex* verts, long lon
 	glBindTexture(GL_TEXTURE_2D, ptr->texture);
 	glUseProgram(ptr->program);
 
+	{
+		affe_effect none;
+		memset(&none, 0, sizeof(affe_effect));
+
+		const affe_effect* effect = affe_buffer_effect(ctx);
+		if (!effect) effect = &none;
+
+		glUniform1f(ptr->u_padding, ptr->padding);
+		glUniform1f(ptr->u_outline, effect->outline_width);
+		glUniform4f(ptr->u_outline_col, effect->outline_r, effect->outline_g, effect->outline_b, effect->outline_a);
+		glUniform3f(ptr->u_shadow, effect->shadow_x, effect->shadow_y, effect->shadow_softness);
+		glUniform4f(ptr->u_shadow_col, effect->shadow_r, effect->shadow_g, effect->shadow_b, effect->shadow_a);
+		glUniform1f(ptr->u_glow, effect->glow_width);
+		glUniform4f(ptr->u_glow_col, effect->glow_r, effect->glow_g, effect->glow_b, effect->glow_a);
+		glUniform1i(ptr->u_coverage, AFFE_KEY_SHADER(affe_buffer_key(ctx)) == AFFE_SHADER_COVERAGE);
+	}
+
 	glDisable(GL_DEPTH_TEST);
 	glDepthMask(GL_FALSE);
 	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glBlendFunc(GL_SRC_ALPHA, AFFE_KEY_BLEND(affe_buffer_key(ctx)) == AFFE_BLEND_ADDITIVE ? GL_ONE : GL_ONE_MINUS_SRC_ALPHA);
 
 	glDrawArrays(GL_TRIANGLES, 0, verts_count);
 
@@ -238,16 +326,22 @@ static void draw(affe_context* ctx, void* user_ptr, affe_vertex* verts, long lon
 	glBlendFunc(prev_blend_src, prev_blend_dst);
 }
 
-static void destroy(affe_context* ctx, void* user_ptr)
+static void destroy(affe_context* ctx, void*)
 {
 	affe__ogl* ptr = ((affe__ogl*)affe_user_ptr(ctx));
 	glDeleteVertexArrays(1, &ptr->vao);
 	glDeleteBuffers(1, &ptr->vbo);
 	glDeleteProgram(ptr->program);
 	glDeleteTextures(1, &ptr->texture);
+
+#ifdef AFFE_OGL3_BC4
+	free(ptr->blocks);
+	ptr->blocks = NULL;
+	ptr->blocks_size = 0;
+#endif
 }
 
-static void error_proc(affe_context* ctx, void* error_ptr, int error)
+static void error_proc(affe_context* ctx, void*, int error)
 {
 	if (error == AFFE_ERROR_ATLAS_FULL) affe_cache_invalidate(ctx);
 }
@@ -258,6 +352,7 @@ affe_context* affe_ogl3_context_create(int width, int height, int quads, int pad
 	impl = (affe__ogl*)malloc(sizeof(affe__ogl));
 	if (!impl) return NULL;
 	memset(impl, 0, sizeof(affe__ogl));
+	impl->padding = (float)padding;
 
 	affe_context_create_info info;
 	memset(&info, 0, sizeof(affe_context_create_info));
@@ -270,6 +365,10 @@ affe_context* affe_ogl3_context_create(int width, int height, int quads, int pad
 	info.draw_proc = &draw;
 	info.delete_proc = &destroy;
 	info.error_proc = &error_proc;
+
+#ifdef AFFE_OGL3_BC4
+	info.flags = AFFE_FLAGS_ATLAS_BC4;
+#endif
 	
 	info.buffer_quad_count = quads;
 	info.edge_value = 0.8f;
@@ -286,4 +385,11 @@ void affe_ogl3_context_delete(affe_context* ctx)
 	free(user_ptr);
 }
 
+unsigned int affe_ogl3_texture(affe_context* ctx)
+{
+	affe__ogl* ptr = (affe__ogl*)affe_user_ptr(ctx);
+	if (!ptr) return 0;
+	return ptr->texture;
+}
+
 #endif // AFFE_OGL3_IMPLEMENTATION
\ No newline at end of file
@@ -0,0 +1,611 @@
+/* af_fontengine_impl_soft.h Last Updated: v0.1.9
+
+Authored from 2023 by AnthoFoxo
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+
+Credits to Sean Barrett, Mikko Mononen, Bjoern Hoehrmann, and the community for making this project possible.
+
+Visit the github page for updates and documentation: https://github.com/anthofoxo/fontengine
+
+Contributor list
+AnthoFoxo
+*/
+#ifndef AF_FONTENGINE_SOFT_H
+#define AF_FONTENGINE_SOFT_H
+
+// Software backend, text is rasterized on the cpu into an rgba8 image
+// The atlas is kept in memory, no gpu or graphics api is needed
+// Effects are composited per pixel like the OpenGL shader, text with an effect draws slower
+// #define AFFE_SOFT_IMPLEMENTATION
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+AFFE_API affe_context* affe_soft_context_create(int width, int height, int quads, int padding, int size);
+AFFE_API void affe_soft_context_delete(affe_context* ctx);
+
+// Set the image text is drawn into, 4 bytes per pixel in rgba order with row 0 at the top
+// stride is the number of bytes between rows. The viewport is scaled to the image size.
+// The image must stay valid until the buffer is flushed
+AFFE_API void affe_soft_target(affe_context* ctx, unsigned char* pixels, int width, int height, int stride);
+
+// Rasterize bands of the image on multiple threads, 1 by default
+// Threads are created once and reused, only draws with many quads are split
+AFFE_API void affe_soft_threads(affe_context* ctx, int threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // AF_FONTENGINE_SOFT_H
+
+#ifdef AFFE_SOFT_IMPLEMENTATION
+
+#include <new>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#ifndef AFFE_SOFT_MAX_THREADS
+#	define AFFE_SOFT_MAX_THREADS 16
+#endif
+
+// Draws with fewer quads are rasterized on the calling thread
+#ifndef AFFE_SOFT_THREAD_MIN_QUADS
+#	define AFFE_SOFT_THREAD_MIN_QUADS 64
+#endif
+
+// Longest span sampled at once, longer spans are split
+#define AFFE__SOFT_SPAN 256
+
+struct affe__soft;
+
+struct affe__soft__pool
+{
+	std::thread threads[AFFE_SOFT_MAX_THREADS];
+	int threads_count;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+
+	unsigned long long job;
+	int pending;
+	bool quit;
+
+	// Current job
+	const affe_vertex* verts;
+	long long verts_count;
+	bool additive;
+	bool coverage;
+	const affe_effect* effect;
+};
+
+struct affe__soft
+{
+	unsigned char* atlas;
+	int atlas_width, atlas_height;
+	int padding;
+
+	unsigned char* target;
+	int target_width, target_height, target_stride;
+
+	affe__soft__pool* pool;
+	int threads;
+
+	affe_context* ctx;
+};
+
+// Convert sdf distances to alpha and blend one color into a row of rgba8 pixels
+// With `coverage` the samples are already alpha and only clamped
+static void affe__soft__span(unsigned char* dst, const float* dist, int count, float lo, float inv_range, const unsigned char* color, bool additive, bool coverage)
+{
+	int i = 0;
+	float alpha_scale = (float)color[3];
+
+#ifdef AFFE__SSE2
+	const __m128 v_lo = _mm_set1_ps(lo);
+	const __m128 v_inv = _mm_set1_ps(inv_range);
+	const __m128 v_zero = _mm_setzero_ps();
+	const __m128 v_one = _mm_set1_ps(1.0f);
+	const __m128 v_two = _mm_set1_ps(2.0f);
+	const __m128 v_three = _mm_set1_ps(3.0f);
+	const __m128 v_alpha = _mm_set1_ps(alpha_scale);
+	const __m128 v_half = _mm_set1_ps(0.5f);
+
+	// Alpha lane is 255 so the destination alpha becomes a + dst * (1 - a)
+	const __m128i v_src = _mm_setr_epi16(color[0], color[1], color[2], 255, color[0], color[1], color[2], 255);
+	const __m128i v_255 = _mm_set1_epi16(255);
+	const __m128i v_128 = _mm_set1_epi16(128);
+	const __m128i v_izero = _mm_setzero_si128();
+
+	for (; i + 4 <= count; i += 4)
+	{
+		// smoothstep
+		__m128 t = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(dist + i), v_lo), v_inv);
+		t = _mm_min_ps(_mm_max_ps(t, v_zero), v_one);
+		if (!coverage) t = _mm_mul_ps(_mm_mul_ps(t, t), _mm_sub_ps(v_three, _mm_mul_ps(v_two, t)));
+
+		// Rounds half up by truncating like the scalar tail, `_mm_cvtps_epi32` would round half to even
+		__m128i a32 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(t, v_alpha), v_half));
+
+		// Most of a glyph quad is outside of the glyph
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(a32, v_izero)) == 0xFFFF) continue;
+
+		// Spread each pixel's alpha to its 4 channels
+		__m128i a16 = _mm_packs_epi32(a32, a32);
+		a16 = _mm_unpacklo_epi16(a16, a16);
+		__m128i a_lo = _mm_unpacklo_epi32(a16, a16);
+		__m128i a_hi = _mm_unpackhi_epi32(a16, a16);
+
+		__m128i pixels = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+		__m128i d_lo = _mm_unpacklo_epi8(pixels, v_izero);
+		__m128i d_hi = _mm_unpackhi_epi8(pixels, v_izero);
+
+		if (additive)
+		{
+			// dst + src * a / 255, saturated
+			__m128i s_lo = _mm_add_epi16(_mm_mullo_epi16(v_src, a_lo), v_128);
+			__m128i s_hi = _mm_add_epi16(_mm_mullo_epi16(v_src, a_hi), v_128);
+			s_lo = _mm_srli_epi16(_mm_add_epi16(s_lo, _mm_srli_epi16(s_lo, 8)), 8);
+			s_hi = _mm_srli_epi16(_mm_add_epi16(s_hi, _mm_srli_epi16(s_hi, 8)), 8);
+			pixels = _mm_adds_epu8(pixels, _mm_packus_epi16(s_lo, s_hi));
+		}
+		else
+		{
+			// (src * a + dst * (255 - a)) / 255
+			__m128i r_lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(v_src, a_lo), _mm_mullo_epi16(d_lo, _mm_sub_epi16(v_255, a_lo))), v_128);
+			__m128i r_hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(v_src, a_hi), _mm_mullo_epi16(d_hi, _mm_sub_epi16(v_255, a_hi))), v_128);
+			r_lo = _mm_srli_epi16(_mm_add_epi16(r_lo, _mm_srli_epi16(r_lo, 8)), 8);
+			r_hi = _mm_srli_epi16(_mm_add_epi16(r_hi, _mm_srli_epi16(r_hi, 8)), 8);
+			pixels = _mm_packus_epi16(r_lo, r_hi);
+		}
+
+		_mm_storeu_si128((__m128i*)(dst + i * 4), pixels);
+	}
+#endif
+
+	for (; i < count; ++i)
+	{
+		float t = (dist[i] - lo) * inv_range;
+		t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+		if (!coverage) t = t * t * (3.0f - 2.0f * t);
+
+		unsigned int a = (unsigned int)(t * alpha_scale + 0.5f);
+		if (a == 0) continue;
+
+		unsigned char* p = dst + i * 4;
+
+		for (int c = 0; c < 4; ++c)
+		{
+			unsigned int src = c == 3 ? 255 : color[c];
+
+			// Alpha and the division by 255 round the same as the simd path, so both give identical pixels
+			unsigned int value = additive ? src * a + 128 : src * a + p[c] * (255 - a) + 128;
+			value = (value + (value >> 8)) >> 8;
+			if (additive) value += p[c];
+
+			p[c] = (unsigned char)(value > 255 ? 255 : value);
+		}
+	}
+}
+
+static float affe__soft__smoothstep(float lo, float hi, float x)
+{
+	float t = (x - lo) / (hi - lo);
+	t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+	return t * t * (3.0f - 2.0f * t);
+}
+
+// Blend a premultiplied layer under `top`: top + bottom * (1 - top alpha)
+static void affe__soft__layer(float* col, float r, float g, float b, float a)
+{
+	float keep = 1.0f - a;
+	col[0] = r * a + col[0] * keep;
+	col[1] = g * a + col[1] * keep;
+	col[2] = b * a + col[2] * keep;
+	col[3] = a + col[3] * keep;
+}
+
+// Bilinear distance at atlas texel coordinates, texel centers are at whole coordinates
+static float affe__soft__sample(const affe__soft* soft, float u, float v)
+{
+	int max_x = soft->atlas_width - 1;
+	int max_y = soft->atlas_height - 1;
+
+	int tx = (int)(u + 1.0f) - 1;
+	int ty = (int)(v + 1.0f) - 1;
+	float fx = u - (float)tx;
+	float fy = v - (float)ty;
+
+	int tx0 = tx < 0 ? 0 : (tx > max_x ? max_x : tx);
+	int tx1 = tx + 1 < 0 ? 0 : (tx + 1 > max_x ? max_x : tx + 1);
+	int ty0 = ty < 0 ? 0 : (ty > max_y ? max_y : ty);
+	int ty1 = ty + 1 < 0 ? 0 : (ty + 1 > max_y ? max_y : ty + 1);
+
+	const unsigned char* row0 = soft->atlas + (long long)ty0 * soft->atlas_width;
+	const unsigned char* row1 = soft->atlas + (long long)ty1 * soft->atlas_width;
+
+	float top = (float)row0[tx0] + ((float)row0[tx1] - (float)row0[tx0]) * fx;
+	float bottom = (float)row1[tx0] + ((float)row1[tx1] - (float)row1[tx0]) * fx;
+	return (top + (bottom - top) * fy) * (1.0f / 255.0f);
+}
+
+// Composite effect layers back to front like the OpenGL shader: shadow, glow, outline, then the text
+// `shadow` holds the distances under the shadow offset, `w` is the edge width in distance units
+static void affe__soft__effect_span(unsigned char* dst, const float* dist, const float* shadow, int count, float edge, float w, float padding, const affe_effect* effect, const float* color, bool additive)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		float col[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+		if (effect->shadow_a > 0.0f)
+		{
+			float spread = effect->shadow_softness / padding + w;
+			affe__soft__layer(col, effect->shadow_r, effect->shadow_g, effect->shadow_b, effect->shadow_a * affe__soft__smoothstep(edge - spread, edge + spread, shadow[i]));
+		}
+
+		if (effect->glow_width > 0.0f)
+			affe__soft__layer(col, effect->glow_r, effect->glow_g, effect->glow_b, effect->glow_a * affe__soft__smoothstep(edge - effect->glow_width / padding, edge, dist[i]));
+
+		if (effect->outline_width > 0.0f)
+		{
+			float outline = edge - effect->outline_width / padding;
+			affe__soft__layer(col, effect->outline_r, effect->outline_g, effect->outline_b, effect->outline_a * affe__soft__smoothstep(outline - w, outline + w, dist[i]));
+		}
+
+		affe__soft__layer(col, color[0], color[1], color[2], color[3] * affe__soft__smoothstep(edge - w, edge + w, dist[i]));
+		if (col[3] <= 0.0f) continue;
+
+		// The color is premultiplied, alpha blending is src + dst * (1 - a)
+		unsigned char* p = dst + i * 4;
+		float keep = additive ? 1.0f : 1.0f - col[3];
+
+		for (int c = 0; c < 4; ++c)
+		{
+			float value = col[c] * 255.0f + (float)p[c] * keep + 0.5f;
+			p[c] = (unsigned char)(value > 255.0f ? 255.0f : value);
+		}
+	}
+}
+
+// Rasterize the quads overlapping rows [row_begin, row_end) of the target
+// Draws with an effect take a slower path compositing every layer per pixel
+static void affe__soft__rasterize(affe__soft* soft, const affe_vertex* verts, long long verts_count, bool additive, bool coverage, const affe_effect* effect, int row_begin, int row_end)
+{
+	affe_context* ctx = soft->ctx;
+	if (ctx->canvas_width <= 0 || ctx->canvas_height <= 0) return;
+
+	float scale_x = (float)soft->target_width / (float)ctx->canvas_width;
+	float scale_y = (float)soft->target_height / (float)ctx->canvas_height;
+
+	float dist[AFFE__SOFT_SPAN];
+	float shadow[AFFE__SOFT_SPAN];
+
+	// Coverage bitmaps are never drawn with an effect, the layers need distances
+	if (coverage) effect = NULL;
+
+	// Quads are written as 2 triangles, vertex 1 is the bottom left corner and vertex 2 the top right
+	for (long long q = 0; q + 6 <= verts_count; q += 6)
+	{
+		const affe_vertex* bl = &verts[q + 1];
+		const affe_vertex* tr = &verts[q + 2];
+
+		// Target space, y down
+		float px0 = bl->x * scale_x;
+		float px1 = tr->x * scale_x;
+		float py0 = ((float)ctx->canvas_height - tr->y) * scale_y;
+		float py1 = ((float)ctx->canvas_height - bl->y) * scale_y;
+		if (px1 <= px0 || py1 <= py0) continue;
+
+		// Atlas space, in texels
+		float u0 = bl->s * (float)soft->atlas_width;
+		float u1 = tr->s * (float)soft->atlas_width;
+		float v0 = tr->t * (float)soft->atlas_height;
+		float v1 = bl->t * (float)soft->atlas_height;
+
+		float du = (u1 - u0) / (px1 - px0);
+		float dv = (v1 - v0) / (py1 - py0);
+
+		// Pixel centers inside the quad
+		int ix0 = (int)(px0 + 0.5f); if ((float)ix0 + 0.5f < px0) ++ix0;
+		int ix1 = (int)(px1 + 0.5f); if ((float)ix1 + 0.5f < px1) ++ix1;
+		int iy0 = (int)(py0 + 0.5f); if ((float)iy0 + 0.5f < py0) ++iy0;
+		int iy1 = (int)(py1 + 0.5f); if ((float)iy1 + 0.5f < py1) ++iy1;
+
+		if (ix0 < 0) ix0 = 0;
+		if (iy0 < row_begin) iy0 = row_begin;
+		if (ix1 > soft->target_width) ix1 = soft->target_width;
+		if (iy1 > row_end) iy1 = row_end;
+		if (ix0 >= ix1 || iy0 >= iy1) continue;
+
+		// Width of the edge, approximates fwidth of the distance as texels per pixel over the sdf padding
+		float texels = du > dv ? du : dv;
+		float w = texels / (float)soft->padding;
+		if (w < 0.0001f) w = 0.0001f;
+
+		const float edge = ctx->info.edge_value;
+		float lo = coverage ? 0.0f : edge - w;
+		float inv_range = coverage ? 1.0f : 1.0f / (2.0f * w);
+
+		unsigned char color[4];
+		color[0] = (unsigned char)(bl->r * 255.0f + 0.5f);
+		color[1] = (unsigned char)(bl->g * 255.0f + 0.5f);
+		color[2] = (unsigned char)(bl->b * 255.0f + 0.5f);
+		color[3] = (unsigned char)(bl->a * 255.0f + 0.5f);
+		if (color[3] == 0 && !effect) continue;
+
+		const float color_float[4] = { bl->r, bl->g, bl->b, bl->a };
+
+		int max_x = soft->atlas_width - 1;
+		int max_y = soft->atlas_height - 1;
+
+		for (int iy = iy0; iy < iy1; ++iy)
+		{
+			// Bilinear filtering, texel centers are at half coordinates
+			float v = v0 + ((float)iy + 0.5f - py0) * dv - 0.5f;
+			int ty = (int)(v + 1.0f) - 1;
+			float fy = v - (float)ty;
+			int ty0 = ty < 0 ? 0 : (ty > max_y ? max_y : ty);
+			int ty1 = ty + 1 < 0 ? 0 : (ty + 1 > max_y ? max_y : ty + 1);
+
+			const unsigned char* row0 = soft->atlas + (long long)ty0 * soft->atlas_width;
+			const unsigned char* row1 = soft->atlas + (long long)ty1 * soft->atlas_width;
+			unsigned char* dst_row = soft->target + (long long)iy * soft->target_stride;
+
+			for (int span = ix0; span < ix1; span += AFFE__SOFT_SPAN)
+			{
+				int count = ix1 - span < AFFE__SOFT_SPAN ? ix1 - span : AFFE__SOFT_SPAN;
+				float u = u0 + ((float)span + 0.5f - px0) * du - 0.5f;
+
+				for (int i = 0; i < count; ++i, u += du)
+				{
+					int tx = (int)(u + 1.0f) - 1;
+					float fx = u - (float)tx;
+					int tx0 = tx < 0 ? 0 : (tx > max_x ? max_x : tx);
+					int tx1 = tx + 1 < 0 ? 0 : (tx + 1 > max_x ? max_x : tx + 1);
+
+					float top = (float)row0[tx0] + ((float)row0[tx1] - (float)row0[tx0]) * fx;
+					float bottom = (float)row1[tx0] + ((float)row1[tx1] - (float)row1[tx0]) * fx;
+					dist[i] = (top + (bottom - top) * fy) * (1.0f / 255.0f);
+				}
+
+				if (effect)
+				{
+					// Shadow lengths are atlas texels, the offset is y up
+					if (effect->shadow_a > 0.0f)
+					{
+						float su = u0 + ((float)span + 0.5f - px0) * du - 0.5f - effect->shadow_x;
+						float sv = v + effect->shadow_y;
+
+						for (int i = 0; i < count; ++i, su += du)
+							shadow[i] = affe__soft__sample(soft, su, sv);
+					}
+
+					affe__soft__effect_span(dst_row + (long long)span * 4, dist, shadow, count, edge, w, (float)soft->padding, effect, color_float, additive);
+				}
+				else
+					affe__soft__span(dst_row + (long long)span * 4, dist, count, lo, inv_range, color, additive, coverage);
+			}
+		}
+	}
+}
+
+static void affe__soft__band(affe__soft* soft, int band, int bands)
+{
+	affe__soft__pool* pool = soft->pool;
+	int row_begin = (int)((long long)soft->target_height * band / bands);
+	int row_end = (int)((long long)soft->target_height * (band + 1) / bands);
+	affe__soft__rasterize(soft, pool->verts, pool->verts_count, pool->additive, pool->coverage, pool->effect, row_begin, row_end);
+}
+
+static void affe__soft__worker(affe__soft* soft, int band)
+{
+	affe__soft__pool* pool = soft->pool;
+	unsigned long long seen = 0;
+
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(pool->mutex);
+			pool->wake.wait(lock, [&] { return pool->quit || pool->job != seen; });
+			if (pool->quit) return;
+			seen = pool->job;
+		}
+
+		affe__soft__band(soft, band, pool->threads_count + 1);
+
+		{
+			std::lock_guard<std::mutex> lock(pool->mutex);
+			if (--pool->pending == 0) pool->done.notify_one();
+		}
+	}
+}
+
+static void affe__soft__pool_stop(affe__soft* soft)
+{
+	affe__soft__pool* pool = soft->pool;
+	if (!pool) return;
+
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->quit = true;
+	}
+	pool->wake.notify_all();
+
+	for (int i = 0; i < pool->threads_count; ++i)
+		pool->threads[i].join();
+
+	delete pool;
+	soft->pool = NULL;
+}
+
+static void affe__soft__pool_start(affe__soft* soft, int threads)
+{
+	affe__soft__pool* pool = new (std::nothrow) affe__soft__pool();
+	if (!pool) return;
+
+	soft->pool = pool;
+
+	// The calling thread rasterizes the first band
+	for (int i = 0; i < threads - 1; ++i)
+	{
+		pool->threads[i] = std::thread(affe__soft__worker, soft, i + 1);
+		++pool->threads_count;
+	}
+}
+
+static int affe__soft__create(affe_context* ctx, void* user_ptr, int w, int h)
+{
+	affe__soft* soft = (affe__soft*)user_ptr;
+
+	soft->atlas = (unsigned char*)malloc((size_t)w * h);
+	if (!soft->atlas) return FALSE;
+	memset(soft->atlas, 0, (size_t)w * h);
+
+	soft->atlas_width = w;
+	soft->atlas_height = h;
+	soft->ctx = ctx;
+
+	return TRUE;
+}
+
+static void affe__soft__update(affe_context*, void* user_ptr, int x, int y, int w, int h, void* pixels)
+{
+	affe__soft* soft = (affe__soft*)user_ptr;
+
+	for (int row = 0; row < h; ++row)
+		memcpy(soft->atlas + (long long)(y + row) * soft->atlas_width + x, (const unsigned char*)pixels + (long long)row * w, (size_t)w);
+}
+
+static void affe__soft__draw(affe_context* ctx, void* user_ptr, affe_vertex* verts, long long verts_count)
+{
+	affe__soft* soft = (affe__soft*)user_ptr;
+	if (!soft->target) return;
+
+	bool additive = AFFE_KEY_BLEND(affe_buffer_key(ctx)) == AFFE_BLEND_ADDITIVE;
+	bool coverage = AFFE_KEY_SHADER(affe_buffer_key(ctx)) == AFFE_SHADER_COVERAGE;
+	const affe_effect* effect = affe_buffer_effect(ctx);
+	affe__soft__pool* pool = soft->pool;
+
+	if (!pool || pool->threads_count == 0 || verts_count < AFFE_SOFT_THREAD_MIN_QUADS * 6)
+	{
+		affe__soft__rasterize(soft, verts, verts_count, additive, coverage, effect, 0, soft->target_height);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->verts = verts;
+		pool->verts_count = verts_count;
+		pool->additive = additive;
+		pool->coverage = coverage;
+		pool->effect = effect;
+		pool->pending = pool->threads_count;
+		++pool->job;
+	}
+	pool->wake.notify_all();
+
+	affe__soft__band(soft, 0, pool->threads_count + 1);
+
+	std::unique_lock<std::mutex> lock(pool->mutex);
+	pool->done.wait(lock, [&] { return pool->pending == 0; });
+}
+
+static void affe__soft__delete(affe_context*, void* user_ptr)
+{
+	affe__soft* soft = (affe__soft*)user_ptr;
+	affe__soft__pool_stop(soft);
+	free(soft->atlas);
+	soft->atlas = NULL;
+}
+
+static void affe__soft__error(affe_context* ctx, void*, int error)
+{
+	if (error == AFFE_ERROR_ATLAS_FULL) affe_cache_invalidate(ctx);
+}
+
+affe_context* affe_soft_context_create(int width, int height, int quads, int padding, int size)
+{
+	affe__soft* impl;
+	impl = (affe__soft*)malloc(sizeof(affe__soft));
+	if (!impl) return NULL;
+	memset(impl, 0, sizeof(affe__soft));
+
+	impl->padding = padding;
+	impl->threads = 1;
+
+	affe_context_create_info info;
+	memset(&info, 0, sizeof(affe_context_create_info));
+
+	info.width = width;
+	info.height = height;
+	info.user_ptr = impl;
+	info.create_proc = &affe__soft__create;
+	info.update_proc = &affe__soft__update;
+	info.draw_proc = &affe__soft__draw;
+	info.delete_proc = &affe__soft__delete;
+	info.error_proc = &affe__soft__error;
+
+	info.buffer_quad_count = quads;
+	info.edge_value = 0.8f;
+	info.padding = padding;
+	info.size = (float)size;
+
+	affe_context* ctx = affe_context_create(&info);
+	if (!ctx) free(impl);
+	return ctx;
+}
+
+void affe_soft_context_delete(affe_context* ctx)
+{
+	void* user_ptr = affe_user_ptr(ctx);
+	affe_context_delete(ctx);
+	free(user_ptr);
+}
+
+void affe_soft_target(affe_context* ctx, unsigned char* pixels, int width, int height, int stride)
+{
+	affe__soft* soft = (affe__soft*)affe_user_ptr(ctx);
+	if (!soft) return;
+
+	// Vertices already in the buffer belong to the previous target
+	affe_buffer_flush(ctx);
+
+	soft->target = pixels;
+	soft->target_width = width;
+	soft->target_height = height;
+	soft->target_stride = stride;
+}
+
+void affe_soft_threads(affe_context* ctx, int threads)
+{
+	affe__soft* soft = (affe__soft*)affe_user_ptr(ctx);
+	if (!soft) return;
+
+	if (threads < 1) threads = 1;
+	if (threads > AFFE_SOFT_MAX_THREADS) threads = AFFE_SOFT_MAX_THREADS;
+	if (threads == soft->threads) return;
+
+	affe_buffer_flush(ctx);
+	affe__soft__pool_stop(soft);
+
+	soft->threads = threads;
+	if (threads > 1) affe__soft__pool_start(soft, threads);
+}
+
+#endif // AFFE_SOFT_IMPLEMENTATION
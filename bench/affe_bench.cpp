@@ -0,0 +1,831 @@
+// Headless benchmarks for af_fontengine
+//
+// Usage: affe_bench <font.ttf> [--cjk <font.ttf>] [--out <results.json>] [--quick]
+//
+// Text is drawn through the null backend, so only the engine is measured.
+// Results are written as json, to stdout when no output file is given.
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <math.h>
+
+// Headers the engine pulls in are included before the allocation macros below
+#ifdef _WIN32
+#	ifndef WIN32_LEAN_AND_MEAN
+#		define WIN32_LEAN_AND_MEAN
+#	endif
+#	include <windows.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#	include <arm_neon.h>
+#endif
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#define STB_RECT_PACK_IMPLEMENTATION
+#define STB_TRUETYPE_IMPLEMENTATION
+#include "stb_rect_pack.h"
+#include "stb_truetype.h"
+
+// Count engine allocations through `affe_context_create_info::allocator`, rasterizer scratch memory from stb is not included
+struct bench_memory
+{
+	long long current;
+	long long peak;
+	long long allocations;
+};
+
+static bench_memory g_memory;
+
+static void* bench_malloc(void*, size_t size)
+{
+	size_t* block = (size_t*)malloc(size + sizeof(size_t) * 2);
+	if (!block) return NULL;
+	block[0] = size;
+
+	g_memory.current += (long long)size;
+	if (g_memory.current > g_memory.peak) g_memory.peak = g_memory.current;
+	++g_memory.allocations;
+
+	return block + 2;
+}
+
+static void bench_free(void*, void* ptr)
+{
+	if (!ptr) return;
+	size_t* block = (size_t*)ptr - 2;
+	g_memory.current -= (long long)block[0];
+	free(block);
+}
+
+static void* bench_realloc(void* user_ptr, void* ptr, size_t size)
+{
+	if (!ptr) return bench_malloc(user_ptr, size);
+
+	size_t* block = (size_t*)ptr - 2;
+	size_t old_size = block[0];
+
+	size_t* new_block = (size_t*)realloc(block, size + sizeof(size_t) * 2);
+	if (!new_block) return NULL;
+	new_block[0] = size;
+
+	g_memory.current += (long long)size - (long long)old_size;
+	if (g_memory.current > g_memory.peak) g_memory.peak = g_memory.current;
+	++g_memory.allocations;
+
+	return new_block + 2;
+}
+
+#include "af_fontengine.hpp"
+
+#define AFFE_IMPLEMENTATION
+#define AFFE_NULL_IMPLEMENTATION
+#include "af_fontengine.h"
+#include "af_fontengine_impl_null.h"
+
+static affe_allocator g_allocator = { NULL, &bench_malloc, &bench_realloc, &bench_free };
+
+// Compact vertex for the templated context, 20 bytes instead of 32
+struct bench_vertex
+{
+	float x, y, s, t;
+	unsigned int rgba;
+};
+
+template <>
+struct affe::vertex_traits<bench_vertex>
+{
+	static void write(bench_vertex& vertex, float x, float y, float s, float t, const affe_text_quad& quad)
+	{
+		vertex.x = x;
+		vertex.y = y;
+		vertex.s = s;
+		vertex.t = t;
+		vertex.rgba = (unsigned int)(quad.r * 255.0f + 0.5f) | (unsigned int)(quad.g * 255.0f + 0.5f) << 8 | (unsigned int)(quad.b * 255.0f + 0.5f) << 16 | (unsigned int)(quad.a * 255.0f + 0.5f) << 24;
+	}
+};
+
+// Backend for `affe::basic_context` doing the same work as the null backend
+struct bench_backend
+{
+	affe_null_stats stats;
+
+	void update(affe_context*, int, int, int width, int height, void*)
+	{
+		++stats.update_calls;
+		stats.update_bytes += (long long)width * height;
+	}
+
+	template <class Vertex>
+	void draw(affe_context*, const Vertex* verts, long long verts_count)
+	{
+		++stats.draw_calls;
+		stats.draw_verts += verts_count;
+		stats.draw_bytes += verts_count * (long long)sizeof(Vertex);
+
+		unsigned long long checksum = stats.checksum;
+
+		for (long long i = 0; i < verts_count; ++i)
+		{
+			unsigned int words[4];
+			memcpy(&words[0], &verts[i].x, sizeof(float));
+			memcpy(&words[1], &verts[i].y, sizeof(float));
+			memcpy(&words[2], &verts[i].s, sizeof(float));
+			memcpy(&words[3], &verts[i].t, sizeof(float));
+
+			checksum = checksum * 31 + (words[0] ^ (words[1] << 1) ^ (words[2] << 2) ^ (words[3] << 3));
+		}
+
+		stats.checksum = checksum;
+	}
+
+	void error(affe_context* ctx, int error)
+	{
+		if (error == AFFE_ERROR_ATLAS_FULL)
+		{
+			++stats.atlas_full;
+			affe_cache_invalidate(ctx);
+		}
+	}
+};
+
+// Keeps every glyph upload, to run the atlas encoder on real glyphs
+struct bench_upload_backend : bench_backend
+{
+	struct upload
+	{
+		int width, height;
+		std::vector<unsigned char> pixels;
+	};
+
+	std::vector<upload> uploads;
+
+	void update(affe_context* ctx, int x, int y, int width, int height, void* pixels)
+	{
+		bench_backend::update(ctx, x, y, width, height, pixels);
+
+		const unsigned char* begin = (const unsigned char*)pixels;
+		uploads.push_back({ width, height, std::vector<unsigned char>(begin, begin + (size_t)width * height) });
+	}
+};
+
+struct bench_indexed_options : affe::default_options
+{
+	static constexpr int quad_vertices = 4;
+};
+
+struct bench_result
+{
+	std::string name;
+	long long iterations;
+	long long ops;
+	long long bytes;
+	double seconds;
+
+	// Engine memory in use at the end of the benchmark
+	long long memory;
+
+	affe_stats stats;
+	affe_null_stats backend;
+};
+
+struct bench_options
+{
+	const char* font_path;
+	const char* cjk_path;
+	const char* out_path;
+	double min_seconds;
+};
+
+// Error of the BC4 encoder on the glyphs of `bc4_encode`, in 8 bit steps
+struct bench_bc4_quality
+{
+	bool measured;
+	int max_error;
+	double mean_error;
+	double psnr;
+
+	// Mean error of texels near the distance field edge, where it moves the outline
+	double edge_error;
+};
+
+static std::vector<bench_result> g_results;
+static bench_options g_options;
+static bench_bc4_quality g_bc4;
+
+static double bench_now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool bench_read_file(const char* path, std::vector<unsigned char>& data)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file) return false;
+
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	data.resize(size > 0 ? (size_t)size : 0);
+	size_t read = data.empty() ? 0 : fread(data.data(), 1, data.size(), file);
+	fclose(file);
+
+	return read == data.size();
+}
+
+// Corpora are generated so results don't depend on files next to the executable
+
+static std::string bench_corpus_latin()
+{
+	static const char* words[] = { "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "engine", "glyph", "atlas", "render", "signed", "distance", "field", "Lorem", "ipsum", "dolor", "sit", "amet," };
+
+	std::string text;
+	unsigned int seed = 1;
+
+	for (int line = 0; line < 200; ++line)
+	{
+		int columns = 0;
+		while (columns < 72)
+		{
+			seed = seed * 1103515245 + 12345;
+			const char* word = words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+			text += word;
+			text += ' ';
+			columns += (int)strlen(word) + 1;
+		}
+		text += '\n';
+	}
+
+	return text;
+}
+
+static void bench_append_utf8(std::string& text, unsigned int cp)
+{
+	if (cp < 0x80) text += (char)cp;
+	else if (cp < 0x800)
+	{
+		text += (char)(0xC0 | (cp >> 6));
+		text += (char)(0x80 | (cp & 0x3F));
+	}
+	else
+	{
+		text += (char)(0xE0 | (cp >> 12));
+		text += (char)(0x80 | ((cp >> 6) & 0x3F));
+		text += (char)(0x80 | (cp & 0x3F));
+	}
+}
+
+// Picks from the start of the CJK unified ideographs block, enough distinct glyphs to overflow a small atlas
+static std::string bench_corpus_cjk(int distinct)
+{
+	std::string text;
+	unsigned int seed = 7;
+
+	for (int line = 0; line < 100; ++line)
+	{
+		for (int i = 0; i < 40; ++i)
+		{
+			seed = seed * 1103515245 + 12345;
+			bench_append_utf8(text, 0x4E00 + (seed >> 16) % (unsigned int)distinct);
+		}
+		text += '\n';
+	}
+
+	return text;
+}
+
+static std::string bench_corpus_log()
+{
+	static const char* levels[] = { "INFO", "WARN", "DEBUG", "ERROR" };
+	static const char* messages[] = { "connection accepted from 10.0.4.17:51234", "cache miss for key user:88123", "request completed in 12.7ms status=200", "retrying upstream after timeout (attempt 3/5)" };
+
+	std::string text;
+	char line[256];
+	unsigned int seed = 3;
+
+	for (int i = 0; i < 400; ++i)
+	{
+		seed = seed * 1103515245 + 12345;
+		snprintf(line, sizeof(line), "2024-03-%02d 12:%02d:%02d.%03d [%s] worker-%d: %s\n", 1 + i % 28, (i / 60) % 60, i % 60, (int)(seed >> 20) % 1000, levels[(seed >> 8) % 4], (int)(seed >> 12) % 16, messages[(seed >> 4) % 4]);
+		text += line;
+	}
+
+	return text;
+}
+
+static affe_context* bench_context(const std::vector<unsigned char>& font, const std::vector<unsigned char>& cjk, int atlas_size)
+{
+	affe_context* ctx = affe_null_context_create_allocator(atlas_size, atlas_size, 1024, 6, 48, &g_allocator);
+	if (!ctx) return NULL;
+
+	int font_handle = affe_font_add(ctx, (void*)font.data(), 0, false);
+
+	if (!cjk.empty())
+	{
+		int cjk_handle = affe_font_add(ctx, (void*)cjk.data(), 0, false);
+		affe_font_fallback(ctx, font_handle, cjk_handle);
+	}
+
+	affe_set_font(ctx, font_handle);
+	affe_set_size(ctx, 16);
+
+	// No viewport is set, nothing is culled and every glyph is emitted
+	return ctx;
+}
+
+// Runs `body` until `min_seconds` have passed, `body` returns the number of operations it did
+// `backend` receives the backend counters of `ctx`
+template<class Body>
+static void bench_run_backend(const char* name, affe_context* ctx, affe_null_stats* backend, long long bytes_per_iteration, Body body)
+{
+	// Warm up, also makes the first iteration of warm benchmarks hit the cache
+	body();
+
+	affe_stats_reset(ctx);
+	memset(backend, 0, sizeof(affe_null_stats));
+
+	bench_result result;
+	result.name = name;
+	result.iterations = 0;
+	result.ops = 0;
+	result.bytes = 0;
+
+	double begin = bench_now();
+	double elapsed = 0.0;
+
+	do
+	{
+		result.ops += body();
+		result.bytes += bytes_per_iteration;
+		++result.iterations;
+
+		affe_frame_end(ctx);
+		elapsed = bench_now() - begin;
+	} while (elapsed < g_options.min_seconds);
+
+	result.seconds = elapsed;
+	result.memory = g_memory.current;
+	affe_stats_get(ctx, NULL, &result.stats);
+	result.backend = *backend;
+
+	g_results.push_back(result);
+
+	fprintf(stderr, "%-28s %10.1f ns/op %12.0f ops/s\n", name, result.seconds * 1e9 / (double)(result.ops ? result.ops : 1), (double)result.ops / result.seconds);
+}
+
+// Benchmark a context of the null backend
+template<class Body>
+static void bench_run(const char* name, affe_context* ctx, long long bytes_per_iteration, Body body)
+{
+	bench_run_backend(name, ctx, (affe_null_stats*)affe_null_stats_get(ctx), bytes_per_iteration, body);
+}
+
+// Same settings as `bench_context` for the templated context
+template<class Context>
+static bool bench_context_template(Context& context, const std::vector<unsigned char>& font)
+{
+	if (!context) return false;
+
+	affe_set_font(context.get(), affe_font_add(context.get(), (void*)font.data(), 0, false));
+	affe_set_size(context.get(), 16);
+	return true;
+}
+
+static affe_context_create_info bench_template_info(int atlas_size)
+{
+	affe_context_create_info info;
+	memset(&info, 0, sizeof(affe_context_create_info));
+
+	info.width = atlas_size;
+	info.height = atlas_size;
+	info.buffer_quad_count = 1024;
+	info.edge_value = 0.8f;
+	info.padding = 6;
+	info.size = 48.0f;
+	info.allocator = g_allocator;
+	return info;
+}
+
+static long long bench_codepoints(const std::string& text)
+{
+	long long count = 0;
+	for (char c : text)
+		if (((unsigned char)c & 0xC0) != 0x80 && c != '\n') ++count;
+	return count;
+}
+
+static void bench_write_json(FILE* out)
+{
+	fprintf(out, "{\n");
+	fprintf(out, "\t\"version\": \"0.1.9\",\n");
+	fprintf(out, "\t\"memory\": { \"peak\": %lld, \"leaked\": %lld, \"allocations\": %lld },\n", g_memory.peak, g_memory.current, g_memory.allocations);
+
+	if (g_bc4.measured)
+		fprintf(out, "\t\"bc4\": { \"max_error\": %d, \"mean_error\": %.4f, \"psnr\": %.2f, \"edge_error\": %.4f },\n", g_bc4.max_error, g_bc4.mean_error, g_bc4.psnr, g_bc4.edge_error);
+	fprintf(out, "\t\"benchmarks\": [\n");
+
+	for (size_t i = 0; i < g_results.size(); ++i)
+	{
+		const bench_result& r = g_results[i];
+		double ops = (double)(r.ops ? r.ops : 1);
+
+		fprintf(out, "\t\t{ \"name\": \"%s\", \"iterations\": %lld, \"ops\": %lld, \"seconds\": %.6f, \"ns_per_op\": %.3f, \"ops_per_second\": %.1f, \"mb_per_second\": %.3f,\n", r.name.c_str(), r.iterations, r.ops, r.seconds, r.seconds * 1e9 / ops, (double)r.ops / r.seconds, (double)r.bytes / r.seconds / 1e6);
+		fprintf(out, "\t\t  \"glyph_hits\": %lld, \"glyph_misses\": %lld, \"rasterize_ns\": %lld, \"invalidations\": %lld, \"atlas_used\": %lld, \"atlas_size\": %lld,\n", r.stats.glyph_hits, r.stats.glyph_misses, r.stats.rasterize_time, r.stats.invalidations, r.stats.atlas_used, r.stats.atlas_size);
+		fprintf(out, "\t\t  \"draw_calls\": %lld, \"draw_verts\": %lld, \"update_calls\": %lld, \"update_bytes\": %lld, \"memory\": %lld, \"checksum\": %llu }%s\n", r.backend.draw_calls, r.backend.draw_verts, r.backend.update_calls, r.backend.update_bytes, r.memory, r.backend.checksum, i + 1 < g_results.size() ? "," : "");
+	}
+
+	fprintf(out, "\t]\n}\n");
+}
+
+int main(int argc, char** argv)
+{
+	g_options.min_seconds = 1.0;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--cjk") == 0 && i + 1 < argc) g_options.cjk_path = argv[++i];
+		else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) g_options.out_path = argv[++i];
+		else if (strcmp(argv[i], "--quick") == 0) g_options.min_seconds = 0.1;
+		else if (!g_options.font_path) g_options.font_path = argv[i];
+	}
+
+	if (!g_options.font_path)
+	{
+		fprintf(stderr, "usage: %s <font.ttf> [--cjk <font.ttf>] [--out <results.json>] [--quick]\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<unsigned char> font, cjk;
+
+	if (!bench_read_file(g_options.font_path, font))
+	{
+		fprintf(stderr, "failed to read %s\n", g_options.font_path);
+		return 1;
+	}
+
+	if (g_options.cjk_path && !bench_read_file(g_options.cjk_path, cjk))
+	{
+		fprintf(stderr, "failed to read %s\n", g_options.cjk_path);
+		return 1;
+	}
+
+	const std::string latin = bench_corpus_latin();
+	const std::string cjk_text = bench_corpus_cjk(2000);
+	const std::string log = bench_corpus_log();
+	const char* printable = " !\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_`abcdefghijklmnopqrstuvwxyz{|}~";
+
+	affe_context* ctx = bench_context(font, cjk, 2048);
+	if (!ctx)
+	{
+		fprintf(stderr, "failed to create context\n");
+		return 1;
+	}
+
+	// Every lookup rasterizes
+	bench_run("glyph_lookup_cold", ctx, 0, [&]() -> long long
+		{
+			affe_cache_invalidate(ctx);
+			affe_text_draw(ctx, 0, 1000, printable, NULL);
+			return (long long)strlen(printable);
+		});
+
+	// Small ui text rasterized cold, from the distance field and as coverage bitmaps
+	affe_state_push(ctx);
+	affe_set_size(ctx, 12);
+
+	bench_run("glyph_lookup_cold_small", ctx, 0, [&]() -> long long
+		{
+			affe_cache_invalidate(ctx);
+			affe_text_draw(ctx, 0, 1000, printable, NULL);
+			return (long long)strlen(printable);
+		});
+
+	affe_set_bitmap_below(ctx, 16);
+
+	bench_run("glyph_lookup_cold_small_bitmap", ctx, 0, [&]() -> long long
+		{
+			affe_cache_invalidate(ctx);
+			affe_text_draw(ctx, 0, 1000, printable, NULL);
+			return (long long)strlen(printable);
+		});
+
+	affe_state_pop(ctx);
+
+	// Every lookup hits the cache
+	bench_run("glyph_lookup_warm", ctx, 0, [&]() -> long long
+		{
+			for (int i = 0; i < 64; ++i)
+				affe_text_draw_inline(ctx, 0, 1000, printable, NULL);
+			affe_buffer_flush(ctx);
+			return 64 * (long long)strlen(printable);
+		});
+
+	struct { const char* name; const std::string* text; } corpora[] = {
+		{ "draw_latin", &latin },
+		{ "draw_cjk", &cjk_text },
+		{ "draw_log", &log },
+	};
+
+	for (auto& corpus : corpora)
+	{
+		long long glyphs = bench_codepoints(*corpus.text);
+		bench_run(corpus.name, ctx, (long long)corpus.text->size(), [&]() -> long long
+			{
+				affe_text_draw(ctx, 0, 1000, corpus.text->c_str(), corpus.text->c_str() + corpus.text->size());
+				return glyphs;
+			});
+	}
+
+	long long latin_glyphs = bench_codepoints(latin);
+
+	// The whole corpus as one line, vertex emission dominates the per line work
+	std::string long_line = latin;
+	for (char& c : long_line)
+		if (c == '\n') c = ' ';
+
+	bench_run("draw_long_line", ctx, (long long)long_line.size(), [&]() -> long long
+		{
+			affe_text_draw_inline(ctx, 0, 1000, long_line.c_str(), long_line.c_str() + long_line.size());
+			return latin_glyphs;
+		});
+
+	// Most of the text is outside of a 1080p viewport and culled
+	affe_viewport(ctx, 1920, 1080);
+	bench_run("draw_latin_culled", ctx, (long long)latin.size(), [&]() -> long long
+		{
+			affe_text_draw(ctx, 0, 1000, latin.c_str(), latin.c_str() + latin.size());
+			return latin_glyphs;
+		});
+	affe_viewport(ctx, 0, 0);
+
+	struct { const char* name; int alignment; } alignments[] = {
+		{ "align_left", AFFE_ALIGN_LEFT },
+		{ "align_center", AFFE_ALIGN_CENTER },
+		{ "align_right", AFFE_ALIGN_RIGHT },
+	};
+
+	for (auto& alignment : alignments)
+	{
+		affe_state_push(ctx);
+		affe_set_alignment(ctx, alignment.alignment);
+		bench_run(alignment.name, ctx, (long long)latin.size(), [&]() -> long long
+			{
+				affe_text_draw(ctx, 960, 1000, latin.c_str(), latin.c_str() + latin.size());
+				return latin_glyphs;
+			});
+		affe_state_pop(ctx);
+	}
+
+	// A hud redrawing changing numbers, formatted by the engine and through snprintf
+	affe_buffer_flush_control(ctx, AFFE_BUFFER_FLUSH_CONTROL_NONE);
+
+	bench_run("hud_numbers", ctx, 0, [&]() -> long long
+		{
+			static long long frame = 0;
+			++frame;
+
+			for (int i = 0; i < 64; ++i)
+				affe_text_draw_int(ctx, 10, 1000 - (float)i * 16, frame * 7919 + i, AFFE_NUMBER_TABULAR);
+			affe_buffer_flush(ctx);
+			return 64;
+		});
+
+	bench_run("hud_numbers_snprintf", ctx, 0, [&]() -> long long
+		{
+			static long long frame = 0;
+			++frame;
+
+			char text[32];
+			for (int i = 0; i < 64; ++i)
+			{
+				snprintf(text, sizeof(text), "%lld", frame * 7919 + i);
+				affe_text_draw_inline(ctx, 10, 1000 - (float)i * 16, text, NULL);
+			}
+			affe_buffer_flush(ctx);
+			return 64;
+		});
+
+	affe_buffer_flush_control(ctx, AFFE_BUFFER_FLUSH_CONTROL_AUTOMATIC);
+
+	// A table of small independent cells, drawn call by call and as one batch
+	{
+		std::vector<std::string> cells;
+		std::vector<affe_text_item> items;
+		long long cell_glyphs = 0;
+
+		for (int i = 0; i < 4096; ++i)
+		{
+			char text[64];
+			snprintf(text, sizeof(text), i % 4 == 0 ? "row %d" : "%d.%02d", i * 7919 % 100000, i % 100);
+			cells.push_back(text);
+			cell_glyphs += (long long)cells.back().size();
+		}
+
+		for (int i = 0; i < (int)cells.size(); ++i)
+		{
+			affe_text_item item = { (float)(i % 16) * 120.0f, 1000.0f - (float)(i / 16) * 4.0f, cells[i].c_str(), NULL, -1 };
+			items.push_back(item);
+		}
+
+		bench_run("table_calls", ctx, 0, [&]() -> long long
+			{
+				for (const affe_text_item& item : items)
+					affe_text_draw(ctx, item.x, item.y, item.string, item.end);
+				return cell_glyphs;
+			});
+
+		// Every frame repeats the last one, cells are copied from the draw cache
+		affe_draw_cache(ctx, true);
+		bench_run("table_calls_cached", ctx, 0, [&]() -> long long
+			{
+				for (const affe_text_item& item : items)
+					affe_text_draw(ctx, item.x, item.y, item.string, item.end);
+				return cell_glyphs;
+			});
+		affe_draw_cache(ctx, false);
+
+		bench_run("table_batch", ctx, 0, [&]() -> long long
+			{
+				affe_text_draw_batch(ctx, items.data(), (int)items.size(), NULL);
+				return cell_glyphs;
+			});
+
+		affe_batch_threads(ctx, 4);
+		bench_run("table_batch_threads", ctx, 0, [&]() -> long long
+			{
+				affe_text_draw_batch(ctx, items.data(), (int)items.size(), NULL);
+				return cell_glyphs;
+			});
+		affe_batch_threads(ctx, 1);
+	}
+
+	// The same text written with a runtime vertex format, compare with the templated context below
+	{
+		const affe_vertex_format format = { (int)sizeof(bench_vertex), (int)offsetof(bench_vertex, x), (int)offsetof(bench_vertex, s), (int)offsetof(bench_vertex, rgba), AFFE_COLOR_RGBA8, 4 };
+		std::vector<bench_vertex> verts((size_t)affe_text_emit_count(ctx, 0, 1000, latin.c_str(), latin.c_str() + latin.size()) * 4);
+
+		bench_run("emit_latin_format", ctx, (long long)latin.size(), [&]() -> long long
+			{
+				long long written = 0;
+				affe_text_emit(ctx, 0, 1000, latin.c_str(), latin.c_str() + latin.size(), &format, verts.data(), (long long)verts.size() / 4, &written);
+				return latin_glyphs;
+			});
+	}
+
+	affe_null_context_delete(ctx);
+
+	// Backend calls and vertex writes resolved at compile time, `affe_vertex` matches `draw_latin`
+	{
+		bench_backend backend = {};
+		affe::basic_context<bench_backend> context(backend, bench_template_info(2048));
+
+		if (bench_context_template(context, font))
+		{
+			bench_run_backend("draw_latin_template", context.get(), &backend.stats, (long long)latin.size(), [&]() -> long long
+				{
+					context.draw(0, 1000, latin.c_str(), latin.c_str() + latin.size());
+					return latin_glyphs;
+				});
+		}
+	}
+
+	// Compact vertices, 4 per quad
+	{
+		bench_backend backend = {};
+		affe::basic_context<bench_backend, bench_vertex, bench_indexed_options> context(backend, bench_template_info(2048));
+
+		if (bench_context_template(context, font))
+		{
+			bench_run_backend("draw_latin_template_indexed", context.get(), &backend.stats, (long long)latin.size(), [&]() -> long long
+				{
+					context.draw(0, 1000, latin.c_str(), latin.c_str() + latin.size());
+					return latin_glyphs;
+				});
+		}
+	}
+
+	// The BC4 encoder on the glyph uploads of a compressed atlas, distance fields and small coverage bitmaps
+	{
+		bench_upload_backend backend = {};
+		affe_context_create_info info = bench_template_info(2048);
+		info.flags = AFFE_FLAGS_ATLAS_BC4;
+		affe::basic_context<bench_upload_backend> context(backend, info);
+
+		if (bench_context_template(context, font))
+		{
+			context.draw(0, 1000, printable);
+			affe_set_bitmap_below(context.get(), 14.0f);
+			affe_set_size(context.get(), 9.0f);
+			context.draw(0, 900, printable);
+			affe_set_size(context.get(), 12.0f);
+			context.draw(0, 800, printable);
+			affe_buffer_flush(context.get());
+
+			long long pixels = 0, blocks_size = 0;
+			for (const bench_upload_backend::upload& upload : backend.uploads)
+			{
+				pixels += (long long)upload.width * upload.height;
+				blocks_size += AFFE_BC4_SIZE(upload.width, upload.height);
+			}
+
+			std::vector<unsigned char> blocks((size_t)blocks_size);
+			std::vector<unsigned char> decoded((size_t)pixels);
+
+			bench_run_backend("bc4_encode", context.get(), &backend.stats, pixels, [&]() -> long long
+				{
+					unsigned char* out = blocks.data();
+					for (const bench_upload_backend::upload& upload : backend.uploads)
+					{
+						affe_bc4_encode(upload.pixels.data(), upload.width, upload.height, upload.width, out);
+						out += AFFE_BC4_SIZE(upload.width, upload.height);
+					}
+					return pixels;
+				});
+
+			bench_run_backend("bc4_decode", context.get(), &backend.stats, pixels, [&]() -> long long
+				{
+					const unsigned char* in = blocks.data();
+					unsigned char* out = decoded.data();
+					for (const bench_upload_backend::upload& upload : backend.uploads)
+					{
+						affe_bc4_decode(in, upload.width, upload.height, out, upload.width);
+						in += AFFE_BC4_SIZE(upload.width, upload.height);
+						out += (size_t)upload.width * upload.height;
+					}
+					return pixels;
+				});
+
+			// Compare the decoded glyphs with the uploads
+			const int edge = (int)(info.edge_value * 255.0f);
+			long long error_sum = 0, edge_sum = 0, edge_count = 0;
+			double squared_sum = 0.0;
+			const unsigned char* decoded_pixel = decoded.data();
+
+			g_bc4.max_error = 0;
+
+			for (const bench_upload_backend::upload& upload : backend.uploads)
+			{
+				for (unsigned char pixel : upload.pixels)
+				{
+					const int error = abs((int)pixel - (int)*decoded_pixel++);
+					if (error > g_bc4.max_error) g_bc4.max_error = error;
+
+					error_sum += error;
+					squared_sum += (double)error * error;
+
+					if (abs((int)pixel - edge) < 32)
+					{
+						edge_sum += error;
+						++edge_count;
+					}
+				}
+			}
+
+			const double mse = squared_sum / (double)(pixels ? pixels : 1);
+			g_bc4.measured = true;
+			g_bc4.mean_error = (double)error_sum / (double)(pixels ? pixels : 1);
+			g_bc4.psnr = mse > 0.0 ? 10.0 * log10(255.0 * 255.0 / mse) : 99.0;
+			g_bc4.edge_error = (double)edge_sum / (double)(edge_count ? edge_count : 1);
+
+			fprintf(stderr, "%-28s %10d max %10.3f mean %8.2f dB psnr %8.3f edge\n", "bc4_quality", g_bc4.max_error, g_bc4.mean_error, g_bc4.psnr, g_bc4.edge_error);
+		}
+	}
+
+	// A small atlas with more distinct glyphs than fit, every frame invalidates the cache
+	affe_context* churn = bench_context(font, cjk, 256);
+	if (churn)
+	{
+		long long glyphs = bench_codepoints(cjk_text);
+		bench_run("atlas_full_churn", churn, (long long)cjk_text.size(), [&]() -> long long
+			{
+				affe_text_draw(churn, 0, 1000, cjk_text.c_str(), cjk_text.c_str() + cjk_text.size());
+				return glyphs;
+			});
+		affe_null_context_delete(churn);
+	}
+
+	FILE* out = stdout;
+	if (g_options.out_path)
+	{
+		out = fopen(g_options.out_path, "w");
+		if (!out)
+		{
+			fprintf(stderr, "failed to open %s\n", g_options.out_path);
+			return 1;
+		}
+	}
+
+	bench_write_json(out);
+	if (out != stdout) fclose(out);
+
+	return 0;
+}
@@ -0,0 +1,492 @@
+// Headless regression tests for af_fontengine
+//
+// Usage: affe_tests <font.ttf>
+//
+// Everything is drawn through the null backend, incremental and batched paths are compared
+// against laying out or drawing the same text from scratch, drawn vertices by the backend's checksum.
+// One glyph is checked vertex by vertex, so a wrong vertex store fails even when every path shares it.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include <string>
+#include <vector>
+
+#define STB_RECT_PACK_IMPLEMENTATION
+#define STB_TRUETYPE_IMPLEMENTATION
+#include "stb_rect_pack.h"
+#include "stb_truetype.h"
+
+#define AFFE_IMPLEMENTATION
+#define AFFE_NULL_IMPLEMENTATION
+#include "af_fontengine.h"
+#include "af_fontengine_impl_null.h"
+
+static int g_failures;
+
+#define TEST_CHECK(condition, ...) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			++g_failures; \
+			fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+			fprintf(stderr, __VA_ARGS__); \
+			fputc('\n', stderr); \
+		} \
+	} while (0)
+
+static bool test_read_file(const char* path, std::vector<unsigned char>& data)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file) return false;
+
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	data.resize(size > 0 ? (size_t)size : 0);
+	size_t read = data.empty() ? 0 : fread(data.data(), 1, data.size(), file);
+	fclose(file);
+
+	return read == data.size();
+}
+
+// Small lcg so runs are the same on every platform
+static unsigned int g_seed = 1;
+
+static int test_random(int range)
+{
+	g_seed = g_seed * 1103515245u + 12345u;
+	return (int)((g_seed >> 16) % (unsigned int)range);
+}
+
+static std::string test_text(int words)
+{
+	// Leading spaces, hard breaks, hyphens, cjk and words wider than a line
+	static const char* pieces[] = { "the", "quick", "brown", "fox", " ", "  ", "\n", " h", "x", "dash-word", "(paren)", "end.", "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e", "supercalifragilisticexpialidocious" };
+	const int pieces_count = (int)(sizeof(pieces) / sizeof(pieces[0]));
+
+	std::string text;
+
+	for (int i = 0; i < words; ++i)
+	{
+		text += pieces[test_random(pieces_count)];
+		if (test_random(3)) text += ' ';
+	}
+
+	return text;
+}
+
+static bool test_same_lines(affe_context* ctx, const affe_paragraph* a, const affe_paragraph* b)
+{
+	const int count = affe_paragraph_line_count(ctx, a);
+	if (count != affe_paragraph_line_count(ctx, b)) return false;
+
+	const affe_paragraph_line* la = affe_paragraph_lines(ctx, a);
+	const affe_paragraph_line* lb = affe_paragraph_lines(ctx, b);
+
+	for (int i = 0; i < count; ++i)
+	{
+		if (la[i].begin != lb[i].begin || la[i].end != lb[i].end || la[i].scan_end != lb[i].scan_end) return false;
+		if (la[i].x != lb[i].x || la[i].y != lb[i].y || la[i].width != lb[i].width) return false;
+	}
+
+	return true;
+}
+
+// Random edits laid out incrementally must match a full layout of the edited text
+static void test_paragraph_edit(affe_context* ctx, int font)
+{
+	affe_paragraph* edited = affe_paragraph_create(ctx);
+	affe_paragraph* full = affe_paragraph_create(ctx);
+	TEST_CHECK(edited && full, "affe_paragraph_create failed");
+	if (!edited || !full) goto done;
+
+	affe_set_font(ctx, font);
+	affe_set_size(ctx, 16.0f);
+
+	for (int round = 0; round < 200; ++round)
+	{
+		std::string text = test_text(test_random(60));
+
+		// Narrow widths put a glyph or two on each line
+		const float width = test_random(4) == 0 ? (float)(4 + test_random(12)) : (float)(20 + test_random(300));
+		static const int alignments[] = { AFFE_ALIGN_LEFT, AFFE_ALIGN_CENTER, AFFE_ALIGN_RIGHT };
+		affe_set_alignment(ctx, alignments[test_random(3)]);
+
+		TEST_CHECK(affe_paragraph_layout(ctx, edited, text.data(), text.data() + text.size(), width), "affe_paragraph_layout failed");
+
+		for (int step = 0; step < 20; ++step)
+		{
+			int offset = test_random((int)text.size() + 1);
+			int removed = test_random(4);
+			if (offset + removed > (int)text.size()) removed = (int)text.size() - offset;
+
+			// Keep the edit on codepoint boundaries
+			while (offset > 0 && ((unsigned char)text[offset] & 0xC0) == 0x80) --offset, ++removed;
+			while (offset + removed < (int)text.size() && ((unsigned char)text[offset + removed] & 0xC0) == 0x80) ++removed;
+
+			std::string inserted = test_random(2) ? test_text(1) : " ";
+			text.replace((size_t)offset, (size_t)removed, inserted);
+
+			TEST_CHECK(affe_paragraph_edit(ctx, edited, text.data(), text.data() + text.size(), offset, removed, (int)inserted.size()), "affe_paragraph_edit failed");
+			TEST_CHECK(affe_paragraph_layout(ctx, full, text.data(), text.data() + text.size(), width), "affe_paragraph_layout failed");
+
+			if (!test_same_lines(ctx, edited, full))
+			{
+				TEST_CHECK(false, "edit at %d (-%d +%d) differs from a full layout, width %g, text \"%s\"", offset, removed, (int)inserted.size(), width, text.c_str());
+				goto done;
+			}
+		}
+	}
+
+done:
+	affe_paragraph_delete(ctx, edited);
+	affe_paragraph_delete(ctx, full);
+}
+
+// Appending in small chunks, splitting crlf pairs too, must index the same lines as one append
+static void test_document_chunks(affe_context* ctx, int font)
+{
+	affe_document* whole = affe_document_create(ctx);
+	affe_document* chunked = affe_document_create(ctx);
+	TEST_CHECK(whole && chunked, "affe_document_create failed");
+	if (!whole || !chunked) goto done;
+
+	affe_set_font(ctx, font);
+	affe_set_size(ctx, 16.0f);
+	affe_set_alignment(ctx, AFFE_ALIGN_LEFT);
+
+	for (int round = 0; round < 50; ++round)
+	{
+		static const char* breaks[] = { "\n", "\r\n", "\r", "\r\r\n", "\n\n" };
+
+		std::string text;
+		const int lines = test_random(40);
+
+		for (int i = 0; i < lines; ++i)
+		{
+			text += test_text(test_random(8));
+			text += breaks[test_random(5)];
+		}
+
+		affe_document_clear(ctx, whole);
+		affe_document_clear(ctx, chunked);
+
+		TEST_CHECK(affe_document_append(ctx, whole, text.data(), text.data() + text.size()), "affe_document_append failed");
+
+		for (size_t offset = 0; offset < text.size();)
+		{
+			size_t chunk = (size_t)(1 + test_random(5));
+			if (chunk > text.size() - offset) chunk = text.size() - offset;
+
+			TEST_CHECK(affe_document_append(ctx, chunked, text.data() + offset, text.data() + offset + chunk), "affe_document_append failed");
+			offset += chunk;
+		}
+
+		const long long count = affe_document_line_count(ctx, whole);
+		TEST_CHECK(count == affe_document_line_count(ctx, chunked), "chunked appends index %lld lines instead of %lld", affe_document_line_count(ctx, chunked), count);
+		if (count != affe_document_line_count(ctx, chunked)) goto done;
+
+		for (long long i = 0; i < count; ++i)
+		{
+			const char* whole_end, * chunked_end;
+			const char* whole_line = affe_document_line(ctx, whole, i, &whole_end);
+			const char* chunked_line = affe_document_line(ctx, chunked, i, &chunked_end);
+
+			const bool same = whole_end - whole_line == chunked_end - chunked_line && memcmp(whole_line, chunked_line, (size_t)(whole_end - whole_line)) == 0;
+			TEST_CHECK(same, "line %lld differs after chunked appends", i);
+			if (!same) goto done;
+		}
+
+		affe_null_stats_reset(ctx);
+		affe_document_draw(ctx, whole, 0.0f, 700.0f, 0.0f, 0.0f, 1280.0f, 720.0f);
+		affe_buffer_flush(ctx);
+		const unsigned long long expected = affe_null_stats_get(ctx)->checksum;
+
+		affe_null_stats_reset(ctx);
+		affe_document_draw(ctx, chunked, 0.0f, 700.0f, 0.0f, 0.0f, 1280.0f, 720.0f);
+		affe_buffer_flush(ctx);
+		TEST_CHECK(affe_null_stats_get(ctx)->checksum == expected, "chunked document draws differently");
+	}
+
+done:
+	affe_document_delete(ctx, whole);
+	affe_document_delete(ctx, chunked);
+}
+
+// Checksum of the vertices drawn since the last call
+static unsigned long long test_checksum(affe_context* ctx)
+{
+	affe_buffer_flush(ctx);
+	const unsigned long long checksum = affe_null_stats_get(ctx)->checksum;
+	affe_null_stats_reset(ctx);
+	return checksum;
+}
+
+// Batches, recorders and the draw cache must send the same vertices as plain `affe_text_draw`
+static void test_draw_paths(affe_context* ctx, int font)
+{
+	enum { items_count = 300 };
+
+	std::vector<std::string> texts;
+	std::vector<affe_text_item> items;
+
+	affe_text_style styles[2];
+	styles[0] = { 24.0f, 1.0f, 0.5f, 0.25f, 1.0f, font };
+	styles[1] = { 12.0f, 0.0f, 1.0f, 0.0f, 0.5f, font };
+
+	for (int i = 0; i < items_count; ++i)
+		texts.push_back(test_text(1 + test_random(6)));
+
+	for (int i = 0; i < items_count; ++i)
+	{
+		affe_text_item item;
+		item.x = (float)test_random(1200);
+		item.y = (float)test_random(720);
+		item.string = texts[(size_t)i].c_str();
+		item.end = NULL;
+		item.style = test_random(3) - 1;
+		items.push_back(item);
+	}
+
+	affe_set_font(ctx, font);
+	affe_set_size(ctx, 16.0f);
+	affe_set_color(ctx, 1.0f, 1.0f, 1.0f, 1.0f);
+	affe_set_alignment(ctx, AFFE_ALIGN_LEFT);
+
+	// Styles are applied over the current state, as a batch does
+	auto draw_plain = [&]()
+	{
+		for (const affe_text_item& item : items)
+		{
+			if (item.style >= 0)
+			{
+				const affe_text_style& style = styles[item.style];
+				affe_set_size(ctx, style.size);
+				affe_set_color(ctx, style.r, style.g, style.b, style.a);
+			}
+
+			affe_text_draw(ctx, item.x, item.y, item.string, item.end);
+
+			affe_set_size(ctx, 16.0f);
+			affe_set_color(ctx, 1.0f, 1.0f, 1.0f, 1.0f);
+		}
+	};
+
+	// Rasterize every glyph first, texture coordinates depend on the order glyphs are packed in
+	draw_plain();
+	test_checksum(ctx);
+
+	draw_plain();
+	const unsigned long long expected = test_checksum(ctx);
+
+	affe_text_draw_batch(ctx, items.data(), items_count, styles);
+	TEST_CHECK(test_checksum(ctx) == expected, "affe_text_draw_batch differs from affe_text_draw");
+
+	affe_batch_threads(ctx, 4);
+	affe_text_draw_batch(ctx, items.data(), items_count, styles);
+	TEST_CHECK(test_checksum(ctx) == expected, "affe_text_draw_batch on 4 threads differs from affe_text_draw");
+	affe_batch_threads(ctx, 1);
+
+	affe_recorder* recorder = affe_recorder_create(ctx);
+	TEST_CHECK(recorder != NULL, "affe_recorder_create failed");
+
+	if (recorder)
+	{
+		affe_recorder_reset(ctx, recorder);
+
+		for (const affe_text_item& item : items)
+		{
+			if (item.style >= 0)
+			{
+				const affe_text_style& style = styles[item.style];
+				affe_recorder_set_size(ctx, recorder, style.size);
+				affe_recorder_set_color(ctx, recorder, style.r, style.g, style.b, style.a);
+			}
+
+			TEST_CHECK(affe_recorder_text_draw(ctx, recorder, item.x, item.y, item.string, item.end), "affe_recorder_text_draw failed");
+
+			affe_recorder_set_size(ctx, recorder, 16.0f);
+			affe_recorder_set_color(ctx, recorder, 1.0f, 1.0f, 1.0f, 1.0f);
+		}
+
+		affe_recorder_submit(ctx, &recorder, 1);
+		TEST_CHECK(test_checksum(ctx) == expected, "affe_recorder_submit differs from affe_text_draw");
+
+		affe_recorder_delete(ctx, recorder);
+	}
+
+	// The first frame keeps the draws, the second copies them
+	affe_draw_cache(ctx, true);
+
+	for (int frame = 0; frame < 2; ++frame)
+	{
+		draw_plain();
+		TEST_CHECK(test_checksum(ctx) == expected, "frame %d with the draw cache differs from affe_text_draw", frame);
+		affe_frame_end(ctx);
+	}
+
+	affe_draw_cache(ctx, false);
+}
+
+// Vertices of the last `draw_proc` call
+struct test_capture
+{
+	std::vector<affe_vertex> verts;
+};
+
+static void test_capture_draw(affe_context*, void* user_ptr, affe_vertex* verts, long long verts_count)
+{
+	test_capture* capture = (test_capture*)user_ptr;
+	capture->verts.assign(verts, verts + verts_count);
+}
+
+static bool test_near(float a, float b)
+{
+	return a - b < 0.001f && b - a < 0.001f;
+}
+
+// One glyph with a known color and pen, the six vertices must match the glyph's quad
+// The other tests only compare draw paths against each other, all of them share the vertex stores
+static void test_glyph_vertices(const std::vector<unsigned char>& font_data)
+{
+	test_capture capture;
+
+	affe_context_create_info info;
+	memset(&info, 0, sizeof(affe_context_create_info));
+
+	info.width = 512;
+	info.height = 512;
+	info.user_ptr = &capture;
+	info.draw_proc = &test_capture_draw;
+	info.buffer_quad_count = 16;
+	info.edge_value = 0.8f;
+	info.padding = 2;
+	info.size = 32.0f;
+
+	affe_context* ctx = affe_context_create(&info);
+	TEST_CHECK(ctx != NULL, "affe_context_create failed");
+	if (!ctx) return;
+
+	affe_set_font(ctx, affe_font_add(ctx, (void*)font_data.data(), 0, false));
+	affe_set_size(ctx, 24.0f);
+	affe_set_color(ctx, 0.25f, 0.5f, 0.75f, 1.0f);
+	affe_set_alignment(ctx, AFFE_ALIGN_LEFT);
+
+	affe_glyph_quad glyph;
+	TEST_CHECK(affe_glyph_get(ctx, 'H', &glyph), "affe_glyph_get failed");
+
+	// Left aligned text starts at its ink, so the pen is taken from `affe_text_quads`, which skips the vertex stores
+	const float x = 100.0f, y = 200.0f;
+	affe_text_quad quad = {};
+	long long written = 0;
+	TEST_CHECK(affe_text_quads(ctx, x, y, "H", NULL, &quad, 1, &written) && written == 1, "affe_text_quads failed");
+
+	const float pen = quad.x0 - glyph.x0;
+	TEST_CHECK(test_near(quad.x1, pen + glyph.x1) && test_near(quad.y0, y + glyph.y0) && test_near(quad.y1, y + glyph.y1), "the quad of 'H' does not match affe_glyph_get");
+	TEST_CHECK(pen <= x, "left aligned text starts right of its pen");
+
+	affe_text_draw(ctx, x, y, "H", NULL);
+	affe_buffer_flush(ctx);
+
+	TEST_CHECK(capture.verts.size() == 6, "one glyph draws %d vertices instead of 6", (int)capture.verts.size());
+
+	if (capture.verts.size() == 6)
+	{
+		// Two triangles: (x0, y1) (x0, y0) (x1, y1) and (x1, y1) (x0, y0) (x1, y0)
+		const float corners[6][4] =
+		{
+			{ pen + glyph.x0, y + glyph.y1, glyph.s0, glyph.t1 },
+			{ pen + glyph.x0, y + glyph.y0, glyph.s0, glyph.t0 },
+			{ pen + glyph.x1, y + glyph.y1, glyph.s1, glyph.t1 },
+			{ pen + glyph.x1, y + glyph.y1, glyph.s1, glyph.t1 },
+			{ pen + glyph.x0, y + glyph.y0, glyph.s0, glyph.t0 },
+			{ pen + glyph.x1, y + glyph.y0, glyph.s1, glyph.t0 },
+		};
+
+		for (int i = 0; i < 6; ++i)
+		{
+			const affe_vertex& v = capture.verts[(size_t)i];
+
+			TEST_CHECK(test_near(v.x, corners[i][0]) && test_near(v.y, corners[i][1]) && test_near(v.s, corners[i][2]) && test_near(v.t, corners[i][3]),
+				"vertex %d is at %g %g %g %g instead of %g %g %g %g", i, v.x, v.y, v.s, v.t, corners[i][0], corners[i][1], corners[i][2], corners[i][3]);
+			TEST_CHECK(v.r == 0.25f && v.g == 0.5f && v.b == 0.75f && v.a == 1.0f, "vertex %d has color %g %g %g %g instead of 0.25 0.5 0.75 1", i, v.r, v.g, v.b, v.a);
+		}
+	}
+
+	affe_context_delete(ctx);
+}
+
+// Text whose glyphs do not fit the atlas together invalidates it on every attempt, nothing stale may be written
+static void test_emit_atlas_full(const std::vector<unsigned char>& font_data)
+{
+	affe_context* ctx = affe_null_context_create(64, 64, 64, 2, 32);
+	TEST_CHECK(ctx != NULL, "affe_null_context_create failed");
+	if (!ctx) return;
+
+	affe_set_font(ctx, affe_font_add(ctx, (void*)font_data.data(), 0, false));
+	affe_set_size(ctx, 32.0f);
+
+	const char* text = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+	std::vector<affe_text_quad> quads(64);
+	long long written = -1;
+	const int result = affe_text_quads(ctx, 0.0f, 100.0f, text, NULL, quads.data(), (long long)quads.size(), &written);
+
+	TEST_CHECK(!result && written == 0, "affe_text_quads returns %d with %lld quads for text larger than the atlas", result, written);
+
+	affe_null_context_delete(ctx);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s <font.ttf>\n", argv[0]);
+		return 2;
+	}
+
+	std::vector<unsigned char> font_data;
+
+	if (!test_read_file(argv[1], font_data))
+	{
+		fprintf(stderr, "failed to read %s\n", argv[1]);
+		return 2;
+	}
+
+	affe_context* ctx = affe_null_context_create(1024, 1024, 512, 2, 32);
+
+	if (!ctx)
+	{
+		fprintf(stderr, "failed to create the context\n");
+		return 2;
+	}
+
+	int font = affe_font_add(ctx, font_data.data(), 0, false);
+
+	if (font == AFFE_INVALID)
+	{
+		fprintf(stderr, "failed to load %s\n", argv[1]);
+		affe_null_context_delete(ctx);
+		return 2;
+	}
+
+	affe_viewport(ctx, 1280, 720);
+
+	test_paragraph_edit(ctx, font);
+	test_document_chunks(ctx, font);
+	test_draw_paths(ctx, font);
+	test_glyph_vertices(font_data);
+	test_emit_atlas_full(font_data);
+
+	affe_null_context_delete(ctx);
+
+	if (g_failures) fprintf(stderr, "%d check(s) failed\n", g_failures);
+	else printf("all tests passed\n");
+
+	return g_failures ? 1 : 0;
+}